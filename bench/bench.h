@@ -0,0 +1,130 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BENCH_H
+#define __BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+/* Helpers shared by the programs in bench/, so they all read the same
+ * clock and compute the latency percentiles the same way.
+ */
+
+/* Output formats of the programs that take --format */
+
+typedef enum {
+  FORMAT_TEXT,
+  FORMAT_CSV,
+  FORMAT_JSON,
+} format_t;
+
+/* Latency percentiles of a set of timed calls, in nanoseconds */
+
+typedef struct {
+  uint64_t p50;
+  uint64_t p99;
+  uint64_t p999;
+  uint64_t max;
+} bench_lat_t;
+
+static inline uint64_t bench_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline double bench_now_sec(void)
+{
+  return bench_now_ns() / 1e9;
+}
+
+/**
+ * bench_parse_format() - Parse the argument of --format.
+ *
+ * @name: text, csv or json.
+ * @format: Output format.
+ *
+ * Return: true if the name is a known format.
+ */
+static inline bool bench_parse_format(const char *name, format_t *format)
+{
+  if (!strcmp(name, "text"))
+    *format = FORMAT_TEXT;
+  else if (!strcmp(name, "csv"))
+    *format = FORMAT_CSV;
+  else if (!strcmp(name, "json"))
+    *format = FORMAT_JSON;
+  else
+    return false;
+
+  return true;
+}
+
+static int bench_cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+/**
+ * bench_percentile() - Get a percentile of sorted samples.
+ *
+ * @lat: The samples in ascending order.
+ * @num: The number of samples, at least one.
+ * @per_mille: The percentile in tenths of a percent.
+ *
+ * Return: The sample below which per_mille / 1000 of the samples fall.
+ */
+static inline uint64_t bench_percentile(const uint64_t *lat, size_t num,
+                                        unsigned int per_mille)
+{
+  size_t idx = num * per_mille / 1000;
+
+  return lat[idx < num ? idx : num - 1];
+}
+
+/**
+ * bench_latency() - Sort latency samples and take their percentiles.
+ *
+ * @lat: The samples, sorted in place.
+ * @num: The number of samples.
+ * @res: Output percentiles, all zero without samples.
+ */
+static inline void bench_latency(uint64_t *lat, size_t num, bench_lat_t *res)
+{
+  memset(res, 0, sizeof(*res));
+  if (num == 0)
+    return;
+
+  qsort(lat, num, sizeof(uint64_t), bench_cmp_u64);
+  res->p50 = bench_percentile(lat, num, 500);
+  res->p99 = bench_percentile(lat, num, 990);
+  res->p999 = bench_percentile(lat, num, 999);
+  res->max = lat[num - 1];
+}
+
+#endif /* __BENCH_H */
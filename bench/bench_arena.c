@@ -0,0 +1,133 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Compare the ways to release the scratch memory of a request: every
+ * object released on its own with s_free, all of them with s_free_batch,
+ * or the whole arena reset at once, keeping its chunks or giving them
+ * back to the heap.
+ *
+ * Usage: bench_arena [objects_per_request]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+#include "s_heap.h"
+#include "s_arena.h"
+
+#define HEAP_SIZE     (256 * 1024 * 1024)
+#define MAX_OBJECTS   (4096)
+#define REQUESTS      (20000)
+#define MAX_ALLOC     (256)
+
+typedef enum {
+  SCRATCH_FREE,
+  SCRATCH_FREE_BATCH,
+  SCRATCH_ARENA_KEEP,
+  SCRATCH_ARENA_RELEASE,
+} scratch_t;
+
+static double run(heap_t *heap, size_t objects, scratch_t scratch)
+{
+  static void *ptrs[MAX_OBJECTS];
+  unsigned int seed = 1;
+  s_arena_t arena;
+  double start;
+
+  s_arena_init(&arena, heap, 0);
+  start = bench_now_sec();
+
+  for (int req = 0; req < REQUESTS; req++)
+  {
+    for (size_t i = 0; i < objects; i++)
+    {
+      size_t len = 16 + rand_r(&seed) % MAX_ALLOC;
+
+      if (scratch == SCRATCH_FREE || scratch == SCRATCH_FREE_BATCH)
+        ptrs[i] = s_alloc(len, heap);
+      else
+        ptrs[i] = s_arena_alloc(len, &arena);
+
+      if (ptrs[i] == NULL)
+        exit(1);
+      *(uint8_t *)ptrs[i] = 1;
+    }
+
+    switch (scratch)
+    {
+    case SCRATCH_FREE:
+      for (size_t i = 0; i < objects; i++)
+        s_free(ptrs[i], heap);
+      break;
+
+    case SCRATCH_FREE_BATCH:
+      s_free_batch(ptrs, objects, heap);
+      break;
+
+    default:
+      s_arena_reset(&arena, scratch == SCRATCH_ARENA_KEEP);
+      break;
+    }
+  }
+
+  s_arena_destroy(&arena);
+
+  return (double)REQUESTS * objects / (bench_now_sec() - start);
+}
+
+int main(int argc, char **argv)
+{
+  static uint8_t memory[HEAP_SIZE];
+  size_t objects = argc > 1 ? strtoul(argv[1], NULL, 0) : 512;
+  static const struct {
+    const char *name;
+    s_heap_mode_t mode;
+  } modes[] = {
+    { "segregated", S_HEAP_MODE_SEGREGATED },
+    { "tlsf", S_HEAP_MODE_TLSF },
+  };
+
+  if (objects == 0 || objects > MAX_OBJECTS)
+    objects = 512;
+
+  printf("objects=%zu\n", objects);
+  printf("%-12s %14s %14s %14s %14s\n", "heap", "free_obj/s", "batch_obj/s",
+         "keep_obj/s", "release_obj/s");
+
+  for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+  {
+    heap_t heap;
+    double res[4];
+
+    s_init_mode(&heap, memory, memory + HEAP_SIZE, modes[i].mode);
+    for (int s = SCRATCH_FREE; s <= SCRATCH_ARENA_RELEASE; s++)
+      res[s] = run(&heap, objects, s);
+    s_heap_destroy(&heap);
+
+    printf("%-12s %14.0f %14.0f %14.0f %14.0f\n", modes[i].name, res[0],
+           res[1], res[2], res[3]);
+  }
+
+  return 0;
+}
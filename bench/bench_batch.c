@@ -0,0 +1,128 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Compare bursts of allocations and frees done with a loop of single calls
+ * against s_alloc_batch and s_free_batch. A few bursts stay alive at any
+ * time so the heap is not empty between two bursts.
+ *
+ * Usage: bench_batch [burst_size]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+#include "s_heap.h"
+
+#define HEAP_SIZE     (256 * 1024 * 1024)
+#define MAX_BURST     (1024)
+#define LIVE_BURSTS   (16)
+#define ROUNDS        (20000)
+#define MAX_ALLOC     (512)
+
+static double run(heap_t *heap, size_t burst, bool batch)
+{
+  static void *live[LIVE_BURSTS][MAX_BURST];
+  static size_t sizes[MAX_BURST];
+  unsigned int seed = 1;
+  double start;
+
+  memset(live, 0, sizeof(live));
+  start = bench_now_sec();
+
+  for (int round = 0; round < ROUNDS; round++)
+  {
+    void **ptrs = live[round % LIVE_BURSTS];
+
+    if (batch)
+      s_free_batch(ptrs, burst, heap);
+    else
+    {
+      for (size_t i = 0; i < burst; i++)
+        s_free(ptrs[i], heap);
+    }
+
+    for (size_t i = 0; i < burst; i++)
+      sizes[i] = 16 + rand_r(&seed) % MAX_ALLOC;
+
+    if (batch)
+    {
+      if (s_alloc_batch(burst, sizes, ptrs, heap) != 0)
+        exit(1);
+    }
+    else
+    {
+      for (size_t i = 0; i < burst; i++)
+      {
+        ptrs[i] = s_alloc(sizes[i], heap);
+        if (ptrs[i] == NULL)
+          exit(1);
+      }
+    }
+  }
+
+  for (int i = 0; i < LIVE_BURSTS; i++)
+    s_free_batch(live[i], burst, heap);
+
+  return 2.0 * ROUNDS * burst / (bench_now_sec() - start);
+}
+
+int main(int argc, char **argv)
+{
+  static uint8_t memory[HEAP_SIZE];
+  size_t burst = argc > 1 ? strtoul(argv[1], NULL, 0) : 256;
+  static const struct {
+    const char *name;
+    s_heap_mode_t mode;
+    bool thread_safe;
+  } configs[] = {
+    { "segregated", S_HEAP_MODE_SEGREGATED, false },
+    { "tlsf", S_HEAP_MODE_TLSF, false },
+    { "segregated-mt", S_HEAP_MODE_SEGREGATED, true },
+    { "tlsf-mt", S_HEAP_MODE_TLSF, true },
+  };
+
+  if (burst == 0 || burst > MAX_BURST)
+    burst = 256;
+
+  printf("burst=%zu\n", burst);
+  printf("%-14s %14s %14s\n", "heap", "single_ops/s", "batch_ops/s");
+
+  for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++)
+  {
+    heap_t heap;
+    double single, batch;
+
+    s_init_mode(&heap, memory, memory + HEAP_SIZE, configs[i].mode);
+    if (configs[i].thread_safe)
+      s_heap_set_thread_safe(&heap);
+
+    single = run(&heap, burst, false);
+    batch = run(&heap, burst, true);
+    s_heap_destroy(&heap);
+
+    printf("%-14s %14.0f %14.0f\n", configs[i].name, single, batch);
+  }
+
+  return 0;
+}
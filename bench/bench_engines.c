@@ -0,0 +1,104 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Compare the latency of the allocation engines on a fragmenting workload.
+ * Every s_alloc and s_free call is timed and the worst case is reported
+ * next to the median and the 99th percentile.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+#include "s_heap.h"
+
+#define HEAP_SIZE     (64 * 1024 * 1024)
+#define NUM_SLOTS     (16384)
+#define NUM_OPS       (1000000)
+#define MAX_ALLOC     (4096)
+
+static uint64_t g_alloc_lat[NUM_OPS];
+static uint64_t g_free_lat[NUM_OPS];
+static void *g_slots[NUM_SLOTS];
+
+static void report(const char *engine, const char *op,
+                   uint64_t *lat, size_t n)
+{
+  bench_lat_t res;
+
+  if (n == 0)
+    return;
+
+  bench_latency(lat, n, &res);
+  printf("%-10s %-6s ops=%-8zu p50=%-6llu p99=%-6llu max=%llu ns\n",
+         engine, op, n,
+         (unsigned long long)res.p50,
+         (unsigned long long)res.p99,
+         (unsigned long long)res.max);
+}
+
+static void run(const char *engine, s_heap_mode_t mode)
+{
+  static heap_t heap;
+  size_t num_alloc = 0, num_free = 0;
+  void *region = malloc(HEAP_SIZE);
+
+  if (region == NULL)
+    return;
+
+  s_init_mode(&heap, region, (uint8_t *)region + HEAP_SIZE, mode);
+  memset(g_slots, 0, sizeof(g_slots));
+  srand(1);
+
+  for (int i = 0; i < NUM_OPS; i++)
+  {
+    int slot = rand() % NUM_SLOTS;
+    uint64_t start;
+
+    if (g_slots[slot] == NULL)
+    {
+      size_t len = 1 + rand() % MAX_ALLOC;
+
+      start = bench_now_ns();
+      g_slots[slot] = s_alloc(len, &heap);
+      g_alloc_lat[num_alloc++] = bench_now_ns() - start;
+    }
+    else
+    {
+      start = bench_now_ns();
+      s_free(g_slots[slot], &heap);
+      g_free_lat[num_free++] = bench_now_ns() - start;
+      g_slots[slot] = NULL;
+    }
+  }
+
+  report(engine, "alloc", g_alloc_lat, num_alloc);
+  report(engine, "free", g_free_lat, num_free);
+
+  free(region);
+}
+
+int main(void)
+{
+  run("segregated", S_HEAP_MODE_SEGREGATED);
+  run("tlsf", S_HEAP_MODE_TLSF);
+  return 0;
+}
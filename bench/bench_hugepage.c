@@ -0,0 +1,186 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Chase pointers through small objects allocated by the slab layer, once on
+ * a heap backed by 4K pages and once on a heap created with s_init_huge.
+ * The objects are interleaved with larger chunks so that on the 4K heap
+ * the runs are spread over the whole region. The dTLB load misses are read
+ * from the kernel performance counters when they are available.
+ *
+ * Usage: bench_hugepage [num_objects]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "bench.h"
+#include "s_heap.h"
+#include "s_slab.h"
+
+#define HEAP_SIZE     (1024UL * 1024 * 1024)
+#define NUM_OBJECTS   (1 << 20)
+#define OBJECT_SIZE   (64)
+#define FILLER_EVERY  (8)
+#define FILLER_SIZE   (4096)
+#define HOPS          (1 << 24)
+
+typedef struct obj_s {
+  struct obj_s *next;
+} obj_t;
+
+static int dtlb_open(void)
+{
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB |
+    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void run(const char *name, heap_t *heap, int num_objects)
+{
+  s_slab_t slab;
+  obj_t **objs = malloc(num_objects * sizeof(obj_t *));
+  void **fillers = malloc(num_objects / FILLER_EVERY * sizeof(void *));
+  unsigned int seed = 1;
+  long long misses = -1;
+  volatile obj_t *cur;
+  double start, elapsed;
+  int fd, i;
+
+  if (objs == NULL || fillers == NULL || s_slab_init(&slab, heap) != 0)
+  {
+    printf("%-6s setup failed\n", name);
+    exit(1);
+  }
+
+  for (i = 0; i < num_objects; i++)
+  {
+    if (i % FILLER_EVERY == 0)
+      fillers[i / FILLER_EVERY] = s_alloc(FILLER_SIZE, heap);
+
+    objs[i] = s_slab_alloc(OBJECT_SIZE, &slab);
+    if (objs[i] == NULL)
+    {
+      printf("%-6s heap exhausted\n", name);
+      exit(1);
+    }
+  }
+
+  /* Link the objects in a random cycle */
+
+  for (i = num_objects - 1; i > 0; i--)
+  {
+    int j = rand_r(&seed) % (i + 1);
+    obj_t *tmp = objs[i];
+
+    objs[i] = objs[j];
+    objs[j] = tmp;
+  }
+
+  for (i = 0; i < num_objects; i++)
+    objs[i]->next = objs[(i + 1) % num_objects];
+
+  fd = dtlb_open();
+  if (fd >= 0)
+  {
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+
+  cur = objs[0];
+  start = bench_now_sec();
+  for (i = 0; i < HOPS; i++)
+    cur = cur->next;
+  elapsed = bench_now_sec() - start;
+
+  if (fd >= 0)
+  {
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+      misses = -1;
+    close(fd);
+  }
+
+  if (misses >= 0)
+    printf("%-6s %8.2f ns/hop  dtlb_misses/hop=%.3f\n", name,
+           elapsed * 1e9 / HOPS, (double)misses / HOPS);
+  else
+    printf("%-6s %8.2f ns/hop  dtlb_misses/hop=n/a\n", name,
+           elapsed * 1e9 / HOPS);
+
+  for (i = 0; i < num_objects; i++)
+    s_slab_free(objs[i], &slab);
+
+  for (i = 0; i < num_objects / FILLER_EVERY; i++)
+    s_free(fillers[i], heap);
+
+  s_slab_destroy(&slab);
+  free(fillers);
+  free(objs);
+}
+
+int main(int argc, char **argv)
+{
+  int num_objects = argc > 1 ? atoi(argv[1]) : NUM_OBJECTS;
+  heap_t small_heap, huge_heap;
+  uint8_t *map;
+
+  if (num_objects <= 0)
+    num_objects = NUM_OBJECTS;
+
+  map = mmap(NULL, HEAP_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED)
+    return 1;
+
+#ifdef MADV_NOHUGEPAGE
+  madvise(map, HEAP_SIZE, MADV_NOHUGEPAGE);
+#endif
+
+  s_init(&small_heap, map, map + HEAP_SIZE);
+  if (s_init_huge(&huge_heap, HEAP_SIZE, NULL) != 0)
+    return 1;
+
+  printf("objects=%d size=%d hops=%d\n", num_objects, OBJECT_SIZE, HOPS);
+  run("4k", &small_heap, num_objects);
+  run("huge", &huge_heap, num_objects);
+
+  s_heap_destroy(&huge_heap);
+  munmap(map, HEAP_SIZE);
+
+  return 0;
+}
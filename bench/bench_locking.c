@@ -0,0 +1,138 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Measure how allocation throughput scales with the number of threads when
+ * the heap is protected by a single global mutex and when it runs in its
+ * built-in thread-safe mode. Every thread works with a different range of
+ * sizes so the built-in locks can keep the threads apart.
+ *
+ * Usage: bench_locking [max_threads]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "bench.h"
+#include "s_heap.h"
+
+#define HEAP_SIZE     (256 * 1024 * 1024)
+#define OPS_PER_THREAD (1000000)
+#define LIVE_SLOTS    (64)
+#define MIN_ALLOC     (16)
+
+typedef struct {
+  heap_t *heap;
+  bool use_mutex;
+  unsigned int seed;
+  size_t min_len;
+} worker_arg_t;
+
+static heap_t g_heap;
+static heap_t g_ts_heap;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *worker(void *arg)
+{
+  worker_arg_t *wa = arg;
+  void *slots[LIVE_SLOTS] = { NULL };
+  unsigned int seed = wa->seed;
+
+  for (int i = 0; i < OPS_PER_THREAD; i++)
+  {
+    int slot = rand_r(&seed) % LIVE_SLOTS;
+    size_t len = wa->min_len + rand_r(&seed) % wa->min_len;
+
+    if (wa->use_mutex)
+      pthread_mutex_lock(&g_lock);
+
+    s_free(slots[slot], wa->heap);
+    slots[slot] = s_alloc(len, wa->heap);
+
+    if (wa->use_mutex)
+      pthread_mutex_unlock(&g_lock);
+  }
+
+  for (int i = 0; i < LIVE_SLOTS; i++)
+  {
+    if (wa->use_mutex)
+      pthread_mutex_lock(&g_lock);
+
+    s_free(slots[i], wa->heap);
+
+    if (wa->use_mutex)
+      pthread_mutex_unlock(&g_lock);
+  }
+
+  return NULL;
+}
+
+static double run(int num_threads, heap_t *heap, bool use_mutex)
+{
+  pthread_t threads[num_threads];
+  worker_arg_t args[num_threads];
+  double start = bench_now_sec();
+
+  for (int i = 0; i < num_threads; i++)
+  {
+    args[i].heap = heap;
+    args[i].use_mutex = use_mutex;
+    args[i].seed = i + 1;
+    args[i].min_len = MIN_ALLOC << (i % 8);
+    pthread_create(&threads[i], NULL, worker, &args[i]);
+  }
+
+  for (int i = 0; i < num_threads; i++)
+    pthread_join(threads[i], NULL);
+
+  return (2.0 * OPS_PER_THREAD * num_threads) / (bench_now_sec() - start);
+}
+
+int main(int argc, char **argv)
+{
+  int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+  void *region = malloc(HEAP_SIZE);
+  void *ts_region = malloc(HEAP_SIZE);
+
+  if (region == NULL || ts_region == NULL)
+    return 1;
+
+  s_init_mode(&g_heap, region, (uint8_t *)region + HEAP_SIZE,
+              S_HEAP_MODE_TLSF);
+  s_init_mode(&g_ts_heap, ts_region, (uint8_t *)ts_region + HEAP_SIZE,
+              S_HEAP_MODE_TLSF);
+  s_heap_set_thread_safe(&g_ts_heap);
+
+  printf("threads  mutex_ops/s  thread_safe_ops/s\n");
+  for (int n = 1; n <= max_threads; n *= 2)
+  {
+    double mutex_ops = run(n, &g_heap, true);
+    double ts_ops = run(n, &g_ts_heap, false);
+
+    printf("%-8d %-12.0f %-12.0f\n", n, mutex_ops, ts_ops);
+  }
+
+  free(ts_region);
+  free(region);
+  return 0;
+}
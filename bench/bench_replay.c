@@ -0,0 +1,625 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Replay a trace written by s_heap_trace_start() on several heap
+ * configurations and on the C library malloc, and report for each one the
+ * throughput, the peak footprint and the fragmentation.
+ *
+ * The chunk addresses of the trace are first turned into dense ids, so a
+ * replay only indexes a table of chunks. The calls are replayed one after
+ * the other on a single thread, in the order of the trace. Every
+ * configuration is run twice: once untimed for the ops/s and once with
+ * the heap sampled every SAMPLE_EVERY calls for the peak footprint, the
+ * free bytes between the live chunks and the fragmentation index at that
+ * peak. The footprint of malloc is taken from mallinfo2 and it has no
+ * fragmentation index.
+ *
+ * Usage: bench_replay [--format text|csv|json] [--heap name]
+ *                     [--block-size N] trace
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bench.h"
+#include "s_heap.h"
+
+#define HEAP_SIZE       (1024UL * 1024 * 1024)
+#define GROW_SIZE       (256UL * 1024 * 1024)
+#define SAMPLE_EVERY    (256)
+#define NO_ID           (UINT32_MAX)
+
+typedef enum {
+  R_ALLOC,
+  R_ALIGNED_ALLOC,
+  R_CALLOC,
+  R_REALLOC,
+  R_FREE,
+} r_op_t;
+
+/* A call of the trace with the chunk address replaced by an id */
+
+typedef struct {
+  uint32_t op;
+  uint32_t id;
+  uint64_t size;
+  uint64_t align;
+} r_call_t;
+
+typedef struct {
+  r_call_t *calls;
+  size_t num_calls;
+  uint32_t num_ids;
+  size_t records;
+  size_t dropped;       /* Records that do not match a live chunk */
+  size_t peak_live;     /* Largest sum of the requested sizes */
+} replay_t;
+
+/* The allocator a trace is replayed on */
+
+typedef struct {
+  const char *name;
+  bool libc;
+  s_heap_mode_t mode;
+  bool defer;
+} target_t;
+
+typedef struct {
+  const char *heap;
+  size_t calls;
+  double ops_per_sec;
+  size_t peak_live;
+  size_t peak_bytes;
+  size_t hole_bytes;
+  uint32_t fragmentation;
+  bool has_frag;
+} result_t;
+
+/* Chunk address to id, open addressing with linear probing */
+
+typedef struct {
+  uint64_t *keys;
+  uint32_t *ids;
+  size_t mask;
+  size_t used;
+} id_map_t;
+
+static void *map_array(size_t len)
+{
+  void *ptr = mmap(NULL, len ? len : 1, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (ptr == MAP_FAILED)
+  {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  return ptr;
+}
+
+static void unmap_array(void *ptr, size_t len)
+{
+  munmap(ptr, len ? len : 1);
+}
+
+static inline size_t map_slot(const id_map_t *map, uint64_t key)
+{
+  return (key * 0x9E3779B97F4A7C15ULL >> 17) & map->mask;
+}
+
+static void map_init(id_map_t *map, size_t cap)
+{
+  map->keys = calloc(cap, sizeof(uint64_t));
+  map->ids = calloc(cap, sizeof(uint32_t));
+  map->mask = cap - 1;
+  map->used = 0;
+
+  if (map->keys == NULL || map->ids == NULL)
+  {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+}
+
+static void map_put(id_map_t *map, uint64_t key, uint32_t id);
+
+static void map_grow(id_map_t *map)
+{
+  id_map_t old = *map;
+
+  map_init(map, (old.mask + 1) * 2);
+  for (size_t i = 0; i <= old.mask; i++)
+  {
+    if (old.keys[i] != 0)
+      map_put(map, old.keys[i], old.ids[i]);
+  }
+
+  free(old.keys);
+  free(old.ids);
+}
+
+static void map_put(id_map_t *map, uint64_t key, uint32_t id)
+{
+  size_t i;
+
+  if ((map->used + 1) * 2 > map->mask + 1)
+    map_grow(map);
+
+  for (i = map_slot(map, key); map->keys[i] != 0; i = (i + 1) & map->mask)
+  {
+    if (map->keys[i] == key)
+    {
+      map->ids[i] = id;
+      return;
+    }
+  }
+
+  map->keys[i] = key;
+  map->ids[i] = id;
+  map->used++;
+}
+
+/* Remove a key and return its id, the entries after it are shifted back
+ * so no probe sequence is broken.
+ */
+
+static uint32_t map_take(id_map_t *map, uint64_t key)
+{
+  size_t i, j, home;
+  uint32_t id;
+
+  for (i = map_slot(map, key); map->keys[i] != key; i = (i + 1) & map->mask)
+  {
+    if (map->keys[i] == 0)
+      return NO_ID;
+  }
+
+  id = map->ids[i];
+  for (j = (i + 1) & map->mask; map->keys[j] != 0; j = (j + 1) & map->mask)
+  {
+    home = map_slot(map, map->keys[j]);
+    if (((j - home) & map->mask) >= ((j - i) & map->mask))
+    {
+      map->keys[i] = map->keys[j];
+      map->ids[i] = map->ids[j];
+      i = j;
+    }
+  }
+
+  map->keys[i] = 0;
+  map->used--;
+  return id;
+}
+
+/* Read a trace and give every chunk an id that stays the same when
+ * s_realloc moves it. A release or a s_realloc of a chunk the trace never
+ * allocated, made before the trace started, is dropped, a s_realloc of
+ * such a chunk is replayed as an allocation.
+ */
+
+static void load_trace(const char *path, replay_t *replay)
+{
+  const s_heap_trace_hdr_t *hdr;
+  const s_heap_trace_rec_t *recs;
+  uint64_t *live_size;
+  struct stat st;
+  uint8_t *file;
+  size_t live = 0, id_cap;
+  id_map_t map;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(*hdr))
+  {
+    fprintf(stderr, "cannot read %s\n", path);
+    exit(1);
+  }
+
+  file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  hdr = (const s_heap_trace_hdr_t *)file;
+  if (file == MAP_FAILED || hdr->magic != S_HEAP_TRACE_MAGIC ||
+      hdr->version != S_HEAP_TRACE_VERSION ||
+      hdr->rec_size != sizeof(s_heap_trace_rec_t))
+  {
+    fprintf(stderr, "%s is not a s_heap trace\n", path);
+    exit(1);
+  }
+
+  memset(replay, 0, sizeof(*replay));
+  recs = (const s_heap_trace_rec_t *)(hdr + 1);
+  replay->records = (st.st_size - sizeof(*hdr)) / sizeof(*recs);
+  replay->calls = map_array(replay->records * sizeof(r_call_t));
+
+  /* There are at most as many ids as records */
+
+  id_cap = replay->records;
+  live_size = map_array(id_cap * sizeof(uint64_t));
+  map_init(&map, 1024);
+
+  for (size_t i = 0; i < replay->records; i++)
+  {
+    const s_heap_trace_rec_t *rec = &recs[i];
+    r_call_t call = { .size = rec->size };
+    uint32_t id;
+
+    switch (rec->op)
+    {
+    case S_HEAP_OP_ALLOC:
+    case S_HEAP_OP_ALIGNED_ALLOC:
+    case S_HEAP_OP_CALLOC:
+      call.op = rec->op == S_HEAP_OP_ALLOC ? R_ALLOC :
+                rec->op == S_HEAP_OP_CALLOC ? R_CALLOC : R_ALIGNED_ALLOC;
+      call.align = rec->op == S_HEAP_OP_ALIGNED_ALLOC ? rec->arg : 0;
+
+      /* The address is still live when another thread got it back before
+       * the s_realloc that released it was logged, the old id leaks.
+       */
+
+      if (map_take(&map, rec->ptr) != NO_ID)
+        replay->dropped++;
+
+      call.id = replay->num_ids++;
+      map_put(&map, rec->ptr, call.id);
+      live += rec->size;
+      live_size[call.id] = rec->size;
+      break;
+
+    case S_HEAP_OP_REALLOC:
+      call.op = R_REALLOC;
+      id = rec->arg != 0 ? map_take(&map, rec->arg) : NO_ID;
+      if (rec->arg != 0 && id == NO_ID)
+      {
+        replay->dropped++;
+        call.op = R_ALLOC;
+      }
+
+      if (id == NO_ID)
+        id = replay->num_ids++;
+      else
+        live -= live_size[id];
+
+      if (map_take(&map, rec->ptr) != NO_ID)
+        replay->dropped++;
+
+      call.id = id;
+      map_put(&map, rec->ptr, id);
+      live += rec->size;
+      live_size[id] = rec->size;
+      break;
+
+    case S_HEAP_OP_FREE:
+      call.op = R_FREE;
+      call.id = map_take(&map, rec->ptr);
+      if (call.id == NO_ID)
+      {
+        replay->dropped++;
+        continue;
+      }
+
+      live -= live_size[call.id];
+      break;
+
+    default:
+      replay->dropped++;
+      continue;
+    }
+
+    if (live > replay->peak_live)
+      replay->peak_live = live;
+    replay->calls[replay->num_calls++] = call;
+  }
+
+  free(map.keys);
+  free(map.ids);
+  unmap_array(live_size, id_cap * sizeof(uint64_t));
+  munmap(file, st.st_size);
+}
+
+/* The footprint of a heap: the memory the OS had to provide */
+
+static void sample(const target_t *target, heap_t *heap, size_t base,
+                   result_t *res)
+{
+  size_t footprint, holes;
+  uint32_t frag = 0;
+
+  if (target->libc)
+  {
+    struct mallinfo2 info = mallinfo2();
+
+    /* The arena does not shrink, count the top chunk as the wilderness */
+
+    footprint = info.arena - info.keepcost + info.hblkhd;
+    footprint = footprint > base ? footprint - base : 0;
+    holes = info.fordblks - info.keepcost;
+  }
+  else
+  {
+    s_heap_stats_t stats;
+
+    s_heap_stats(heap, &stats);
+    footprint = stats.total_bytes - stats.wild_bytes;
+    holes = stats.free_bytes - stats.wild_bytes;
+    frag = stats.fragmentation;
+  }
+
+  if (footprint > res->peak_bytes)
+  {
+    res->peak_bytes = footprint;
+    res->hole_bytes = holes;
+    res->fragmentation = frag;
+  }
+}
+
+static double run_once(const target_t *target, const replay_t *replay,
+                       size_t block_size, void **chunks, bool sampled,
+                       result_t *res)
+{
+  static heap_t heap;
+  s_heap_config_t config = {
+    .mode = target->mode,
+    .block_size = block_size,
+    .zeroed = true,
+    .grow_size = GROW_SIZE,
+    .defer_coalescing = target->defer,
+  };
+  uint8_t *region = NULL;
+  size_t base = 0;
+  uint64_t start;
+  double elapsed;
+
+  if (target->libc)
+  {
+    struct mallinfo2 info;
+
+    /* Leave out what this program itself allocated */
+
+    malloc_trim(0);
+    info = mallinfo2();
+    base = info.uordblks + info.hblkhd;
+  }
+  else
+  {
+    region = mmap(NULL, HEAP_SIZE, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED || s_init_ex(&heap, region, region + HEAP_SIZE,
+                                          &config) != 0)
+    {
+      fprintf(stderr, "cannot create the heap\n");
+      exit(1);
+    }
+  }
+
+  start = bench_now_ns();
+
+  for (size_t i = 0; i < replay->num_calls; i++)
+  {
+    const r_call_t *call = &replay->calls[i];
+    void **chunk = &chunks[call->id];
+
+    switch (call->op)
+    {
+    case R_ALLOC:
+      *chunk = target->libc ? malloc(call->size) : s_alloc(call->size, &heap);
+      break;
+
+    case R_ALIGNED_ALLOC:
+      *chunk = target->libc ? aligned_alloc(call->align, call->size) :
+               s_aligned_alloc(call->align, call->size, &heap);
+      break;
+
+    case R_CALLOC:
+      *chunk = target->libc ? calloc(1, call->size) :
+               s_calloc(1, call->size, &heap);
+      break;
+
+    case R_REALLOC:
+      *chunk = target->libc ? realloc(*chunk, call->size) :
+               s_realloc(*chunk, call->size, &heap);
+      break;
+
+    default:
+      if (target->libc)
+        free(*chunk);
+      else
+        s_free(*chunk, &heap);
+      *chunk = NULL;
+      continue;
+    }
+
+    if (*chunk == NULL && call->size != 0)
+    {
+      fprintf(stderr, "%s: heap exhausted\n", target->name);
+      exit(1);
+    }
+
+    /* Touch the chunk like the traced program would */
+
+    if (*chunk != NULL)
+      memset(*chunk, 0xA5, call->size < 64 ? call->size : 64);
+
+    if (sampled && i % SAMPLE_EVERY == 0)
+      sample(target, &heap, base, res);
+  }
+
+  if (sampled)
+    sample(target, &heap, base, res);
+
+  elapsed = (bench_now_ns() - start) / 1e9;
+
+  for (uint32_t id = 0; id < replay->num_ids; id++)
+  {
+    if (target->libc)
+      free(chunks[id]);
+    else
+      s_free(chunks[id], &heap);
+    chunks[id] = NULL;
+  }
+
+  if (!target->libc)
+  {
+    s_heap_destroy(&heap);
+    munmap(region, HEAP_SIZE);
+  }
+
+  return elapsed;
+}
+
+static void run_target(const target_t *target, const replay_t *replay,
+                       size_t block_size, void **chunks, result_t *res)
+{
+  double elapsed;
+
+  memset(res, 0, sizeof(*res));
+  res->heap = target->name;
+  res->calls = replay->num_calls;
+  res->peak_live = replay->peak_live;
+  res->has_frag = !target->libc;
+
+  elapsed = run_once(target, replay, block_size, chunks, false, res);
+  res->ops_per_sec = elapsed > 0 ? replay->num_calls / elapsed : 0;
+
+  run_once(target, replay, block_size, chunks, true, res);
+}
+
+static void print_result(format_t format, const result_t *res, bool first)
+{
+  char frag[16] = "";
+
+  if (res->has_frag)
+    snprintf(frag, sizeof(frag), "%u", res->fragmentation);
+
+  switch (format)
+  {
+  case FORMAT_CSV:
+    if (first)
+      printf("heap,calls,ops_per_sec,peak_live_bytes,peak_bytes,hole_bytes,"
+             "fragmentation\n");
+    printf("%s,%zu,%.0f,%zu,%zu,%zu,%s\n", res->heap, res->calls,
+           res->ops_per_sec, res->peak_live, res->peak_bytes,
+           res->hole_bytes, frag);
+    break;
+
+  case FORMAT_JSON:
+    printf("%s  {\"heap\": \"%s\", \"calls\": %zu, \"ops_per_sec\": %.0f, "
+           "\"peak_live_bytes\": %zu, \"peak_bytes\": %zu, "
+           "\"hole_bytes\": %zu, \"fragmentation\": %s}",
+           first ? "[\n" : ",\n", res->heap, res->calls, res->ops_per_sec,
+           res->peak_live, res->peak_bytes, res->hole_bytes,
+           res->has_frag ? frag : "null");
+    break;
+
+  default:
+    if (first)
+      printf("%-18s %10s %11s %15s %11s %10s %5s\n", "heap", "calls",
+             "ops/s", "peak_live_bytes", "peak_bytes", "hole_bytes",
+             "frag");
+    printf("%-18s %10zu %11.0f %15zu %11zu %10zu %5s\n", res->heap,
+           res->calls, res->ops_per_sec, res->peak_live, res->peak_bytes,
+           res->hole_bytes, res->has_frag ? frag : "-");
+    break;
+  }
+}
+
+static void usage(void)
+{
+  fprintf(stderr, "usage: bench_replay [--format text|csv|json] "
+          "[--heap name] [--block-size N] trace\n");
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  static const target_t targets[] = {
+    { "segregated", false, S_HEAP_MODE_SEGREGATED, false },
+    { "tlsf", false, S_HEAP_MODE_TLSF, false },
+    { "segregated-defer", false, S_HEAP_MODE_SEGREGATED, true },
+    { "tlsf-defer", false, S_HEAP_MODE_TLSF, true },
+    { "libc", true },
+  };
+  format_t format = FORMAT_TEXT;
+  const char *path = NULL, *only_heap = NULL;
+  size_t block_size = 0;
+  bool first = true;
+  replay_t replay;
+  void **chunks;
+  result_t res;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strncmp(argv[i], "--", 2))
+    {
+      if (path != NULL)
+        usage();
+      path = argv[i];
+      continue;
+    }
+
+    if (i + 1 >= argc)
+      usage();
+
+    if (!strcmp(argv[i], "--format"))
+    {
+      if (!bench_parse_format(argv[++i], &format))
+        usage();
+    }
+    else if (!strcmp(argv[i], "--heap"))
+      only_heap = argv[++i];
+    else if (!strcmp(argv[i], "--block-size"))
+      block_size = strtoul(argv[++i], NULL, 0);
+    else
+      usage();
+  }
+
+  if (path == NULL)
+    usage();
+
+  load_trace(path, &replay);
+  fprintf(stderr, "%zu records, %zu calls, %u chunks, %zu dropped\n",
+          replay.records, replay.num_calls, replay.num_ids, replay.dropped);
+
+  chunks = map_array(replay.num_ids * sizeof(void *));
+
+  for (size_t t = 0; t < sizeof(targets) / sizeof(targets[0]); t++)
+  {
+    if (only_heap != NULL && strcmp(only_heap, targets[t].name))
+      continue;
+
+    run_target(&targets[t], &replay, block_size, chunks, &res);
+    print_result(format, &res, first);
+    fflush(stdout);
+    first = false;
+  }
+
+  if (format == FORMAT_JSON)
+    printf(first ? "[]\n" : "\n]\n");
+
+  return 0;
+}
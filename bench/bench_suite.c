@@ -0,0 +1,673 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Run a set of seeded workloads against a fresh heap and report for each
+ * one the throughput, the latency percentiles of the heap calls, the peak
+ * footprint and the fragmentation index. Every workload is run twice with
+ * the same seed: once untimed for the throughput and once with every call
+ * timed for the percentiles, so the clock reads do not skew the ops/s.
+ *
+ * Every chunk carries a stamp of its size in its first bytes that is
+ * checked before it is resized or released, and the heap has to be empty
+ * once a workload released everything, so a run also fails on a corrupted
+ * chunk or a leak.
+ *
+ * The footprint is the part of the heap that is not wilderness, the memory
+ * the OS had to provide, sampled with s_heap_stats while the workload runs.
+ * The fragmentation index and the free bytes that are not wilderness, the
+ * holes between the live chunks, are taken at the end with the live set
+ * still allocated.
+ *
+ * Usage: bench_suite [--format text|csv|json] [--seed N] [--ops N]
+ *                    [--mode segregated|tlsf] [--workload name]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "bench.h"
+#include "s_heap.h"
+
+#define HEAP_SIZE       (1024UL * 1024 * 1024)
+#define DEFAULT_OPS     (2000000)
+#define DEFAULT_SEED    (1)
+#define SAMPLE_EVERY    (256)
+#define STAMP_LEN       (64)
+
+#define NUM_SLOTS       (4096)
+#define NUM_VECTORS     (64)
+#define RING_SIZE       (1024)
+#define SHORT_WINDOW    (16)
+#define LONG_SLOTS      (16384)
+
+/* Per thread state of a workload run */
+
+typedef struct {
+  heap_t *heap;
+  uint64_t rng;
+  size_t ops;           /* Heap calls to make */
+  size_t done;          /* Heap calls made */
+  uint64_t *lat;        /* Latency of every call or NULL when untimed */
+  size_t peak;          /* Largest footprint seen, only sampled by thread 0 */
+  uint32_t frag;        /* Fragmentation index with the live set */
+  size_t holes;         /* Free bytes outside the wilderness */
+  bool sampler;
+} ctx_t;
+
+typedef struct {
+  const char *name;
+  void (*run)(ctx_t *ctx);
+  int threads;          /* Workloads with more threads use a safe heap */
+} workload_t;
+
+typedef struct {
+  const char *workload;
+  const char *mode;
+  uint64_t seed;
+  size_t ops;
+  double ops_per_sec;
+  uint64_t p50, p99, p999;
+  size_t peak_bytes;
+  size_t hole_bytes;
+  uint32_t fragmentation;
+} result_t;
+
+/* xorshift64*, the sequence only depends on the seed */
+
+static inline uint64_t rng_next(ctx_t *ctx)
+{
+  ctx->rng ^= ctx->rng >> 12;
+  ctx->rng ^= ctx->rng << 25;
+  ctx->rng ^= ctx->rng >> 27;
+  return ctx->rng * 2685821657736338717ULL;
+}
+
+static inline size_t rng_range(ctx_t *ctx, size_t min, size_t max)
+{
+  return min + rng_next(ctx) % (max - min + 1);
+}
+
+static void sample(ctx_t *ctx)
+{
+  s_heap_stats_t stats;
+
+  if (!ctx->sampler || ctx->done % SAMPLE_EVERY != 0)
+    return;
+
+  s_heap_stats(ctx->heap, &stats);
+  if (stats.total_bytes - stats.wild_bytes > ctx->peak)
+    ctx->peak = stats.total_bytes - stats.wild_bytes;
+}
+
+/* Take the last sample with the live set still allocated, the cleanup
+ * that follows is not measured.
+ */
+
+static void finish(ctx_t *ctx)
+{
+  s_heap_stats_t stats;
+
+  if (!ctx->sampler)
+    return;
+
+  s_heap_stats(ctx->heap, &stats);
+  if (stats.total_bytes - stats.wild_bytes > ctx->peak)
+    ctx->peak = stats.total_bytes - stats.wild_bytes;
+
+  ctx->frag = stats.fragmentation;
+  ctx->holes = stats.free_bytes - stats.wild_bytes;
+  ctx->sampler = false;
+}
+
+/* Write the size of a chunk and a pattern derived from it in its first
+ * STAMP_LEN bytes, like a caller touching the chunk would.
+ */
+
+static void stamp(void *ptr, size_t len)
+{
+  uint8_t *bytes = ptr;
+  size_t end = len < STAMP_LEN ? len : STAMP_LEN;
+
+  memcpy(bytes, &len, sizeof(len));
+  for (size_t i = sizeof(len); i < end; i++)
+    bytes[i] = (uint8_t)(len + i);
+}
+
+/* Check the stamp of a chunk and return the size it holds */
+
+static size_t stamp_check(const void *ptr)
+{
+  const uint8_t *bytes = ptr;
+  size_t len, end;
+
+  memcpy(&len, bytes, sizeof(len));
+  end = len < STAMP_LEN ? len : STAMP_LEN;
+
+  for (size_t i = sizeof(len); i < end; i++)
+  {
+    if (bytes[i] != (uint8_t)(len + i))
+    {
+      fprintf(stderr, "corrupted chunk %p of %zu bytes\n", ptr, len);
+      exit(1);
+    }
+  }
+
+  return len;
+}
+
+static void *b_alloc(ctx_t *ctx, size_t len)
+{
+  uint64_t start = ctx->lat != NULL ? bench_now_ns() : 0;
+  void *ptr = s_alloc(len, ctx->heap);
+
+  if (ctx->lat != NULL)
+    ctx->lat[ctx->done] = bench_now_ns() - start;
+  if (ptr == NULL)
+  {
+    fprintf(stderr, "heap exhausted\n");
+    exit(1);
+  }
+
+  ctx->done++;
+  sample(ctx);
+
+  stamp(ptr, len);
+  return ptr;
+}
+
+static void *b_realloc(ctx_t *ctx, void *ptr, size_t len)
+{
+  size_t old_len = stamp_check(ptr);
+  uint64_t start = ctx->lat != NULL ? bench_now_ns() : 0;
+
+  ptr = s_realloc(ptr, len, ctx->heap);
+  if (ctx->lat != NULL)
+    ctx->lat[ctx->done] = bench_now_ns() - start;
+  if (ptr == NULL)
+  {
+    fprintf(stderr, "heap exhausted\n");
+    exit(1);
+  }
+
+  ctx->done++;
+  sample(ctx);
+
+  /* The vectors only grow, the whole stamp was moved */
+
+  if (old_len <= len && stamp_check(ptr) != old_len)
+  {
+    fprintf(stderr, "s_realloc lost the contents of %p\n", ptr);
+    exit(1);
+  }
+
+  stamp(ptr, len);
+  return ptr;
+}
+
+static void b_free(ctx_t *ctx, void *ptr)
+{
+  uint64_t start;
+
+  stamp_check(ptr);
+  start = ctx->lat != NULL ? bench_now_ns() : 0;
+
+  s_free(ptr, ctx->heap);
+  if (ctx->lat != NULL)
+    ctx->lat[ctx->done] = bench_now_ns() - start;
+
+  ctx->done++;
+  sample(ctx);
+}
+
+/* Power law sizes: a size of the class 16 << k is picked with probability
+ * 2^-(k+1), so there are twice as many chunks of every size as of the
+ * double of it, up to 1MB.
+ */
+
+static size_t power_law_size(ctx_t *ctx)
+{
+  unsigned int k = __builtin_ctzll(rng_next(ctx) | (1ULL << 16));
+  size_t base = (size_t)16 << k;
+
+  return base + rng_next(ctx) % base;
+}
+
+static void w_random_slots(ctx_t *ctx, bool power_law)
+{
+  static void *slots[NUM_SLOTS];
+  size_t i;
+
+  memset(slots, 0, sizeof(slots));
+
+  while (ctx->done < ctx->ops)
+  {
+    i = rng_next(ctx) % NUM_SLOTS;
+    if (slots[i] == NULL)
+      slots[i] = b_alloc(ctx, power_law ? power_law_size(ctx) :
+                         rng_range(ctx, 16, 256));
+    else
+    {
+      b_free(ctx, slots[i]);
+      slots[i] = NULL;
+    }
+  }
+
+  finish(ctx);
+  for (i = 0; i < NUM_SLOTS; i++)
+    s_free(slots[i], ctx->heap);
+}
+
+static void w_uniform_small(ctx_t *ctx)
+{
+  w_random_slots(ctx, false);
+}
+
+static void w_power_law(ctx_t *ctx)
+{
+  w_random_slots(ctx, true);
+}
+
+/* Vectors that grow by half of their size until they reach a random
+ * capacity, then they are released and start again.
+ */
+
+static void w_realloc_growth(ctx_t *ctx)
+{
+  static struct {
+    void *ptr;
+    size_t len;
+    size_t target;
+  } vecs[NUM_VECTORS];
+  size_t i;
+
+  memset(vecs, 0, sizeof(vecs));
+
+  while (ctx->done < ctx->ops)
+  {
+    i = rng_next(ctx) % NUM_VECTORS;
+    if (vecs[i].ptr == NULL)
+    {
+      vecs[i].len = rng_range(ctx, 16, 128);
+      vecs[i].target = rng_range(ctx, 1024, 256 * 1024);
+      vecs[i].ptr = b_alloc(ctx, vecs[i].len);
+    }
+    else if (vecs[i].len < vecs[i].target)
+    {
+      vecs[i].len += vecs[i].len / 2;
+      vecs[i].ptr = b_realloc(ctx, vecs[i].ptr, vecs[i].len);
+    }
+    else
+    {
+      b_free(ctx, vecs[i].ptr);
+      vecs[i].ptr = NULL;
+    }
+  }
+
+  finish(ctx);
+  for (i = 0; i < NUM_VECTORS; i++)
+    s_free(vecs[i].ptr, ctx->heap);
+}
+
+/* Most chunks live for a few allocations, one in sixteen stays in a large
+ * pool until its slot is reused much later.
+ */
+
+static void w_lifetime_mix(ctx_t *ctx)
+{
+  static void *pool[LONG_SLOTS];
+  void *window[SHORT_WINDOW] = { NULL };
+  size_t head = 0, i;
+
+  memset(pool, 0, sizeof(pool));
+
+  while (ctx->done < ctx->ops)
+  {
+    if (rng_next(ctx) % 16 == 0)
+    {
+      i = rng_next(ctx) % LONG_SLOTS;
+      if (pool[i] != NULL)
+        b_free(ctx, pool[i]);
+      pool[i] = b_alloc(ctx, rng_range(ctx, 64, 8192));
+      continue;
+    }
+
+    if (window[head] != NULL)
+      b_free(ctx, window[head]);
+    window[head] = b_alloc(ctx, rng_range(ctx, 16, 2048));
+    head = (head + 1) % SHORT_WINDOW;
+  }
+
+  finish(ctx);
+  for (i = 0; i < SHORT_WINDOW; i++)
+    s_free(window[i], ctx->heap);
+  for (i = 0; i < LONG_SLOTS; i++)
+    s_free(pool[i], ctx->heap);
+}
+
+/* One thread allocates and hands the chunks over a ring, the other one
+ * releases them.
+ */
+
+static struct {
+  void *slots[RING_SIZE];
+  size_t head;          /* Written by the producer */
+  size_t tail;          /* Written by the consumer */
+} g_ring;
+
+static void w_producer(ctx_t *ctx)
+{
+  size_t head = 0;
+
+  while (ctx->done < ctx->ops)
+  {
+    void *ptr = b_alloc(ctx, rng_range(ctx, 32, 1024));
+
+    while (head - __atomic_load_n(&g_ring.tail, __ATOMIC_ACQUIRE) ==
+           RING_SIZE)
+      sched_yield();
+
+    g_ring.slots[head % RING_SIZE] = ptr;
+    __atomic_store_n(&g_ring.head, ++head, __ATOMIC_RELEASE);
+  }
+
+  finish(ctx);
+}
+
+static void w_consumer(ctx_t *ctx)
+{
+  size_t tail = 0;
+
+  while (ctx->done < ctx->ops)
+  {
+    while (__atomic_load_n(&g_ring.head, __ATOMIC_ACQUIRE) == tail)
+      sched_yield();
+
+    b_free(ctx, g_ring.slots[tail % RING_SIZE]);
+    __atomic_store_n(&g_ring.tail, ++tail, __ATOMIC_RELEASE);
+  }
+}
+
+static void w_producer_consumer(ctx_t *ctx)
+{
+  if (ctx->sampler)
+    w_producer(ctx);
+  else
+    w_consumer(ctx);
+}
+
+static const workload_t g_workloads[] = {
+  { "uniform_small", w_uniform_small, 1 },
+  { "power_law", w_power_law, 1 },
+  { "producer_consumer", w_producer_consumer, 2 },
+  { "realloc_growth", w_realloc_growth, 1 },
+  { "lifetime_mix", w_lifetime_mix, 1 },
+};
+
+static void *thread_main(void *arg)
+{
+  const workload_t *workload = ((void **)arg)[0];
+  ctx_t *ctx = ((void **)arg)[1];
+
+  workload->run(ctx);
+  return NULL;
+}
+
+/**
+ * run_once() - Run a workload on a fresh heap.
+ *
+ * @workload: The workload.
+ * @mode: The heap engine.
+ * @seed: The seed of the size and slot sequences.
+ * @ops: The number of heap calls of every thread.
+ * @lat: Latency output array of threads * ops entries or NULL.
+ * @res: Filled with the footprint and the fragmentation.
+ *
+ * Return: The elapsed time in seconds.
+ */
+static double run_once(const workload_t *workload, s_heap_mode_t mode,
+                       uint64_t seed, size_t ops, uint64_t *lat,
+                       result_t *res)
+{
+  static heap_t heap;
+  s_heap_config_t config = { .mode = mode, .zeroed = true };
+  s_heap_stats_t stats;
+  ctx_t ctx[2];
+  void *args[2][2];
+  pthread_t threads[2];
+  uint8_t *region;
+  double start, elapsed;
+  int i;
+
+  region = mmap(NULL, HEAP_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (region == MAP_FAILED || s_init_ex(&heap, region, region + HEAP_SIZE,
+                                        &config) != 0)
+  {
+    fprintf(stderr, "cannot create the heap\n");
+    exit(1);
+  }
+
+  if (workload->threads > 1)
+    s_heap_set_thread_safe(&heap);
+
+  memset(&g_ring, 0, sizeof(g_ring));
+
+  for (i = 0; i < workload->threads; i++)
+  {
+    ctx[i] = (ctx_t) {
+      .heap = &heap,
+      .rng = seed * 0x9E3779B97F4A7C15ULL + i + 1,
+      .ops = ops,
+      .lat = lat != NULL ? lat + i * ops : NULL,
+      .sampler = i == 0,
+    };
+    args[i][0] = (void *)workload;
+    args[i][1] = &ctx[i];
+  }
+
+  start = bench_now_ns() / 1e9;
+
+  if (workload->threads == 1)
+    workload->run(&ctx[0]);
+  else
+  {
+    for (i = 0; i < workload->threads; i++)
+      pthread_create(&threads[i], NULL, thread_main, args[i]);
+    for (i = 0; i < workload->threads; i++)
+      pthread_join(threads[i], NULL);
+  }
+
+  elapsed = bench_now_ns() / 1e9 - start;
+
+  /* Every workload releases all its chunks at the end */
+
+  s_heap_stats(&heap, &stats);
+  if (stats.used_bytes != 0 || stats.alloc_count != stats.free_count)
+  {
+    fprintf(stderr, "%s: %zu bytes still used after %zu allocations and "
+            "%zu releases\n", workload->name, stats.used_bytes,
+            stats.alloc_count, stats.free_count);
+    exit(1);
+  }
+
+  res->peak_bytes = ctx[0].peak;
+  res->fragmentation = ctx[0].frag;
+  res->hole_bytes = ctx[0].holes;
+
+  s_heap_destroy(&heap);
+  munmap(region, HEAP_SIZE);
+
+  return elapsed;
+}
+
+static void run_workload(const workload_t *workload, const char *mode_name,
+                         s_heap_mode_t mode, uint64_t seed, size_t ops,
+                         result_t *res)
+{
+  size_t total = ops * workload->threads;
+  uint64_t *lat = malloc(total * sizeof(uint64_t));
+  bench_lat_t pct;
+  result_t timed;
+  double elapsed;
+
+  if (lat == NULL)
+  {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  memset(res, 0, sizeof(*res));
+  res->workload = workload->name;
+  res->mode = mode_name;
+  res->seed = seed;
+  res->ops = total;
+
+  elapsed = run_once(workload, mode, seed, ops, NULL, res);
+  res->ops_per_sec = total / elapsed;
+
+  run_once(workload, mode, seed, ops, lat, &timed);
+  bench_latency(lat, total, &pct);
+  res->p50 = pct.p50;
+  res->p99 = pct.p99;
+  res->p999 = pct.p999;
+
+  free(lat);
+}
+
+static void print_result(format_t format, const result_t *res, bool first)
+{
+  switch (format)
+  {
+  case FORMAT_CSV:
+    if (first)
+      printf("workload,mode,seed,ops,ops_per_sec,p50_ns,p99_ns,p999_ns,"
+             "peak_bytes,hole_bytes,fragmentation\n");
+    printf("%s,%s,%llu,%zu,%.0f,%llu,%llu,%llu,%zu,%zu,%u\n",
+           res->workload, res->mode, (unsigned long long)res->seed,
+           res->ops, res->ops_per_sec, (unsigned long long)res->p50,
+           (unsigned long long)res->p99, (unsigned long long)res->p999,
+           res->peak_bytes, res->hole_bytes, res->fragmentation);
+    break;
+
+  case FORMAT_JSON:
+    printf("%s  {\"workload\": \"%s\", \"mode\": \"%s\", \"seed\": %llu, "
+           "\"ops\": %zu, \"ops_per_sec\": %.0f, \"p50_ns\": %llu, "
+           "\"p99_ns\": %llu, \"p999_ns\": %llu, \"peak_bytes\": %zu, "
+           "\"hole_bytes\": %zu, \"fragmentation\": %u}",
+           first ? "[\n" : ",\n", res->workload, res->mode,
+           (unsigned long long)res->seed, res->ops, res->ops_per_sec,
+           (unsigned long long)res->p50, (unsigned long long)res->p99,
+           (unsigned long long)res->p999, res->peak_bytes, res->hole_bytes,
+           res->fragmentation);
+    break;
+
+  default:
+    if (first)
+      printf("%-18s %-10s %11s %7s %7s %8s %11s %10s %5s\n", "workload",
+             "mode", "ops/s", "p50_ns", "p99_ns", "p999_ns", "peak_bytes",
+             "hole_bytes", "frag");
+    printf("%-18s %-10s %11.0f %7llu %7llu %8llu %11zu %10zu %5u\n",
+           res->workload, res->mode, res->ops_per_sec,
+           (unsigned long long)res->p50, (unsigned long long)res->p99,
+           (unsigned long long)res->p999, res->peak_bytes, res->hole_bytes,
+           res->fragmentation);
+    break;
+  }
+}
+
+static void usage(void)
+{
+  fprintf(stderr, "usage: bench_suite [--format text|csv|json] [--seed N] "
+          "[--ops N] [--mode segregated|tlsf] [--workload name]\n");
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  static const struct {
+    const char *name;
+    s_heap_mode_t mode;
+  } modes[] = {
+    { "segregated", S_HEAP_MODE_SEGREGATED },
+    { "tlsf", S_HEAP_MODE_TLSF },
+  };
+  format_t format = FORMAT_TEXT;
+  uint64_t seed = DEFAULT_SEED;
+  size_t ops = DEFAULT_OPS;
+  const char *only_mode = NULL, *only_workload = NULL;
+  bool first = true;
+  result_t res;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (i + 1 >= argc)
+      usage();
+
+    if (!strcmp(argv[i], "--format"))
+    {
+      if (!bench_parse_format(argv[++i], &format))
+        usage();
+    }
+    else if (!strcmp(argv[i], "--seed"))
+      seed = strtoull(argv[++i], NULL, 0);
+    else if (!strcmp(argv[i], "--ops"))
+      ops = strtoul(argv[++i], NULL, 0);
+    else if (!strcmp(argv[i], "--mode"))
+      only_mode = argv[++i];
+    else if (!strcmp(argv[i], "--workload"))
+      only_workload = argv[++i];
+    else
+      usage();
+  }
+
+  if (ops == 0)
+    usage();
+
+  for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+  {
+    if (only_mode != NULL && strcmp(only_mode, modes[m].name))
+      continue;
+
+    for (size_t w = 0; w < sizeof(g_workloads) / sizeof(g_workloads[0]);
+         w++)
+    {
+      if (only_workload != NULL && strcmp(only_workload,
+                                          g_workloads[w].name))
+        continue;
+
+      run_workload(&g_workloads[w], modes[m].name, modes[m].mode, seed, ops,
+                   &res);
+      print_result(format, &res, first);
+      fflush(stdout);
+      first = false;
+    }
+  }
+
+  if (format == FORMAT_JSON)
+    printf(first ? "[]\n" : "\n]\n");
+
+  return 0;
+}
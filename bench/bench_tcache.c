@@ -0,0 +1,139 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Measure how allocation throughput scales with the number of threads when
+ * the heap is shared through a single global mutex and when it is shared
+ * through the per-thread caches.
+ *
+ * Usage: bench_tcache [max_threads]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "bench.h"
+#include "s_heap.h"
+#include "s_tcache.h"
+
+#define HEAP_SIZE     (256 * 1024 * 1024)
+#define OPS_PER_THREAD (1000000)
+#define LIVE_SLOTS    (64)
+#define MAX_ALLOC     (256)
+
+typedef struct {
+  bool use_tcache;
+  unsigned int seed;
+} worker_arg_t;
+
+static heap_t g_heap;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static s_tcache_heap_t g_tc_heap;
+
+static void *worker(void *arg)
+{
+  worker_arg_t *wa = arg;
+  void *slots[LIVE_SLOTS] = { NULL };
+  unsigned int seed = wa->seed;
+
+  for (int i = 0; i < OPS_PER_THREAD; i++)
+  {
+    int slot = rand_r(&seed) % LIVE_SLOTS;
+
+    if (wa->use_tcache)
+    {
+      s_tcache_free(slots[slot], &g_tc_heap);
+      slots[slot] = s_tcache_alloc(1 + rand_r(&seed) % MAX_ALLOC, &g_tc_heap);
+    }
+    else
+    {
+      pthread_mutex_lock(&g_lock);
+      s_free(slots[slot], &g_heap);
+      slots[slot] = s_alloc(1 + rand_r(&seed) % MAX_ALLOC, &g_heap);
+      pthread_mutex_unlock(&g_lock);
+    }
+  }
+
+  for (int i = 0; i < LIVE_SLOTS; i++)
+  {
+    if (wa->use_tcache)
+    {
+      s_tcache_free(slots[i], &g_tc_heap);
+    }
+    else
+    {
+      pthread_mutex_lock(&g_lock);
+      s_free(slots[i], &g_heap);
+      pthread_mutex_unlock(&g_lock);
+    }
+  }
+
+  if (wa->use_tcache)
+    s_tcache_flush(&g_tc_heap);
+
+  return NULL;
+}
+
+static double run(int num_threads, bool use_tcache)
+{
+  pthread_t threads[num_threads];
+  worker_arg_t args[num_threads];
+  double start = bench_now_sec();
+
+  for (int i = 0; i < num_threads; i++)
+  {
+    args[i].use_tcache = use_tcache;
+    args[i].seed = i + 1;
+    pthread_create(&threads[i], NULL, worker, &args[i]);
+  }
+
+  for (int i = 0; i < num_threads; i++)
+    pthread_join(threads[i], NULL);
+
+  return (2.0 * OPS_PER_THREAD * num_threads) / (bench_now_sec() - start);
+}
+
+int main(int argc, char **argv)
+{
+  int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+  void *region = malloc(HEAP_SIZE);
+
+  if (region == NULL)
+    return 1;
+
+  s_init(&g_heap, region, (uint8_t *)region + HEAP_SIZE);
+  s_tcache_init(&g_tc_heap, &g_heap);
+
+  printf("threads  mutex_ops/s  tcache_ops/s\n");
+  for (int n = 1; n <= max_threads; n *= 2)
+  {
+    double mutex_ops = run(n, false);
+    double tcache_ops = run(n, true);
+
+    printf("%-8d %-12.0f %-12.0f\n", n, mutex_ops, tcache_ops);
+  }
+
+  s_tcache_destroy(&g_tc_heap);
+  free(region);
+  return 0;
+}
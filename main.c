@@ -3,7 +3,6 @@
 #include <stdbool.h>
 #include <string.h>
 #include <assert.h>
-#include <unistd.h>
 
 #include "s_heap.h"
 
@@ -16,26 +15,46 @@ void s_dbg_heap(heap_t *my_heap)
 
   printf("################ Alocated blocks ##################\n");
 
-  mem_node_t *node = NULL;
-  list_for_each_entry (node, &my_heap->g_used_heap_list, node_list)
+  mem_node_t *node;
+  for (s_heap_seg_t *seg = &my_heap->first_segment; seg; seg = seg->next)
   {
-    printf("leaked block start = 0x%lx, size = %u blocks\n",
-           (unsigned long)node->chunk_addr,
-           node->mask.size);
+    uint8_t *chunk = (uint8_t *)seg->start;
+    for (; chunk < (uint8_t *)seg->end;
+         chunk += node->mask.size * my_heap->block_size)
+    {
+      node = (mem_node_t *)chunk;
+
+      if (node->mask.used == 0)
+        continue;
+
+      printf("leaked block start = 0x%lx, size = %u blocks\n",
+             (unsigned long)node + S_HEAP_HDR_SIZE,
+             node->mask.size);
+    }
   }
 
   printf("################ Free blocks ##################\n");
 
-  node = NULL;
-  list_for_each_entry (node, &my_heap->g_free_heap_list, node_list)
-  {
-    printf("block start = 0x%lx, size = %u blocks\n",
-           (unsigned long)node->chunk_addr,
-           node->mask.size);
-  }
+  if (my_heap->wilderness != NULL)
+    printf("wilderness start = 0x%lx, size = %u blocks\n",
+           (unsigned long)my_heap->wilderness + S_HEAP_HDR_SIZE,
+           my_heap->wilderness->mask.size);
+
+  for (int fl = 0; fl < S_HEAP_FL_COUNT; fl++)
+    for (int sl = 0; sl < S_HEAP_SL_COUNT; sl++)
+    {
+      node = NULL;
+      list_for_each_entry (node, &my_heap->g_free_bins[fl][sl], node_list)
+      {
+        printf("bin %d.%d block start = 0x%lx, size = %u blocks\n",
+               fl, sl,
+               (unsigned long)node + S_HEAP_HDR_SIZE,
+               node->mask.size);
+      }
+    }
 }
 
-int main(void)
+int main(int argc, char **argv)
 {
   static heap_t my_heap;
   const size_t sz = 1024 * 1024;
@@ -55,8 +74,13 @@ int main(void)
 
   s_dbg_heap(&my_heap);
 
+  /* The number of iterations is the first argument, the performance is
+   * measured by the programs in bench/.
+   */
+
   uint32_t it = 0;
-  while (1)
+  uint32_t iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 100;
+  while (it < iterations)
 	{
 
 		for (int i = 0; i < TEST_ARRAY_SIZE; i++)
@@ -162,7 +186,6 @@ int main(void)
 		printf("\r\nIteration : %u\n", ++it);
 		printf("\r\n##############\r\n");
 		printf("\r\n##############\r\n");
-    sleep(1);
 	}
   free(start_addr);
   return 0;
@@ -0,0 +1,294 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "s_arena.h"
+
+/* The memory of a chunk starts after its header */
+
+#define S_ARENA_HDR_SIZE \
+  ((sizeof(s_arena_chunk_t) + S_ARENA_ALIGN - 1) & ~(size_t)(S_ARENA_ALIGN - 1))
+
+/**
+ * s_arena_align() - Round an address up to an alignment.
+ *
+ * @ptr: The address.
+ * @align: The alignment, a power of two.
+ *
+ * Return: The first address at or after ptr that is aligned.
+ */
+static inline uint8_t *s_arena_align(uint8_t *ptr, size_t align)
+{
+  return (uint8_t *)(((uintptr_t)ptr + align - 1) & ~(uintptr_t)(align - 1));
+}
+
+/**
+ * s_arena_chunk_release() - Give a chunk that left the stack away.
+ *
+ * @arena: The arena context.
+ * @chunk: The chunk.
+ * @keep: Put the chunk in the cache instead of giving it back to the heap.
+ */
+static void s_arena_chunk_release(s_arena_t *arena, s_arena_chunk_t *chunk,
+                                  bool keep)
+{
+  if (keep && !chunk->large)
+  {
+    chunk->prev = arena->cache;
+    arena->cache = chunk;
+    return;
+  }
+
+  s_free_sized(chunk, chunk->end - (uint8_t *)chunk, arena->heap);
+  arena->num_chunks--;
+}
+
+/**
+ * s_arena_refill() - Allocate from a new chunk.
+ *
+ * @arena: The arena context.
+ * @align: The alignment, a power of two.
+ * @len: The requested memory size.
+ *
+ * A request that fits in a chunk moves the arena to a chunk from the cache
+ * or from the heap, the rest of the current chunk is not used any more. A
+ * larger request gets a chunk of its own and the arena keeps moving in the
+ * current chunk.
+ *
+ * Return: A void pointer on success otherwise NULL.
+ */
+static void *s_arena_refill(s_arena_t *arena, size_t align, size_t len)
+{
+  s_arena_chunk_t *chunk;
+  size_t need, size;
+  uint8_t *ptr;
+
+  if (len > SIZE_MAX - align - S_ARENA_HDR_SIZE)
+    return NULL;
+
+  /* The heap only guarantees its own alignment for the chunk */
+
+  need = S_ARENA_HDR_SIZE + align - 1 + len;
+  size = need <= arena->chunk_size ? arena->chunk_size : need;
+
+  if (size == arena->chunk_size && arena->cache != NULL)
+  {
+    chunk = arena->cache;
+    arena->cache = chunk->prev;
+  }
+  else
+  {
+    chunk = s_alloc(size, arena->heap);
+    if (chunk == NULL)
+      return NULL;
+
+    chunk->end = (uint8_t *)chunk + size;
+    chunk->large = size != arena->chunk_size;
+    arena->num_chunks++;
+  }
+
+  chunk->prev = arena->top;
+  arena->top = chunk;
+
+  ptr = s_arena_align((uint8_t *)chunk + S_ARENA_HDR_SIZE, align);
+  if (!chunk->large)
+  {
+    arena->cur = chunk;
+    arena->next = ptr + len;
+  }
+
+  arena->used_bytes += len;
+  return ptr;
+}
+
+/**
+ * s_arena_init() - Initialize an arena on top of a heap.
+ *
+ * @arena: The arena context.
+ * @my_heap: An initialized heap that provides the chunks.
+ * @chunk_size: The size of the chunks taken from the heap, 0 for
+ *              S_ARENA_CHUNK_SIZE.
+ *
+ * Return: 0 on success, -1 if the chunk size is too small.
+ */
+int s_arena_init(s_arena_t *arena, heap_t *my_heap, size_t chunk_size)
+{
+  if (chunk_size == 0)
+    chunk_size = S_ARENA_CHUNK_SIZE;
+
+  if (chunk_size < 2 * S_ARENA_HDR_SIZE)
+    return -1;
+
+  memset(arena, 0, sizeof(*arena));
+  arena->heap = my_heap;
+  arena->chunk_size = chunk_size;
+
+  return 0;
+}
+
+/**
+ * s_arena_aligned_alloc() - Allocate aligned memory from an arena.
+ *
+ * @align: The alignment, a power of two.
+ * @len: The requested memory size.
+ * @arena: The arena context.
+ *
+ * Return: A void pointer on success otherwise NULL.
+ */
+void *s_arena_aligned_alloc(size_t align, size_t len, s_arena_t *arena)
+{
+  uint8_t *ptr;
+
+  if (align == 0 || (align & (align - 1)) != 0)
+  {
+    assert(false);
+    return NULL;
+  }
+
+  if (align < S_ARENA_ALIGN)
+    align = S_ARENA_ALIGN;
+
+  /* Two calls of 0 bytes still get different addresses */
+
+  if (len == 0)
+    len = 1;
+
+  if (arena->cur != NULL)
+  {
+    ptr = s_arena_align(arena->next, align);
+    if (ptr >= arena->next && ptr <= arena->cur->end &&
+        len <= (size_t)(arena->cur->end - ptr))
+    {
+      arena->next = ptr + len;
+      arena->used_bytes += len;
+      return ptr;
+    }
+  }
+
+  return s_arena_refill(arena, align, len);
+}
+
+/**
+ * s_arena_alloc() - Allocate memory from an arena.
+ *
+ * @len: The requested memory size.
+ * @arena: The arena context.
+ *
+ * Return: A void pointer on success otherwise NULL.
+ */
+void *s_arena_alloc(size_t len, s_arena_t *arena)
+{
+  return s_arena_aligned_alloc(S_ARENA_ALIGN, len, arena);
+}
+
+/**
+ * s_arena_mark() - Save the position of an arena.
+ *
+ * @arena: The arena context.
+ *
+ * Return: A mark to give to s_arena_rewind.
+ */
+s_arena_mark_t s_arena_mark(s_arena_t *arena)
+{
+  s_arena_mark_t mark = {
+    .top = arena->top,
+    .cur = arena->cur,
+    .next = arena->next,
+    .used_bytes = arena->used_bytes,
+  };
+
+  return mark;
+}
+
+/**
+ * s_arena_rewind() - Release everything allocated after a mark.
+ *
+ * @arena: The arena context.
+ * @mark: A mark taken on this arena since its last reset.
+ *
+ * The chunks taken after the mark are above it in the stack, the ones
+ * below it and the part of the current chunk before the mark stay.
+ *
+ * Return: None.
+ */
+void s_arena_rewind(s_arena_t *arena, const s_arena_mark_t *mark)
+{
+  s_arena_chunk_t *chunk;
+
+  while (arena->top != mark->top)
+  {
+    chunk = arena->top;
+    assert(chunk != NULL);
+
+    arena->top = chunk->prev;
+    s_arena_chunk_release(arena, chunk, true);
+  }
+
+  arena->cur = mark->cur;
+  arena->next = mark->next;
+  arena->used_bytes = mark->used_bytes;
+}
+
+/**
+ * s_arena_reset() - Release everything allocated from an arena.
+ *
+ * @arena: The arena context.
+ * @keep: Keep the chunks for the next allocations instead of giving them
+ *        back to the heap.
+ *
+ * Return: None.
+ */
+void s_arena_reset(s_arena_t *arena, bool keep)
+{
+  s_arena_chunk_t *chunk;
+
+  while (arena->top != NULL)
+  {
+    chunk = arena->top;
+    arena->top = chunk->prev;
+    s_arena_chunk_release(arena, chunk, keep);
+  }
+
+  while (!keep && arena->cache != NULL)
+  {
+    chunk = arena->cache;
+    arena->cache = chunk->prev;
+    s_arena_chunk_release(arena, chunk, false);
+  }
+
+  arena->cur = NULL;
+  arena->next = NULL;
+  arena->used_bytes = 0;
+}
+
+/**
+ * s_arena_destroy() - Give all the chunks of an arena back to the heap.
+ *
+ * @arena: The arena context.
+ *
+ * Return: None.
+ */
+void s_arena_destroy(s_arena_t *arena)
+{
+  s_arena_reset(arena, false);
+  assert(arena->num_chunks == 0);
+}
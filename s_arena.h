@@ -0,0 +1,168 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __S_ARENA_H
+#define __S_ARENA_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "s_heap.h"
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+/* An arena cuts S_ARENA_CHUNK_SIZE chunks from its heap, unless another
+ * size is given to s_arena_init, and hands out their memory by moving a
+ * pointer. Allocations are aligned to S_ARENA_ALIGN unless they ask for
+ * more. A request that does not fit in a chunk gets a chunk of its own.
+ */
+
+#define S_ARENA_CHUNK_SIZE  (64 * 1024)
+#define S_ARENA_ALIGN       (16)
+
+/****************************************************************************
+ * Public types
+ ****************************************************************************/
+
+/* The header at the start of every chunk of an arena */
+
+typedef struct s_arena_chunk_s
+{
+  struct s_arena_chunk_s *prev; /* The chunk taken before this one */
+  uint8_t *end;                 /* Address right after the chunk */
+  bool large;                   /* Serves a single large request */
+} s_arena_chunk_t;
+
+/* The position of an arena, all the memory handed out after it is given
+ * back by s_arena_rewind.
+ */
+
+typedef struct {
+  s_arena_chunk_t *top;
+  s_arena_chunk_t *cur;
+  uint8_t *next;
+  size_t used_bytes;
+} s_arena_mark_t;
+
+/* A region of memory released all at once. It is not thread-safe, every
+ * thread or request uses its own arena, the heap under it can be shared.
+ */
+
+typedef struct {
+  heap_t *heap;
+  size_t chunk_size;
+  s_arena_chunk_t *top;       /* Last chunk taken, the chunks form a stack */
+  s_arena_chunk_t *cur;       /* Chunk the pointer moves in */
+  uint8_t *next;              /* Next free byte of cur */
+  s_arena_chunk_t *cache;     /* Chunks kept by a reset or a rewind */
+  size_t num_chunks;          /* Chunks in the stack and in the cache */
+  size_t used_bytes;          /* Bytes handed out since the last reset */
+} s_arena_t;
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/**
+ * s_arena_init() - Initialize an arena on top of a heap.
+ *
+ * @arena: The arena context.
+ * @my_heap: An initialized heap that provides the chunks.
+ * @chunk_size: The size of the chunks taken from the heap, 0 for
+ *              S_ARENA_CHUNK_SIZE.
+ *
+ * No memory is taken from the heap before the first allocation.
+ *
+ * Return: 0 on success, -1 if the chunk size is too small.
+ */
+int s_arena_init(s_arena_t *arena, heap_t *my_heap, size_t chunk_size);
+
+/**
+ * s_arena_alloc() - Allocate memory from an arena.
+ *
+ * @len: The requested memory size.
+ * @arena: The arena context.
+ *
+ * The memory is aligned to S_ARENA_ALIGN and can not be released on its
+ * own, only by s_arena_rewind or s_arena_reset.
+ *
+ * Return: A void pointer on success otherwise NULL.
+ */
+void *s_arena_alloc(size_t len, s_arena_t *arena);
+
+/**
+ * s_arena_aligned_alloc() - Allocate aligned memory from an arena.
+ *
+ * @align: The alignment, a power of two.
+ * @len: The requested memory size.
+ * @arena: The arena context.
+ *
+ * Return: A void pointer on success otherwise NULL.
+ */
+void *s_arena_aligned_alloc(size_t align, size_t len, s_arena_t *arena);
+
+/**
+ * s_arena_mark() - Save the position of an arena.
+ *
+ * @arena: The arena context.
+ *
+ * Return: A mark to give to s_arena_rewind.
+ */
+s_arena_mark_t s_arena_mark(s_arena_t *arena);
+
+/**
+ * s_arena_rewind() - Release everything allocated after a mark.
+ *
+ * @arena: The arena context.
+ * @mark: A mark taken on this arena since its last reset and not rewound
+ *        past by an older mark.
+ *
+ * The chunks taken after the mark are kept in the cache, the ones that
+ * served a large request are given back to the heap.
+ *
+ * Return: None.
+ */
+void s_arena_rewind(s_arena_t *arena, const s_arena_mark_t *mark);
+
+/**
+ * s_arena_reset() - Release everything allocated from an arena.
+ *
+ * @arena: The arena context.
+ * @keep: Keep the chunks for the next allocations instead of giving them
+ *        back to the heap.
+ *
+ * The cost depends on the number of chunks, not on the number of
+ * allocations. Chunks that served a large request are always given back.
+ *
+ * Return: None.
+ */
+void s_arena_reset(s_arena_t *arena, bool keep);
+
+/**
+ * s_arena_destroy() - Give all the chunks of an arena back to the heap.
+ *
+ * @arena: The arena context, it can be used again after s_arena_init.
+ *
+ * Return: None.
+ */
+void s_arena_destroy(s_arena_t *arena);
+
+#endif /* __S_ARENA_H */
@@ -20,344 +20,2798 @@
 #include <stdbool.h>
 #include <string.h>
 #include <assert.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
-#define MAX_LIST_LENGTH_BITS 20
-#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+#include "s_heap.h"
+
+#ifdef S_HEAP_PROFILE
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+/* Free chunks visited by the calling thread since it started, a call
+ * records how much it grew while it ran.
+ */
+
+static __thread uint32_t g_prof_visits;
+#endif
+
+#ifdef S_HEAP_TRACE
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#endif
+
+/* The start of a call timed in S_HEAP_PROFILE builds */
+
+typedef struct {
+  uint64_t ticks;
+  uint32_t visits;
+} s_prof_t;
+
+/**
+ * s_prof_start() - Start timing a public call.
+ *
+ * Return: The time and the visit count at the start of the call, nothing
+ * when S_HEAP_PROFILE is not defined.
+ */
+static inline s_prof_t s_prof_start(void)
+{
+  s_prof_t prof = { 0 };
+
+#ifdef S_HEAP_PROFILE
+#if defined(__x86_64__) || defined(__i386__)
+  prof.ticks = __rdtsc();
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  prof.ticks = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+  prof.visits = g_prof_visits;
+#endif
+
+  return prof;
+}
+
+/**
+ * s_prof_visit() - Count a free chunk looked at by the current call.
+ */
+static inline void s_prof_visit(void)
+{
+#ifdef S_HEAP_PROFILE
+  g_prof_visits++;
+#endif
+}
+
+/**
+ * s_prof_end() - Record a timed public call in the histograms.
+ *
+ * @my_heap: The heap context.
+ * @op: The public call.
+ * @blocks: The size class of the call in blocks number.
+ * @prof: The value returned by s_prof_start().
+ */
+static inline void s_prof_end(heap_t *my_heap, s_heap_op_t op, size_t blocks,
+                              const s_prof_t *prof)
+{
+#ifdef S_HEAP_PROFILE
+  s_prof_t now = s_prof_start();
+  uint64_t ticks = now.ticks - prof->ticks;
+  uint32_t visits = now.visits - prof->visits;
+  unsigned int cls = blocks ? 63 - __builtin_clzll(blocks) : 0;
+  unsigned int bucket = ticks ? 64 - __builtin_clzll(ticks) : 0;
+  unsigned int visit_bucket = visits ? 32 - __builtin_clz(visits) : 0;
+
+  if (cls >= S_HEAP_FL_COUNT)
+    cls = S_HEAP_FL_COUNT - 1;
+  if (bucket >= S_HEAP_PROF_BUCKETS)
+    bucket = S_HEAP_PROF_BUCKETS - 1;
+  if (visit_bucket >= S_HEAP_PROF_BUCKETS)
+    visit_bucket = S_HEAP_PROF_BUCKETS - 1;
+
+  if (my_heap->thread_safe)
+  {
+    __atomic_fetch_add(&my_heap->prof.latency[op][cls][bucket], 1,
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&my_heap->prof.visits[op][visit_bucket], 1,
+                       __ATOMIC_RELAXED);
+  }
+  else
+  {
+    my_heap->prof.latency[op][cls][bucket]++;
+    my_heap->prof.visits[op][visit_bucket]++;
+  }
+#endif
+}
+
+#ifdef S_HEAP_TRACE
+/* The trace of a heap, mapped outside of it so that logging a call never
+ * allocates.
+ */
+
+struct s_heap_trace_s {
+  pthread_mutex_t lock;
+  int fd;
+  pid_t pid;                  /* A forked child does not write the file */
+  bool failed;                /* A write to the file failed */
+  uint64_t start_ns;
+  uint32_t count;             /* Records waiting in the buffer */
+  s_heap_trace_rec_t recs[S_HEAP_TRACE_BATCH];
+};
+
+/* Public calls the calling thread is in, the nested ones are not logged */
+
+static __thread uint32_t g_trace_depth;
+
+/**
+ * s_trace_now() - Read the monotonic clock.
+ *
+ * Return: The time in nanoseconds.
+ */
+static uint64_t s_trace_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * s_trace_flush() - Write the buffered records to the trace file.
+ *
+ * @trace: The trace, locked by the caller.
+ */
+static void s_trace_flush(struct s_heap_trace_s *trace)
+{
+  const uint8_t *buf = (const uint8_t *)trace->recs;
+  size_t len = trace->count * sizeof(s_heap_trace_rec_t);
+  ssize_t ret;
+
+  /* The records of a forked child are a copy of the ones of its parent
+   * and the ones it makes itself, they are dropped.
+   */
+
+  if (getpid() != trace->pid)
+    len = 0;
+
+  while (len > 0 && !trace->failed)
+  {
+    ret = write(trace->fd, buf, len);
+    if (ret < 0 && errno == EINTR)
+      continue;
+
+    if (ret <= 0)
+      trace->failed = true;
+    else
+    {
+      buf += ret;
+      len -= ret;
+    }
+  }
+
+  trace->count = 0;
+}
+#endif
+
+/**
+ * s_trace_enter() - Start a public call that may be logged.
+ *
+ * Return: The depth to give to s_trace_leave(), 0 for an outer call.
+ */
+static inline uint32_t s_trace_enter(void)
+{
+#ifdef S_HEAP_TRACE
+  return g_trace_depth++;
+#else
+  return 0;
+#endif
+}
+
+/**
+ * s_trace_record() - Append a call to the trace of a heap.
+ *
+ * @my_heap: The heap context.
+ * @op: The public call.
+ * @size: The requested size.
+ * @ptr: The chunk returned or released.
+ * @arg: The old chunk of a s_realloc() or the alignment.
+ */
+static inline void s_trace_record(heap_t *my_heap, s_heap_op_t op,
+                                  size_t size, const void *ptr,
+                                  uintptr_t arg)
+{
+#ifdef S_HEAP_TRACE
+  struct s_heap_trace_s *trace;
+  s_heap_trace_rec_t *rec;
+
+  /* s_heap_trace_stop() waits for the users before it unmaps the trace */
+
+  __atomic_fetch_add(&my_heap->trace_users, 1, __ATOMIC_SEQ_CST);
+  trace = __atomic_load_n(&my_heap->trace, __ATOMIC_SEQ_CST);
+  if (trace != NULL)
+  {
+    /* The time is read under the lock so the file is sorted by time */
+
+    pthread_mutex_lock(&trace->lock);
+    rec = &trace->recs[trace->count++];
+    rec->time_ns = s_trace_now() - trace->start_ns;
+    rec->op = op;
+    rec->size = size;
+    rec->ptr = (uintptr_t)ptr;
+    rec->arg = arg;
+
+    if (trace->count == S_HEAP_TRACE_BATCH)
+      s_trace_flush(trace);
+    pthread_mutex_unlock(&trace->lock);
+  }
+
+  __atomic_fetch_sub(&my_heap->trace_users, 1, __ATOMIC_RELEASE);
+#endif
+}
+
+/**
+ * s_trace_leave() - End a public call and log it if it is an outer one.
+ *
+ * @my_heap: The heap context.
+ * @depth: The value returned by s_trace_enter().
+ * @op: The public call.
+ * @size: The requested size.
+ * @ptr: The chunk returned or released, NULL if the call failed.
+ * @arg: The old chunk of a s_realloc() or the alignment.
+ */
+static inline void s_trace_leave(heap_t *my_heap, uint32_t depth,
+                                 s_heap_op_t op, size_t size,
+                                 const void *ptr, uintptr_t arg)
+{
+#ifdef S_HEAP_TRACE
+  g_trace_depth = depth;
+  if (depth == 0 && ptr != NULL)
+    s_trace_record(my_heap, op, size, ptr, arg);
+#endif
+}
+
+/**
+ * s_trace_batch() - End a batch call and log one record per chunk.
+ *
+ * @my_heap: The heap context.
+ * @depth: The value returned by s_trace_enter().
+ * @op: S_HEAP_OP_ALLOC or S_HEAP_OP_FREE.
+ * @ptrs: The chunks of the batch, NULL entries are skipped.
+ * @sizes: The requested sizes or NULL for a release.
+ * @num: The number of chunks.
+ */
+static inline void s_trace_batch(heap_t *my_heap, uint32_t depth,
+                                 s_heap_op_t op, void * const *ptrs,
+                                 const size_t *sizes, size_t num)
+{
+#ifdef S_HEAP_TRACE
+  g_trace_depth = depth;
+  if (depth != 0 ||
+      __atomic_load_n(&my_heap->trace, __ATOMIC_RELAXED) == NULL)
+    return;
+
+  for (size_t i = 0; i < num; i++)
+  {
+    if (ptrs[i] != NULL)
+      s_trace_record(my_heap, op, sizes ? sizes[i] : 0, ptrs[i], 0);
+  }
+#endif
+}
+
+/**
+ * s_node_set_mask() - Write the mask of a chunk header.
+ *
+ * @node: The chunk header.
+ * @mask: The new mask.
+ *
+ * The caller holds the lock bit of the header or the header is not
+ * reachable by other threads yet. The store is atomic because other
+ * threads may still load the word, see s_heap_mask.
+ */
+static inline void s_node_set_mask(mem_node_t *node, mem_mask_t mask)
+{
+  __atomic_store_n(&node->mask.word, mask.word, __ATOMIC_RELAXED);
+}
+
+/**
+ * s_node_dirty() - Clear the zeroed bit of a chunk.
+ *
+ * @node: The chunk header, see s_node_set_mask.
+ *
+ * Called once the payload of the chunk may have been written.
+ */
+static inline void s_node_dirty(mem_node_t *node)
+{
+  mem_mask_t mask = s_heap_mask(node);
+
+  mask.zeroed = 0;
+  s_node_set_mask(node, mask);
+}
+
+/**
+ * s_node_trylock() - Try to lock a chunk header.
+ *
+ * @my_heap: The heap context.
+ * @node: The chunk header.
+ *
+ * In thread-safe mode a header can only be changed by the thread that
+ * holds its lock bit. This covers the prev_free bit which is written by
+ * the owner of the previous chunk.
+ *
+ * Return: true if the lock was taken or the heap is not thread-safe.
+ */
+static inline bool s_node_trylock(heap_t *my_heap, mem_node_t *node)
+{
+  mem_mask_t old_mask, new_mask;
+
+  if (!my_heap->thread_safe)
+    return true;
+
+  old_mask = s_heap_mask(node);
+  if (old_mask.locked)
+    return false;
+
+  new_mask = old_mask;
+  new_mask.locked = 1;
+
+  return __atomic_compare_exchange_n(&node->mask.word, &old_mask.word,
+                                     new_mask.word, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/**
+ * s_node_lock() - Lock a chunk header.
+ *
+ * @my_heap: The heap context.
+ * @node: The chunk header.
+ *
+ * Headers are only locked in ascending address order with this function,
+ * going backwards has to use s_node_trylock to avoid deadlocks.
+ */
+static inline void s_node_lock(heap_t *my_heap, mem_node_t *node)
+{
+  while (!s_node_trylock(my_heap, node))
+    sched_yield();
+}
+
+/**
+ * s_node_unlock() - Unlock a chunk header.
+ *
+ * @my_heap: The heap context.
+ * @node: The chunk header or NULL.
+ */
+static inline void s_node_unlock(heap_t *my_heap, mem_node_t *node)
+{
+  mem_mask_t mask;
+
+  if (!my_heap->thread_safe || node == NULL)
+    return;
+
+  /* Nobody else writes the header while we hold the lock bit */
+
+  mask = s_heap_mask(node);
+  mask.locked = 0;
+  __atomic_store_n(&node->mask.word, mask.word, __ATOMIC_RELEASE);
+}
+
+/**
+ * s_bin_lock() - Lock the bins of a first level class.
+ *
+ * @my_heap: The heap context.
+ * @fl: The first level index.
+ */
+static inline void s_bin_lock(heap_t *my_heap, unsigned int fl)
+{
+  if (my_heap->thread_safe)
+    pthread_mutex_lock(&my_heap->bin_locks[fl]);
+}
+
+/**
+ * s_bin_unlock() - Unlock the bins of a first level class.
+ *
+ * @my_heap: The heap context.
+ * @fl: The first level index.
+ */
+static inline void s_bin_unlock(heap_t *my_heap, unsigned int fl)
+{
+  if (my_heap->thread_safe)
+    pthread_mutex_unlock(&my_heap->bin_locks[fl]);
+}
+
+/**
+ * s_bin_bitmap_update() - Set or clear bits in the first level bitmap.
+ *
+ * @my_heap: The heap context.
+ * @set: The bits to set.
+ * @clear: The bits to clear.
+ *
+ * The second level bitmaps are only written with their bin lock held but
+ * the first level bitmap is shared by all the bin locks.
+ */
+static inline void s_bin_bitmap_update(heap_t *my_heap, uint32_t set,
+                                       uint32_t clear)
+{
+  if (!my_heap->thread_safe)
+  {
+    my_heap->free_bins_bitmap = (my_heap->free_bins_bitmap | set) & ~clear;
+    return;
+  }
+
+  if (set)
+    __atomic_fetch_or(&my_heap->free_bins_bitmap, set, __ATOMIC_RELAXED);
+  if (clear)
+    __atomic_fetch_and(&my_heap->free_bins_bitmap, ~clear, __ATOMIC_RELAXED);
+}
+
+/**
+ * s_bin_count() - Account a free chunk that enters or leaves the bins.
+ *
+ * @my_heap: The heap context.
+ * @size: The chunk size in blocks number.
+ * @add: true when the chunk enters the bins.
+ *
+ * All the chunks of a power of two class land in the bins of one first
+ * level index with both engines, so the caller holds the only lock that
+ * protects the class counters.
+ */
+static inline void s_bin_count(heap_t *my_heap, size_t size, bool add)
+{
+  unsigned int cls = 31 - __builtin_clz((uint32_t)size);
+  size_t chunks = my_heap->bin_stats[cls].chunks;
+  size_t blocks = my_heap->bin_stats[cls].blocks;
+
+  __atomic_store_n(&my_heap->bin_stats[cls].chunks, add ? chunks + 1 : chunks - 1,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&my_heap->bin_stats[cls].blocks,
+                   add ? blocks + size : blocks - size, __ATOMIC_RELAXED);
+}
+
+/**
+ * s_stat_add() - Increment a heap counter.
+ *
+ * @my_heap: The heap context.
+ * @counter: One of the alloc/free counters of the heap.
+ * @n: The increment.
+ */
+static inline void s_stat_add(heap_t *my_heap, size_t *counter, size_t n)
+{
+  if (my_heap->thread_safe)
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+  else
+    *counter += n;
+}
+
+/**
+ * s_bin_unlink() - Remove a free chunk from a bin that is already locked.
+ *
+ * @my_heap: The heap context.
+ * @node: The free chunk.
+ * @fl: The first level index of the chunk.
+ * @sl: The second level index of the chunk.
+ */
+static inline void s_bin_unlink(heap_t *my_heap, mem_node_t *node,
+                                unsigned int fl, unsigned int sl)
+{
+  list_del(&node->node_list);
+  s_bin_count(my_heap, s_heap_mask(node).size, false);
+  if (list_empty(&my_heap->g_free_bins[fl][sl]))
+  {
+    uint32_t sl_map = my_heap->sl_bitmap[fl] & ~(1U << sl);
+
+    __atomic_store_n(&my_heap->sl_bitmap[fl], sl_map, __ATOMIC_RELAXED);
+    if (sl_map == 0)
+      s_bin_bitmap_update(my_heap, 0, 1U << fl);
+  }
+}
+
+/**
+ * s_node_epoch() - Get the purge epoch in which a free chunk was binned.
+ *
+ * @node: A free chunk that is not zeroed.
+ *
+ * The epoch follows the bin links, a purge clears it with the rest of the
+ * payload.
+ *
+ * Return: The address of the epoch.
+ */
+static inline uint32_t *s_node_epoch(mem_node_t *node)
+{
+  return (uint32_t *)(node + 1);
+}
+
+/**
+ * s_bin_insert() - Add a free chunk to the bin that matches its size.
+ *
+ * @my_heap: The heap context.
+ * @node: The free chunk.
+ *
+ * A dirty chunk that is large enough to be purged records the current
+ * purge epoch, the chunks are added at the head of the bins so every list
+ * goes from the newest to the oldest one.
+ */
+static void s_bin_insert(heap_t *my_heap, mem_node_t *node)
+{
+  mem_mask_t mask = s_heap_mask(node);
+  unsigned int fl, sl;
+
+  assert(mask.used == 0);
+
+  s_bin_mapping(my_heap, mask.size, &fl, &sl);
+
+  if (my_heap->purge_min != 0 && !mask.zeroed &&
+      mask.size * my_heap->block_size >= my_heap->purge_min &&
+      mask.size * my_heap->block_size >= sizeof(mem_node_t) +
+      sizeof(uint32_t) + sizeof(mem_footer_t))
+    *s_node_epoch(node) = __atomic_load_n(&my_heap->purge_epoch,
+                                          __ATOMIC_RELAXED);
+
+  s_bin_lock(my_heap, fl);
+  list_add(&node->node_list, &my_heap->g_free_bins[fl][sl]);
+  s_bin_count(my_heap, mask.size, true);
+  if (my_heap->sl_bitmap[fl] == 0)
+    s_bin_bitmap_update(my_heap, 1U << fl, 0);
+
+  __atomic_store_n(&my_heap->sl_bitmap[fl], my_heap->sl_bitmap[fl] | 1U << sl,
+                   __ATOMIC_RELAXED);
+  s_bin_unlock(my_heap, fl);
+}
+
+/**
+ * s_bin_remove() - Remove a free chunk from its bin.
+ *
+ * @my_heap: The heap context.
+ * @node: The free chunk.
+ */
+static void s_bin_remove(heap_t *my_heap, mem_node_t *node)
+{
+  unsigned int fl, sl;
+
+  s_bin_mapping(my_heap, s_heap_mask(node).size, &fl, &sl);
+
+  s_bin_lock(my_heap, fl);
+  s_bin_unlink(my_heap, node, fl, sl);
+  s_bin_unlock(my_heap, fl);
+}
+
+/**
+ * s_bin_find_suitable() - Find the first non-empty bin at or above a class.
+ *
+ * @my_heap: The heap context.
+ * @fl: In/out first level index.
+ * @sl: In/out second level index.
+ *
+ * In thread-safe mode the bitmaps are read without holding the bin locks
+ * so the caller has to check again that the bin is not empty.
+ *
+ * Return: true if a bin was found, false otherwise.
+ */
+static bool s_bin_find_suitable(heap_t *my_heap,
+                                unsigned int *fl, unsigned int *sl)
+{
+  uint32_t sl_map = 0;
+  uint32_t fl_map;
+
+  if (*sl < S_HEAP_SL_COUNT)
+    sl_map = __atomic_load_n(&my_heap->sl_bitmap[*fl], __ATOMIC_RELAXED) &
+      (~0U << *sl);
+
+  if (sl_map == 0)
+  {
+    if (*fl + 1 >= S_HEAP_FL_COUNT)
+      return false;
+
+    fl_map = __atomic_load_n(&my_heap->free_bins_bitmap, __ATOMIC_RELAXED) &
+      (~0U << (*fl + 1));
+    if (fl_map == 0)
+      return false;
+
+    *fl = __builtin_ctz(fl_map);
+    sl_map = __atomic_load_n(&my_heap->sl_bitmap[*fl], __ATOMIC_RELAXED);
+    if (sl_map == 0)
+      return false;
+  }
+
+  *sl = __builtin_ctz(sl_map);
+  return true;
+}
+
+/**
+ * s_bin_pop() - Take a free chunk out of a bin.
+ *
+ * @my_heap: The heap context.
+ * @fl: The first level index.
+ * @sl: The second level index.
+ * @blocks: The requested size in blocks number.
+ * @busy: Set to true if a chunk that fits was locked by another thread.
+ *
+ * Return the first chunk of the bin that can hold the requested size. In
+ * thread-safe mode the chunk is returned locked, chunks that are locked
+ * by other threads are skipped because their owner may be waiting for
+ * this bin.
+ *
+ * Return: The chunk removed from the bin or NULL.
+ */
+static mem_node_t *s_bin_pop(heap_t *my_heap, unsigned int fl,
+                             unsigned int sl, size_t blocks, bool *busy)
+{
+  mem_node_t *node = NULL;
+
+  s_bin_lock(my_heap, fl);
+
+  list_for_each_entry (node, &my_heap->g_free_bins[fl][sl], node_list)
+  {
+    s_prof_visit();
+    if (s_heap_mask(node).size < blocks)
+      continue;
+
+    if (s_node_trylock(my_heap, node))
+    {
+      s_bin_unlink(my_heap, node, fl, sl);
+      s_bin_unlock(my_heap, fl);
+      return node;
+    }
+
+    *busy = true;
+  }
+
+  s_bin_unlock(my_heap, fl);
+  return NULL;
+}
+
+/**
+ * s_bin_take() - Take a free chunk that can hold a number of blocks.
+ *
+ * @my_heap: The heap context.
+ * @blocks: The requested size in blocks number.
+ *
+ * The segregated engine searches the bin that matches the size first
+ * because its chunks are the closest fit. If nothing fits there, the first
+ * non-empty bin above it is found with a find-first-set on the bitmap and
+ * every chunk from that bin is large enough.
+ *
+ * The TLSF engine rounds the size up to the next class so that the head of
+ * any bin it finds is large enough and no list is ever walked.
+ *
+ * A bin whose chunks are all locked by other threads is passed over for
+ * the next one. Only when nothing was found and some chunks were locked
+ * the thread yields and searches again.
+ *
+ * Return: A free chunk removed from its bin or NULL if nothing fits.
+ */
+static mem_node_t *s_bin_take(heap_t *my_heap, size_t blocks)
+{
+  unsigned int fl, sl, start_fl, start_sl;
+  mem_node_t *node = NULL;
+  bool busy = false;
+
+  if (my_heap->mode == S_HEAP_MODE_TLSF)
+  {
+    size_t rounded = blocks;
+
+    if (blocks >= S_HEAP_SL_COUNT)
+    {
+      unsigned int msb = 31 - __builtin_clz((uint32_t)blocks);
+      rounded += (1U << (msb - S_HEAP_SL_LOG2)) - 1;
+    }
+
+    s_bin_mapping(my_heap, rounded, &fl, &sl);
+  }
+  else
+  {
+    s_bin_mapping(my_heap, blocks, &fl, &sl);
+    if (__atomic_load_n(&my_heap->sl_bitmap[fl], __ATOMIC_RELAXED) & 1U)
+    {
+      node = s_bin_pop(my_heap, fl, 0, blocks, &busy);
+      if (node != NULL)
+        return node;
+    }
+
+    sl = S_HEAP_SL_COUNT;
+  }
+
+  /* A bin can look non-empty and be drained by another thread before we
+   * lock it, or hold only chunks that other threads have locked. Go on
+   * with the next bin and search again from the same class after a yield
+   * as long as some chunks were locked.
+   */
+
+  start_fl = fl;
+  start_sl = sl;
+  for (;;)
+  {
+    while (s_bin_find_suitable(my_heap, &fl, &sl))
+    {
+      node = s_bin_pop(my_heap, fl, sl, blocks, &busy);
+      if (node != NULL)
+        return node;
+
+      sl++;
+    }
+
+    if (!busy)
+      return NULL;
+
+    sched_yield();
+    fl = start_fl;
+    sl = start_sl;
+    busy = false;
+  }
+}
+
+/**
+ * s_next_node() - Get the physical neighbour that follows a chunk.
+ *
+ * @my_heap: The heap context.
+ * @node: The current chunk.
+ *
+ * Return: The next chunk header or NULL if this is the last chunk of its
+ * segment.
+ */
+static inline mem_node_t *s_next_node(heap_t *my_heap, mem_node_t *node)
+{
+  mem_node_t *next_node = (mem_node_t *)((uint8_t *)node +
+    s_heap_mask(node).size * my_heap->block_size);
+
+  /* Only the fence that ends a segment has a zero size */
+
+  return s_heap_mask(next_node).size != 0 ? next_node : NULL;
+}
+
+/**
+ * s_segment_of() - Find the segment that holds an address.
+ *
+ * @my_heap: The heap context.
+ * @addr: The address.
+ *
+ * Return: The segment or NULL if no segment holds addr.
+ */
+static inline s_heap_seg_t *s_segment_of(heap_t *my_heap, uintptr_t addr)
+{
+  s_heap_seg_t *seg = &my_heap->first_segment;
+
+  for (; seg != NULL; seg = __atomic_load_n(&seg->next, __ATOMIC_ACQUIRE))
+  {
+    if (addr - seg->start < seg->end - seg->start)
+      return seg;
+  }
+
+  return NULL;
+}
+
+/**
+ * s_node_footer() - Get the boundary tag of a chunk.
+ *
+ * @my_heap: The heap context.
+ * @node: The chunk header.
+ *
+ * Return: The footer placed in the last bytes of the chunk.
+ */
+static inline mem_footer_t *s_node_footer(heap_t *my_heap, mem_node_t *node)
+{
+  return (mem_footer_t *)((uint8_t *)node +
+                          s_heap_mask(node).size * my_heap->block_size) - 1;
+}
+
+/**
+ * s_prev_node() - Get the free physical neighbour that precedes a chunk.
+ *
+ * @my_heap: The heap context.
+ * @node: The current chunk.
+ *
+ * The previous chunk is only reachable when it is free because this is
+ * the only case when it carries a boundary tag.
+ *
+ * Return: The previous chunk header or NULL if it is not free.
+ */
+static inline mem_node_t *s_prev_node(heap_t *my_heap, mem_node_t *node)
+{
+  mem_node_t *prev_node;
+
+  if (s_heap_mask(node).prev_free == 0)
+    return NULL;
+
+  prev_node = ((mem_footer_t *)node - 1)->node;
+
+  assert(prev_node < node);
+  assert(s_heap_mask(prev_node).used == 0);
+  assert(s_node_footer(my_heap, prev_node) == (mem_footer_t *)node - 1);
+
+  return prev_node;
+}
+
+/**
+ * s_mark_free() - Tag a chunk as free.
+ *
+ * @my_heap: The heap context.
+ * @node: The chunk header.
+ *
+ * Write the boundary tag of the chunk and let the next chunk know that its
+ * previous neighbour can be merged.
+ */
+static inline void s_mark_free(heap_t *my_heap, mem_node_t *node)
+{
+  mem_node_t *next_node = s_next_node(my_heap, node);
+  mem_mask_t mask = s_heap_mask(node);
+
+  mask.used = 0;
+  s_node_set_mask(node, mask);
+  node->magic = S_HEAP_MAGIC_FREE;
+  s_node_footer(my_heap, node)->node = node;
+
+  if (next_node != NULL)
+  {
+    mask = s_heap_mask(next_node);
+    mask.prev_free = 1;
+    s_node_set_mask(next_node, mask);
+  }
+}
+
+/**
+ * s_mark_used() - Tag a chunk as used.
+ *
+ * @my_heap: The heap context.
+ * @node: The chunk header.
+ */
+static inline void s_mark_used(heap_t *my_heap, mem_node_t *node)
+{
+  mem_node_t *next_node = s_next_node(my_heap, node);
+  mem_mask_t mask = s_heap_mask(node);
+
+  mask.used = 1;
+  s_node_set_mask(node, mask);
+  node->magic = S_HEAP_MAGIC_USED;
+
+  if (next_node != NULL)
+  {
+    mask = s_heap_mask(next_node);
+    mask.prev_free = 0;
+    s_node_set_mask(next_node, mask);
+  }
+}
+
+/**
+ * s_ptr_to_node() - Get the header of an allocated chunk.
+ *
+ * @my_heap: The heap context.
+ * @ptr: The pointer returned by s_alloc.
+ *
+ * The header sits right before the payload. Debug builds validate it by
+ * checking that it lives inside a segment on a chunk boundary and that its
+ * magic marks it as used.
+ *
+ * Return: The chunk header.
+ */
+static inline mem_node_t *s_ptr_to_node(heap_t *my_heap, void *ptr)
+{
+  mem_node_t *node = s_heap_node(ptr);
+
+  /* The specified input address for this function is invalid.
+   * Did we encounter a double free memory corruption ?
+   */
+
+  assert(s_segment_of(my_heap, (uintptr_t)node) != NULL);
+  assert((((uintptr_t)node - s_segment_of(my_heap, (uintptr_t)node)->start) &
+          (my_heap->block_size - 1)) == 0);
+  assert(node->magic == S_HEAP_MAGIC_USED && s_heap_mask(node).used == 1);
+
+  return node;
+}
+
+/**
+ * s_node_payload() - Get the payload of a chunk.
+ *
+ * @node: The chunk header.
+ *
+ * Return: The first byte after the header.
+ */
+static inline void *s_node_payload(mem_node_t *node)
+{
+  return (uint8_t *)node + S_HEAP_HDR_SIZE;
+}
+
+/**
+ * s_node_absorb() - Merge a chunk into the chunk that precedes it.
+ *
+ * @node: The chunk that grows.
+ * @next_node: The chunk that follows it, already out of its bin.
+ *
+ * When both chunks are zeroed the boundary tag of node and the header and
+ * links of next_node become payload, they are cleared so that the merged
+ * chunk stays zeroed.
+ */
+static inline void s_node_absorb(mem_node_t *node, mem_node_t *next_node)
+{
+  mem_mask_t next_mask = s_heap_mask(next_node);
+  mem_mask_t mask = s_heap_mask(node);
+
+  /* The header of next_node is cleared below, read its mask first */
+
+  if (mask.zeroed && next_mask.zeroed)
+    memset((uint8_t *)next_node - sizeof(mem_footer_t), 0,
+           sizeof(mem_footer_t) + sizeof(mem_node_t));
+  else
+    mask.zeroed = 0;
+
+  mask.size += next_mask.size;
+  s_node_set_mask(node, mask);
+}
+
+/**
+ * s_wild_lock() - Lock the wilderness pointer.
+ *
+ * @my_heap: The heap context.
+ *
+ * It is taken after chunk locks, so the wilderness header itself can only
+ * be try-locked while holding it.
+ */
+static inline void s_wild_lock(heap_t *my_heap)
+{
+  if (my_heap->thread_safe)
+    pthread_mutex_lock(&my_heap->wild_lock);
+}
+
+/**
+ * s_wild_unlock() - Unlock the wilderness pointer.
+ *
+ * @my_heap: The heap context.
+ */
+static inline void s_wild_unlock(heap_t *my_heap)
+{
+  if (my_heap->thread_safe)
+    pthread_mutex_unlock(&my_heap->wild_lock);
+}
+
+/**
+ * s_is_wild() - Check if a chunk is the wilderness.
+ *
+ * @my_heap: The heap context.
+ * @node: A chunk locked by the caller.
+ *
+ * Return: true if node is the wilderness.
+ */
+static inline bool s_is_wild(heap_t *my_heap, mem_node_t *node)
+{
+  return node == __atomic_load_n(&my_heap->wilderness, __ATOMIC_RELAXED);
+}
+
+/**
+ * s_wild_carve() - Cut a chunk from the front of the wilderness.
+ *
+ * @my_heap: The heap context.
+ * @node: The wilderness, locked by the caller with the wilderness lock.
+ * @blocks: The size of the chunk, at most the wilderness size.
+ *
+ * The wilderness moves past the chunk or disappears when what is left
+ * cannot hold a free chunk. The chunk stays free, out of the bins and
+ * locked, and it is zeroed if it lies above the untouched mark.
+ */
+static void s_wild_carve(heap_t *my_heap, mem_node_t *node, size_t blocks)
+{
+  mem_mask_t mask = s_heap_mask(node);
+  mem_node_t *rest = NULL;
+  uintptr_t end = my_heap->wild_end;
+
+  assert(mask.size >= blocks);
+
+  mask.zeroed = (uintptr_t)node >= my_heap->untouched;
+
+  if (mask.size >= blocks + my_heap->min_blocks)
+  {
+    rest = (mem_node_t *)((uint8_t *)node + blocks * my_heap->block_size);
+    s_node_set_mask(rest, (mem_mask_t) {
+      .used = 0,
+      .prev_free = 0,
+      .size = mask.size - blocks,
+    });
+    rest->magic = S_HEAP_MAGIC_FREE;
+    mask.size = blocks;
+    end = (uintptr_t)rest;
+  }
+
+  s_node_set_mask(node, mask);
+
+  if (end > my_heap->untouched)
+    my_heap->untouched = end;
+
+  __atomic_store_n(&my_heap->wilderness, rest, __ATOMIC_RELAXED);
+}
+
+/**
+ * s_wild_take() - Bump a chunk out of the wilderness.
+ *
+ * @my_heap: The heap context.
+ * @blocks: The requested size in blocks number.
+ *
+ * Return: A free chunk that is not in the bins or NULL if the wilderness
+ * is too small.
+ */
+static mem_node_t *s_wild_take(heap_t *my_heap, size_t blocks)
+{
+  mem_node_t *node;
+
+  s_wild_lock(my_heap);
+  while ((node = my_heap->wilderness) != NULL &&
+         !s_node_trylock(my_heap, node))
+  {
+    s_wild_unlock(my_heap);
+    sched_yield();
+    s_wild_lock(my_heap);
+  }
+
+  if (node != NULL && s_heap_mask(node).size < blocks)
+  {
+    s_node_unlock(my_heap, node);
+    node = NULL;
+  }
+
+  if (node != NULL)
+    s_wild_carve(my_heap, node, blocks);
+
+  s_wild_unlock(my_heap);
+  return node;
+}
+
+/**
+ * s_node_release() - Give a free chunk back to the heap.
+ *
+ * @my_heap: The heap context.
+ * @node: The merged free chunk, locked by the caller.
+ *
+ * A chunk that reaches the end of the last segment becomes the wilderness,
+ * any other one goes to the bin that matches its size.
+ */
+static void s_node_release(heap_t *my_heap, mem_node_t *node)
+{
+  mem_mask_t mask = s_heap_mask(node);
+
+  if (s_next_node(my_heap, node) == NULL)
+  {
+    s_wild_lock(my_heap);
+    if ((uintptr_t)node + mask.size * my_heap->block_size ==
+        my_heap->wild_end)
+    {
+      mask.used = 0;
+      mask.zeroed = 0;
+      s_node_set_mask(node, mask);
+      node->magic = S_HEAP_MAGIC_FREE;
+
+      __atomic_store_n(&my_heap->wilderness, node, __ATOMIC_RELAXED);
+      s_wild_unlock(my_heap);
+      return;
+    }
+
+    s_wild_unlock(my_heap);
+  }
+
+  s_mark_free(my_heap, node);
+  s_bin_insert(my_heap, node);
+}
+
+/**
+ * s_seg_format() - Lay out the chunks of a new segment.
+ *
+ * @my_heap: The heap context.
+ * @seg: The segment descriptor.
+ * @start: The first byte available for chunks.
+ * @end: The end of the region.
+ *
+ * The segment gets one free chunk followed by the fence. Nothing else in
+ * the region is written.
+ *
+ * Return: The free chunk or NULL if the region is too small.
+ */
+static mem_node_t *s_seg_format(heap_t *my_heap, s_heap_seg_t *seg,
+                                uintptr_t start, uintptr_t end)
+{
+  size_t block_size = my_heap->block_size;
+  uintptr_t first = ((start + S_HEAP_HDR_SIZE + block_size - 1) &
+                     ~(block_size - 1)) - S_HEAP_HDR_SIZE;
+  mem_node_t *node, *fence;
+  size_t blocks;
+
+  if (end < first + my_heap->min_blocks * block_size + S_HEAP_HDR_SIZE)
+    return NULL;
+
+  blocks = (end - first - S_HEAP_HDR_SIZE) / block_size;
+  if (blocks > S_HEAP_MAX_BLOCKS)
+    blocks = S_HEAP_MAX_BLOCKS;
+
+  node = (mem_node_t *)first;
+  node->mask = (mem_mask_t) {
+    .used = 0,
+    .prev_free = 0,
+    .size = blocks,
+  };
+  node->magic = S_HEAP_MAGIC_FREE;
+
+  fence = (mem_node_t *)(first + blocks * block_size);
+  fence->mask = (mem_mask_t) {
+    .used = 1,
+    .prev_free = 0,
+    .size = 0,
+  };
+  fence->magic = S_HEAP_MAGIC_FENCE;
+
+  seg->next = NULL;
+  seg->start = first;
+  seg->end = (uintptr_t)fence;
+  seg->map_len = 0;
+
+  return node;
+}
+
+/**
+ * s_heap_add_segment() - Make a region the last segment of a heap.
+ *
+ * @my_heap: The heap context.
+ * @start: The start of the region.
+ * @end: The end of the region.
+ * @map_len: The length to unmap when the heap is destroyed or 0.
+ * @zeroed: The region is zero filled.
+ *
+ * The segment descriptor is stored at the start of the region. The free
+ * space of the segment becomes the wilderness and the previous wilderness
+ * goes to the bins.
+ *
+ * Return: 0 on success, -1 if the region is too small.
+ */
+static int s_heap_add_segment(heap_t *my_heap, void *start, void *end,
+                              size_t map_len, bool zeroed)
+{
+  s_heap_seg_t *seg = (s_heap_seg_t *)(((uintptr_t)start +
+    sizeof(void *) - 1) & ~(sizeof(void *) - 1));
+  mem_node_t *node, *old_wild;
+
+  if ((uintptr_t)end <= (uintptr_t)(seg + 1))
+    return -1;
+
+  node = s_seg_format(my_heap, seg, (uintptr_t)(seg + 1), (uintptr_t)end);
+  if (node == NULL)
+    return -1;
+
+  seg->map_len = map_len;
+
+  s_wild_lock(my_heap);
+  while ((old_wild = my_heap->wilderness) != NULL &&
+         !s_node_trylock(my_heap, old_wild))
+  {
+    s_wild_unlock(my_heap);
+    sched_yield();
+    s_wild_lock(my_heap);
+  }
+
+  if (old_wild != NULL)
+  {
+    mem_mask_t mask = s_heap_mask(old_wild);
+
+    mask.zeroed = (uintptr_t)old_wild >= my_heap->untouched;
+    s_node_set_mask(old_wild, mask);
+  }
+
+  seg->next = my_heap->first_segment.next;
+  __atomic_store_n(&my_heap->first_segment.next, seg, __ATOMIC_RELEASE);
+
+  my_heap->num_blocks += s_heap_mask(node).size;
+  my_heap->total_size += s_heap_mask(node).size * my_heap->block_size;
+
+  my_heap->wild_end = seg->end;
+  my_heap->untouched = zeroed ? (uintptr_t)node : seg->end;
+  __atomic_store_n(&my_heap->wilderness, node, __ATOMIC_RELAXED);
+  s_wild_unlock(my_heap);
+
+  if (old_wild != NULL)
+  {
+    s_mark_free(my_heap, old_wild);
+    s_bin_insert(my_heap, old_wild);
+    s_node_unlock(my_heap, old_wild);
+  }
+
+  return 0;
+}
+
+/**
+ * s_map_region() - Map anonymous memory for a heap region.
+ *
+ * @len: The length of the region, a multiple of S_HEAP_HUGE_PAGE_SIZE
+ *       for huge pages and of the page size otherwise.
+ * @huge: Back the region with huge pages.
+ *
+ * Reserved huge pages are used when the system has them. Otherwise a
+ * region aligned to the huge page size is cut out of a larger mapping and
+ * the kernel is asked to back it with transparent huge pages.
+ *
+ * Return: The region or NULL if it could not be mapped.
+ */
+static void *s_map_region(size_t len, bool huge)
+{
+  const int prot = PROT_READ | PROT_WRITE;
+  const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  uint8_t *map, *aligned;
+
+  if (!huge)
+  {
+    map = mmap(NULL, len, prot, flags, -1, 0);
+    return map == MAP_FAILED ? NULL : map;
+  }
+
+#ifdef MAP_HUGETLB
+  map = mmap(NULL, len, prot, flags | MAP_HUGETLB, -1, 0);
+  if (map != MAP_FAILED)
+    return map;
+#endif
+
+  map = mmap(NULL, len + S_HEAP_HUGE_PAGE_SIZE, prot, flags, -1, 0);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  aligned = (uint8_t *)(((uintptr_t)map + S_HEAP_HUGE_PAGE_SIZE - 1) &
+                        ~(S_HEAP_HUGE_PAGE_SIZE - 1));
+  if (aligned != map)
+    munmap(map, aligned - map);
+
+  munmap(aligned + len, map + S_HEAP_HUGE_PAGE_SIZE - aligned);
+
+#ifdef MADV_HUGEPAGE
+  madvise(aligned, len, MADV_HUGEPAGE);
+#endif
+
+  return aligned;
+}
+
+/**
+ * s_heap_grow() - Map a new segment for a request that does not fit.
+ *
+ * @my_heap: The heap context.
+ * @blocks: The requested size in blocks number.
+ *
+ * Return: 0 if a segment was added, -1 otherwise.
+ */
+static int s_heap_grow(heap_t *my_heap, size_t blocks)
+{
+  size_t page_size = my_heap->huge_pages ? S_HEAP_HUGE_PAGE_SIZE :
+    sysconf(_SC_PAGESIZE);
+  size_t len;
+  void *map;
+
+  if (my_heap->grow_size == 0)
+    return -1;
+
+  /* Room for the descriptor, the alignment of the first header and the
+   * fence.
+   */
+
+  len = blocks * my_heap->block_size + sizeof(s_heap_seg_t) +
+    2 * my_heap->block_size;
+  if (len < my_heap->grow_size)
+    len = my_heap->grow_size;
+
+  len = (len + page_size - 1) & ~(page_size - 1);
+
+  map = s_map_region(len, my_heap->huge_pages);
+  if (map == NULL)
+    return -1;
+
+  if (s_heap_add_segment(my_heap, map, (uint8_t *)map + len, len, true) != 0)
+  {
+    munmap(map, len);
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * s_release_tail() - Give back the end of a used chunk to the free bins.
+ *
+ * @my_heap: The heap context.
+ * @node: The used chunk.
+ * @blocks: The number of blocks the chunk keeps.
+ * @next_node: The chunk that follows node in memory or NULL.
+ *
+ * Split the chunk if the remaining space can hold a free chunk, otherwise
+ * the chunk is left untouched. The released tail is merged with the next
+ * chunk in memory if that one is free, including the wilderness.
+ *
+ * In thread-safe mode the caller holds the locks of node and next_node.
+ * When next_node is merged its header disappears, so the lock is moved to
+ * the chunk that follows it.
+ *
+ * Return: The chunk that follows node and its tail, the caller unlocks it.
+ */
+static mem_node_t *s_release_tail(heap_t *my_heap, mem_node_t *node,
+                                  size_t blocks, mem_node_t *next_node)
+{
+  mem_mask_t mask = s_heap_mask(node);
+  mem_node_t *free_node;
+
+  if (mask.size < blocks + my_heap->min_blocks)
+    return next_node;
+
+  free_node = (mem_node_t *)((uint8_t *)node + blocks * my_heap->block_size);
+  s_node_set_mask(free_node, (mem_mask_t) {
+    .used = 0,
+    .prev_free = 0,
+    .zeroed = mask.zeroed,
+    .size = mask.size - blocks,
+  });
+  mask.size = blocks;
+  s_node_set_mask(node, mask);
+
+  if (next_node != NULL && s_heap_mask(next_node).used == 0)
+  {
+    mem_node_t *next_next_node = s_next_node(my_heap, next_node);
+    if (next_next_node != NULL)
+      s_node_lock(my_heap, next_next_node);
+
+    if (!s_is_wild(my_heap, next_node))
+      s_bin_remove(my_heap, next_node);
+
+    s_node_absorb(free_node, next_node);
+    next_node = next_next_node;
+  }
+
+  s_node_release(my_heap, free_node);
+
+  return next_node;
+}
+
+/**
+ * s_node_pages() - Get the whole pages inside a free chunk.
+ *
+ * @my_heap: The heap context.
+ * @node: A free chunk.
+ * @page_size: The OS page size.
+ * @page_start: Output start of the first page after the bin links.
+ * @page_end: Output end of the last page before the boundary tag.
+ *
+ * Return: true if the chunk holds at least one whole page.
+ */
+static inline bool s_node_pages(heap_t *my_heap, mem_node_t *node,
+                                size_t page_size, uintptr_t *page_start,
+                                uintptr_t *page_end)
+{
+  uintptr_t start = (uintptr_t)s_node_payload(node) + sizeof(struct list_head);
+  uintptr_t end = (uintptr_t)s_node_footer(my_heap, node);
+
+  *page_start = (start + page_size - 1) & ~(page_size - 1);
+  *page_end = end & ~(page_size - 1);
+
+  return *page_end > *page_start;
+}
+
+/**
+ * s_node_purge() - Give the pages of a free chunk back to the OS.
+ *
+ * @my_heap: The heap context.
+ * @node: A free chunk in a bin, locked by the caller.
+ * @page_size: The OS page size.
+ *
+ * The bin links and the boundary tag are kept, the pages between them are
+ * released and the partial pages at both ends are cleared, so the chunk
+ * becomes zeroed.
+ *
+ * Return: The number of bytes given back.
+ */
+static size_t s_node_purge(heap_t *my_heap, mem_node_t *node,
+                           size_t page_size)
+{
+  uintptr_t start = (uintptr_t)s_node_payload(node) + sizeof(struct list_head);
+  uintptr_t end = (uintptr_t)s_node_footer(my_heap, node);
+  mem_mask_t mask = s_heap_mask(node);
+  uintptr_t page_start, page_end;
+
+  if (mask.zeroed ||
+      !s_node_pages(my_heap, node, page_size, &page_start, &page_end))
+    return 0;
+
+  if (madvise((void *)page_start, page_end - page_start, MADV_DONTNEED) != 0)
+    return 0;
+
+  memset((void *)start, 0, page_start - start);
+  memset((void *)page_end, 0, end - page_end);
+  mask.zeroed = 1;
+  s_node_set_mask(node, mask);
+
+  return page_end - page_start;
+}
+
+/**
+ * s_wild_purge() - Give the used pages of the wilderness back to the OS.
+ *
+ * @my_heap: The heap context.
+ * @page_size: The OS page size.
+ *
+ * Everything from the wilderness up to the untouched mark was handed out
+ * before. Once it is released the mark moves down to the wilderness.
+ *
+ * Return: The number of bytes given back.
+ */
+static size_t s_wild_purge(heap_t *my_heap, size_t page_size)
+{
+  uintptr_t start, end, page_start, page_end;
+  mem_node_t *node;
+  size_t purged = 0;
+
+  s_wild_lock(my_heap);
+  while ((node = my_heap->wilderness) != NULL &&
+         !s_node_trylock(my_heap, node))
+  {
+    s_wild_unlock(my_heap);
+    sched_yield();
+    s_wild_lock(my_heap);
+  }
+
+  if (node == NULL)
+  {
+    s_wild_unlock(my_heap);
+    return 0;
+  }
+
+  start = (uintptr_t)s_node_payload(node);
+  end = my_heap->untouched;
+  page_start = (start + page_size - 1) & ~(page_size - 1);
+  page_end = (end + page_size - 1) & ~(page_size - 1);
+  if (page_end > my_heap->wild_end)
+    page_end = my_heap->wild_end & ~(page_size - 1);
+
+  if (page_end > page_start &&
+      madvise((void *)page_start, page_end - page_start, MADV_DONTNEED) == 0)
+  {
+    memset((void *)start, 0, page_start - start);
+    if (end > page_end)
+      memset((void *)page_end, 0, end - page_end);
+
+    my_heap->untouched = (uintptr_t)node;
+    purged = page_end - page_start;
+  }
+
+  s_node_unlock(my_heap, node);
+  s_wild_unlock(my_heap);
+
+  return purged;
+}
+
+/**
+ * s_bin_purge_batch() - Lock a batch of free chunks of a class to purge.
+ *
+ * @my_heap: The heap context.
+ * @fl: The first level index of the class.
+ * @min_blocks: The smallest chunk that is purged in blocks.
+ * @page_size: The OS page size.
+ * @epoch: Only take the chunks binned before this purge epoch or take all
+ *         of them if NULL.
+ * @batch: Output array of S_HEAP_PURGE_BATCH locked chunks.
+ *
+ * The chunks stay in their bins locked, so the other threads skip them
+ * while their pages are released without the bin lock. The lists are
+ * walked from the oldest chunk and the walk stops at the first chunk that
+ * is too young.
+ *
+ * Return: The number of chunks in the batch.
+ */
+static size_t s_bin_purge_batch(heap_t *my_heap, unsigned int fl,
+                                size_t min_blocks, size_t page_size,
+                                const uint32_t *epoch, mem_node_t **batch)
+{
+  uintptr_t page_start, page_end;
+  size_t num = 0;
+  unsigned int sl;
+  mem_node_t *node;
+
+  s_bin_lock(my_heap, fl);
+  for (sl = 0; sl < S_HEAP_SL_COUNT && num < S_HEAP_PURGE_BATCH; sl++)
+  {
+    list_for_each_entry_reverse (node, &my_heap->g_free_bins[fl][sl],
+                                 node_list)
+    {
+      s_prof_visit();
+      if (s_heap_mask(node).zeroed || s_heap_mask(node).size < min_blocks ||
+          !s_node_pages(my_heap, node, page_size, &page_start, &page_end) ||
+          !s_node_trylock(my_heap, node))
+        continue;
+
+      if (epoch != NULL && (int32_t)(*epoch - *s_node_epoch(node)) < 1)
+      {
+        s_node_unlock(my_heap, node);
+        break;
+      }
+
+      batch[num++] = node;
+      if (num == S_HEAP_PURGE_BATCH)
+        break;
+    }
+  }
+  s_bin_unlock(my_heap, fl);
+
+  return num;
+}
+
+/**
+ * s_heap_purge() - Give the pages of the large free chunks back to the OS.
+ *
+ * @my_heap: The heap context.
+ * @min_len: The smallest chunk that is purged in bytes.
+ * @epoch: Only purge the chunks binned before this purge epoch, at most
+ *         S_HEAP_PURGE_BATCH of them per class, or all of them if NULL.
+ *
+ * Chunks that are zeroed already are skipped, so only the memory that was
+ * freed since the last purge is released. Chunks locked by other threads
+ * are left for the next purge.
+ *
+ * Return: The number of bytes given back.
+ */
+static size_t s_heap_purge(heap_t *my_heap, size_t min_len,
+                           const uint32_t *epoch)
+{
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t min_blocks = (min_len + my_heap->block_size - 1) /
+    my_heap->block_size;
+  size_t purged = s_wild_purge(my_heap, page_size);
+  mem_node_t *batch[S_HEAP_PURGE_BATCH];
+  size_t num, batch_purged;
+  unsigned int fl, sl;
+
+  if (min_blocks > S_HEAP_MAX_BLOCKS)
+    return purged;
+
+  s_bin_mapping(my_heap, min_blocks, &fl, &sl);
+
+  for (; fl < S_HEAP_FL_COUNT; fl++)
+  {
+    do
+    {
+      if (__atomic_load_n(&my_heap->sl_bitmap[fl], __ATOMIC_RELAXED) == 0)
+        break;
+
+      num = s_bin_purge_batch(my_heap, fl, min_blocks, page_size, epoch,
+                              batch);
+      batch_purged = 0;
+      for (size_t i = 0; i < num; i++)
+      {
+        batch_purged += s_node_purge(my_heap, batch[i], page_size);
+        s_node_unlock(my_heap, batch[i]);
+      }
+
+      purged += batch_purged;
+    } while (epoch == NULL && num == S_HEAP_PURGE_BATCH && batch_purged != 0);
+  }
+
+  return purged;
+}
+
+/**
+ * s_heap_compact() - Merge the runs of free chunks of every segment.
+ *
+ * @my_heap: The heap context.
+ *
+ * The chunks are locked hand over hand in ascending address order, so a
+ * free chunk that is in use by another thread (taken from its bin but not
+ * marked used yet) is never touched. A merged run goes back to its bin or
+ * becomes the wilderness.
+ *
+ * Return: The number of free chunks that were merged into another one.
+ */
+static size_t s_heap_compact(heap_t *my_heap)
+{
+  s_heap_seg_t *seg = &my_heap->first_segment;
+  mem_node_t *node, *next_node;
+  size_t merged = 0;
+  bool taken;
+
+  __atomic_store_n(&my_heap->defer_count, 0, __ATOMIC_RELAXED);
+
+  for (; seg != NULL; seg = __atomic_load_n(&seg->next, __ATOMIC_ACQUIRE))
+  {
+    node = (mem_node_t *)seg->start;
+    s_node_lock(my_heap, node);
+    taken = false;
+
+    while ((next_node = s_next_node(my_heap, node)) != NULL)
+    {
+      s_node_lock(my_heap, next_node);
+      s_prof_visit();
+
+      if (s_heap_mask(node).used == 0 && s_heap_mask(next_node).used == 0 &&
+          !s_is_wild(my_heap, node))
+      {
+        if (!taken)
+        {
+          s_bin_remove(my_heap, node);
+          taken = true;
+        }
+
+        if (!s_is_wild(my_heap, next_node))
+          s_bin_remove(my_heap, next_node);
+
+        s_node_absorb(node, next_node);
+        merged++;
+        continue;
+      }
+
+      if (taken)
+        s_node_release(my_heap, node);
+
+      s_node_unlock(my_heap, node);
+      node = next_node;
+      taken = false;
+    }
+
+    if (taken)
+      s_node_release(my_heap, node);
+
+    s_node_unlock(my_heap, node);
+  }
+
+  return merged;
+}
+
+/**
+ * s_chunk_take() - Find a free chunk for an allocation.
+ *
+ * @my_heap: The heap context.
+ * @blocks: The requested size in blocks number.
+ *
+ * The bins are searched first, then the wilderness. When coalescing is
+ * deferred the free chunks are compacted before the heap grows.
+ *
+ * Return: A free chunk out of the bins and locked or NULL.
+ */
+static mem_node_t *s_chunk_take(heap_t *my_heap, size_t blocks)
+{
+  mem_node_t *node = s_bin_take(my_heap, blocks);
+
+  if (node != NULL)
+    return node;
+
+  node = s_wild_take(my_heap, blocks);
+  if (node == NULL && my_heap->defer_coalescing && s_heap_compact(my_heap))
+  {
+    node = s_bin_take(my_heap, blocks);
+    if (node == NULL)
+      node = s_wild_take(my_heap, blocks);
+  }
+
+  while (node == NULL && s_heap_grow(my_heap, blocks) == 0)
+    node = s_wild_take(my_heap, blocks);
+
+  return node;
+}
+
+/**
+ * s_init() - Initialize heap memory.
+ *
+ * @start_heap_unaligned: The start of the unaligned memory region for HEAP.
+ * @end_heap: The end of the HEAP region.
+ *
+ * Initialize a heap strucure with the default segregated engine.
+ *
+ * Return: No return value.
+ */
+void s_init(heap_t *my_heap,
+            void *start_heap_unaligned,
+            void *end_heap)
+{
+  s_init_mode(my_heap, start_heap_unaligned, end_heap,
+              S_HEAP_MODE_SEGREGATED);
+}
+
+/**
+ * s_init_mode() - Initialize heap memory with a specific allocation engine.
+ *
+ * @start_heap_unaligned: The start of the unaligned memory region for HEAP.
+ * @end_heap: The end of the HEAP region.
+ * @mode: The engine used to search the free bins.
+ *
+ * Initialize a heap strucure with the default block size.
+ *
+ * Return: No return value.
+ */
+void s_init_mode(heap_t *my_heap,
+                 void *start_heap_unaligned,
+                 void *end_heap,
+                 s_heap_mode_t mode)
+{
+  s_heap_config_t config = {
+    .mode = mode,
+  };
+
+  s_init_ex(my_heap, start_heap_unaligned, end_heap, &config);
+}
+
+/**
+ * s_init_ex() - Initialize heap memory with a specific configuration.
+ *
+ * @start_heap_unaligned: The start of the unaligned memory region for HEAP.
+ * @end_heap: The end of the HEAP region.
+ * @config: The heap configuration or NULL for the defaults.
+ *
+ * Initialize a heap strucure and create the first free node that will hold
+ * all the blocks.
+ *
+ * Return: 0 on success, -1 if the configuration is invalid.
+ */
+int s_init_ex(heap_t *my_heap,
+              void *start_heap_unaligned,
+              void *end_heap,
+              const s_heap_config_t *config)
+{
+  s_heap_config_t defaults = { 0 };
+  size_t block_size, alignment;
+  mem_node_t *start_node = NULL;
+  s_heap_seg_t *seg;
+
+  if (config == NULL)
+    config = &defaults;
+
+  block_size = config->block_size ? config->block_size : S_HEAP_BLOCK_SIZE;
+  alignment = config->alignment > block_size ? config->alignment : block_size;
+
+  if (my_heap == NULL ||
+      start_heap_unaligned == NULL ||
+      end_heap <= start_heap_unaligned ||
+      block_size < S_HEAP_HDR_SIZE ||
+      (block_size & (block_size - 1)) != 0 ||
+      (alignment & (alignment - 1)) != 0)
+    {
+      assert(false);
+      return -1;
+    }
+
+  /* Save the block size */
+
+  my_heap->block_size = block_size;
+  my_heap->alignment = alignment;
+  my_heap->heap_memory_end = end_heap;
+  my_heap->heap_mem_start_unaligned = start_heap_unaligned;
+
+  my_heap->mode = config->mode;
+  my_heap->thread_safe = false;
+
+  for (int fl = 0; fl < S_HEAP_FL_COUNT; fl++)
+  {
+    for (int sl = 0; sl < S_HEAP_SL_COUNT; sl++)
+      INIT_LIST_HEAD(&my_heap->g_free_bins[fl][sl]);
+
+    my_heap->sl_bitmap[fl] = 0;
+    my_heap->bin_stats[fl].chunks = 0;
+    my_heap->bin_stats[fl].blocks = 0;
+  }
+
+  my_heap->free_bins_bitmap = 0;
+  my_heap->alloc_count = 0;
+  my_heap->free_count = 0;
+  my_heap->failed_count = 0;
+#ifdef S_HEAP_PROFILE
+  memset(&my_heap->prof, 0, sizeof(my_heap->prof));
+#endif
+#ifdef S_HEAP_TRACE
+  my_heap->trace = NULL;
+  my_heap->trace_users = 0;
+#endif
+
+  /* A free chunk has to hold its bin links and its boundary tag */
+
+  my_heap->min_blocks = (sizeof(mem_node_t) + sizeof(mem_footer_t) +
+                         block_size - 1) / block_size;
+
+  /* Place the first header so that the payloads are aligned to the block
+   * size, every chunk is a multiple of it. The first node is the
+   * wilderness, the rest of the region is left untouched so that its pages
+   * are only faulted in when they are handed out.
+   */
+
+  seg = &my_heap->first_segment;
+  start_node = s_seg_format(my_heap, seg, (uintptr_t)start_heap_unaligned,
+                            (uintptr_t)end_heap);
+  if (start_node == NULL)
+    {
+      assert(false);
+      return -1;
+    }
+
+  my_heap->heap_mem_start = start_node;
+  my_heap->num_blocks = s_heap_mask(start_node).size;
+  my_heap->total_size = my_heap->num_blocks * block_size;
+  my_heap->grow_size = config->grow_size;
+  my_heap->huge_pages = false;
+  my_heap->purge_min = config->purge_min;
+  my_heap->purge_interval = config->purge_interval ? config->purge_interval :
+    S_HEAP_PURGE_INTERVAL;
+  my_heap->purge_ticks = 0;
+  my_heap->purge_epoch = 0;
+  my_heap->defer_coalescing = config->defer_coalescing;
+  my_heap->defer_limit = config->defer_limit ? config->defer_limit :
+    S_HEAP_DEFER_LIMIT;
+  my_heap->defer_count = 0;
+
+  my_heap->wilderness = start_node;
+  my_heap->wild_end = seg->end;
+  my_heap->untouched = config->zeroed ? seg->start : seg->end;
+
+  return 0;
+}
+
+/**
+ * s_init_huge() - Initialize a heap on a region mapped with huge pages.
+ *
+ * @my_heap : The heap context used to store heap info.
+ * @len: The size of the region, rounded up to S_HEAP_HUGE_PAGE_SIZE.
+ * @config: The heap settings like for s_init_ex() or NULL.
+ *
+ * Return: 0 on success, -1 if the region could not be mapped or the
+ * configuration is invalid.
+ */
+int s_init_huge(heap_t *my_heap, size_t len, const s_heap_config_t *config)
+{
+  s_heap_config_t huge_config = { 0 };
+  uint8_t *map;
+
+  if (my_heap == NULL || len == 0 || len > SIZE_MAX - S_HEAP_HUGE_PAGE_SIZE)
+  {
+    assert(false);
+    return -1;
+  }
+
+  if (config != NULL)
+    huge_config = *config;
+
+  len = (len + S_HEAP_HUGE_PAGE_SIZE - 1) & ~(S_HEAP_HUGE_PAGE_SIZE - 1);
+  map = s_map_region(len, true);
+  if (map == NULL)
+    return -1;
+
+  /* A fresh mapping is zero filled */
+
+  huge_config.zeroed = true;
+  if (s_init_ex(my_heap, map, map + len, &huge_config) != 0)
+  {
+    munmap(map, len);
+    return -1;
+  }
+
+  my_heap->first_segment.map_len = len;
+  my_heap->huge_pages = true;
+
+  return 0;
+}
+
+/**
+ * s_heap_extend() - Add a memory region to a heap.
+ *
+ * @my_heap: An initialized heap.
+ * @start: The start of the new region.
+ * @end: The end of the new region.
+ *
+ * Return: 0 on success, -1 if the region is too small.
+ */
+int s_heap_extend(heap_t *my_heap, void *start, void *end)
+{
+  if (my_heap == NULL || start == NULL || end <= start)
+  {
+    assert(false);
+    return -1;
+  }
+
+  return s_heap_add_segment(my_heap, start, end, 0, false);
+}
+
+/**
+ * s_heap_contains() - Check if a pointer belongs to one of the segments.
+ *
+ * @my_heap: The heap context.
+ * @ptr: Any address.
+ *
+ * Return: true if ptr lies inside a segment of the heap.
+ */
+bool s_heap_contains(heap_t *my_heap, const void *ptr)
+{
+  return s_segment_of(my_heap, (uintptr_t)ptr) != NULL;
+}
+
+/**
+ * s_heap_destroy() - Release the resources held by a heap.
+ *
+ * @my_heap: The heap context.
+ *
+ * Return: None.
+ */
+void s_heap_destroy(heap_t *my_heap)
+{
+  s_heap_seg_t *seg = my_heap->first_segment.next;
+  s_heap_seg_t *next_seg;
+
+#ifdef S_HEAP_TRACE
+  s_heap_trace_stop(my_heap);
+#endif
+
+  for (; seg != NULL; seg = next_seg)
+  {
+    next_seg = seg->next;
+    if (seg->map_len != 0)
+      munmap(seg, seg->map_len);
+  }
+
+  if (my_heap->first_segment.map_len != 0)
+    munmap(my_heap->heap_mem_start_unaligned, my_heap->first_segment.map_len);
+
+  my_heap->first_segment.next = NULL;
+  my_heap->first_segment.map_len = 0;
+  my_heap->wilderness = NULL;
+
+  if (my_heap->thread_safe)
+  {
+    for (int fl = 0; fl < S_HEAP_FL_COUNT; fl++)
+      pthread_mutex_destroy(&my_heap->bin_locks[fl]);
+
+    pthread_mutex_destroy(&my_heap->wild_lock);
+    my_heap->thread_safe = false;
+  }
+}
+
+/**
+ * s_heap_trim() - Give the pages of the free memory back to the OS.
+ *
+ * @my_heap: The heap context.
+ *
+ * Return: The number of bytes given back.
+ */
+size_t s_heap_trim(heap_t *my_heap)
+{
+  return s_heap_purge(my_heap, 0, NULL);
+}
+
+/**
+ * s_heap_compact_free() - Merge the free chunks that are neighbours.
+ *
+ * @my_heap: The heap context.
+ *
+ * Return: The number of free chunks that were merged into another one.
+ */
+size_t s_heap_compact_free(heap_t *my_heap)
+{
+  return s_heap_compact(my_heap);
+}
+
+/**
+ * s_bin_largest() - Find the largest free chunk in the bins.
+ *
+ * @my_heap: The heap context.
+ *
+ * Both engines map larger sizes to higher bins, so the largest chunk sits in
+ * the highest non-empty bin and only that list is walked, under its lock.
+ * With TLSF its chunks are within 1 / S_HEAP_SL_COUNT of each other in size.
+ * A bin that another thread emptied in the meantime sends the search to the
+ * next first level class.
+ *
+ * Return: The size in blocks number of the largest binned chunk, 0 if the
+ * bins are empty.
+ */
+static size_t s_bin_largest(heap_t *my_heap)
+{
+  uint32_t fl_map = __atomic_load_n(&my_heap->free_bins_bitmap,
+                                    __ATOMIC_RELAXED);
+  size_t largest = 0;
+  unsigned int fl, sl;
+  mem_node_t *node;
+  mem_mask_t mask;
+  uint32_t sl_map;
+
+  while (fl_map != 0 && largest == 0)
+  {
+    fl = 31 - __builtin_clz(fl_map);
+    fl_map &= ~(1U << fl);
+
+    s_bin_lock(my_heap, fl);
+
+    sl_map = __atomic_load_n(&my_heap->sl_bitmap[fl], __ATOMIC_RELAXED);
+    if (sl_map != 0)
+    {
+      sl = 31 - __builtin_clz(sl_map);
+
+      /* The lock bit of a binned chunk can still be flipped by the owner of
+       * its previous neighbour.
+       */
+
+      list_for_each_entry (node, &my_heap->g_free_bins[fl][sl], node_list)
+      {
+        mask = s_heap_mask(node);
+        if (mask.size > largest)
+          largest = mask.size;
+      }
+    }
+
+    s_bin_unlock(my_heap, fl);
+  }
+
+  return largest;
+}
+
+/**
+ * s_heap_stats() - Report the heap usage and fragmentation.
+ *
+ * @my_heap: The heap context.
+ * @stats: Output structure filled with the counters.
+ *
+ * The free memory is the sum of the bin class counters and the wilderness,
+ * the used memory is what is left of the segments. The largest free chunk
+ * is either the wilderness or the largest one of the highest non-empty bin.
+ *
+ * Return: None.
+ */
+void s_heap_stats(heap_t *my_heap, s_heap_stats_t *stats)
+{
+  size_t block_size = my_heap->block_size;
+  size_t free_blocks = 0, largest, total, chunks;
+  mem_node_t *node;
+  mem_mask_t mask;
+
+  memset(stats, 0, sizeof(*stats));
+
+  for (int cls = 0; cls < S_HEAP_FL_COUNT; cls++)
+  {
+    chunks = __atomic_load_n(&my_heap->bin_stats[cls].chunks,
+                             __ATOMIC_RELAXED);
+
+    stats->free_hist[cls] = chunks;
+    stats->free_chunks += chunks;
+    free_blocks += __atomic_load_n(&my_heap->bin_stats[cls].blocks,
+                                   __ATOMIC_RELAXED);
+  }
+
+  largest = s_bin_largest(my_heap);
+
+  node = __atomic_load_n(&my_heap->wilderness, __ATOMIC_RELAXED);
+  if (node != NULL)
+  {
+    mask = s_heap_mask(node);
+    stats->wild_bytes = mask.size * block_size;
+    free_blocks += mask.size;
+    if (mask.size > largest)
+      largest = mask.size;
+  }
+  total = __atomic_load_n(&my_heap->num_blocks, __ATOMIC_RELAXED);
+
+  /* Chunks that other threads are moving in and out of the bins can make
+   * the counters disagree for a moment.
+   */
+
+  if (free_blocks > total)
+    free_blocks = total;
+  if (largest > free_blocks)
+    largest = free_blocks;
+
+  stats->total_bytes = total * block_size;
+  stats->free_bytes = free_blocks * block_size;
+  stats->used_bytes = stats->total_bytes - stats->free_bytes;
+  stats->largest_free = largest * block_size;
+  stats->alloc_count = __atomic_load_n(&my_heap->alloc_count,
+                                       __ATOMIC_RELAXED);
+  stats->free_count = __atomic_load_n(&my_heap->free_count, __ATOMIC_RELAXED);
+  stats->failed_count = __atomic_load_n(&my_heap->failed_count,
+                                        __ATOMIC_RELAXED);
+
+  if (free_blocks != 0)
+    stats->fragmentation = 1000 - largest * 1000 / free_blocks;
+}
+
+/**
+ * s_heap_prof_read() - Copy the latency histograms of a heap.
+ *
+ * @my_heap: The heap context.
+ * @prof: Output structure filled with the histograms.
+ *
+ * Return: 0 on success, -1 if the library was built without
+ * S_HEAP_PROFILE in which case prof is zero filled.
+ */
+int s_heap_prof_read(heap_t *my_heap, s_heap_prof_t *prof)
+{
+#ifdef S_HEAP_PROFILE
+  const size_t *src = (const size_t *)&my_heap->prof;
+  size_t *dst = (size_t *)prof;
+
+  for (size_t i = 0; i < sizeof(*prof) / sizeof(size_t); i++)
+    dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+
+  return 0;
+#else
+  memset(prof, 0, sizeof(*prof));
+  return -1;
+#endif
+}
+
+/**
+ * s_heap_prof_reset() - Clear the latency histograms of a heap.
+ *
+ * @my_heap: The heap context.
+ *
+ * Return: None.
+ */
+void s_heap_prof_reset(heap_t *my_heap)
+{
+#ifdef S_HEAP_PROFILE
+  size_t *counters = (size_t *)&my_heap->prof;
+
+  for (size_t i = 0; i < sizeof(my_heap->prof) / sizeof(size_t); i++)
+    __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+#endif
+}
+
+/**
+ * s_heap_trace_start() - Log the calls made on a heap to a file.
+ *
+ * @my_heap: The heap context.
+ * @path: The trace file, created or truncated.
+ *
+ * Return: 0 on success, -1 if the file can not be created, the heap is
+ * already traced or the library was built without S_HEAP_TRACE.
+ */
+int s_heap_trace_start(heap_t *my_heap, const char *path)
+{
+#ifdef S_HEAP_TRACE
+  s_heap_trace_hdr_t hdr = {
+    .magic = S_HEAP_TRACE_MAGIC,
+    .version = S_HEAP_TRACE_VERSION,
+    .rec_size = sizeof(s_heap_trace_rec_t),
+  };
+  struct s_heap_trace_s *trace;
+  int fd;
+
+  if (my_heap->trace != NULL)
+    return -1;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -1;
+
+  trace = mmap(NULL, sizeof(*trace), PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (trace == MAP_FAILED)
+  {
+    close(fd);
+    return -1;
+  }
+
+  if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+  {
+    munmap(trace, sizeof(*trace));
+    close(fd);
+    return -1;
+  }
+
+  pthread_mutex_init(&trace->lock, NULL);
+  trace->fd = fd;
+  trace->pid = getpid();
+  trace->start_ns = s_trace_now();
+  __atomic_store_n(&my_heap->trace, trace, __ATOMIC_RELEASE);
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+/**
+ * s_heap_trace_stop() - Flush and close the trace of a heap.
+ *
+ * @my_heap: The heap context, no other thread may be using it.
+ *
+ * Return: 0 on success, -1 if the heap was not traced or a write to the
+ * trace file failed.
+ */
+int s_heap_trace_stop(heap_t *my_heap)
+{
+#ifdef S_HEAP_TRACE
+  struct s_heap_trace_s *trace = my_heap->trace;
+  int ret;
+
+  if (trace == NULL)
+    return -1;
+
+  __atomic_store_n(&my_heap->trace, NULL, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&my_heap->trace_users, __ATOMIC_ACQUIRE) != 0)
+    sched_yield();
+
+  s_trace_flush(trace);
+  ret = trace->failed ? -1 : 0;
+  if (close(trace->fd) != 0)
+    ret = -1;
+
+  pthread_mutex_destroy(&trace->lock);
+  munmap(trace, sizeof(*trace));
+  return ret;
+#else
+  return -1;
+#endif
+}
+
+/**
+ * s_heap_set_thread_safe() - Let several threads use a heap concurrently.
+ *
+ * @my_heap: An initialized heap that is not used by any thread yet.
+ *
+ * Return: 0 on success, an error number otherwise.
+ */
+int s_heap_set_thread_safe(heap_t *my_heap)
+{
+  int ret;
+
+  ret = pthread_mutex_init(&my_heap->wild_lock, NULL);
+  if (ret != 0)
+    return ret;
+
+  for (int fl = 0; fl < S_HEAP_FL_COUNT; fl++)
+  {
+    ret = pthread_mutex_init(&my_heap->bin_locks[fl], NULL);
+    if (ret != 0)
+    {
+      while (fl-- > 0)
+        pthread_mutex_destroy(&my_heap->bin_locks[fl]);
+
+      pthread_mutex_destroy(&my_heap->wild_lock);
+      return ret;
+    }
+  }
+
+  my_heap->thread_safe = true;
+  return 0;
+}
+
+/**
+ * s_do_alloc() - Allocate a memory chunk in a specified heap.
+ *
+ * @len: The requested memory size.
+ * @my_heap: The pool of memory from where we allocate.
+ *
+ * This function reserves a continious block of memory.
+ *
+ * Return: A void pointer on success otherwise NULL.
+ *
+ * On success it returns the address of the new memory block otherwise
+ * it returns NULL.
+ */
+static void *s_do_alloc(size_t len, heap_t *my_heap)
+{
+  mem_node_t *node = NULL;
+  size_t blocks;
+
+  if (my_heap->alignment > my_heap->block_size)
+    return s_aligned_alloc(my_heap->alignment, len, my_heap);
+
+  blocks = s_heap_len_to_blocks(my_heap, len);
+  if (blocks > S_HEAP_MAX_BLOCKS)
+  {
+    s_stat_add(my_heap, &my_heap->failed_count, 1);
+    return NULL;
+  }
+
+#ifdef DEBUG_ONLY
+  for (unsigned int fl = 0; fl < S_HEAP_FL_COUNT && !my_heap->thread_safe;
+       fl++)
+  {
+    for (unsigned int sl = 0; sl < S_HEAP_SL_COUNT; sl++)
+    {
+      unsigned int node_fl, node_sl;
+
+      assert(list_empty(&my_heap->g_free_bins[fl][sl]) ==
+             !(my_heap->sl_bitmap[fl] & (1U << sl)));
+
+      list_for_each_entry (node, &my_heap->g_free_bins[fl][sl], node_list)
+      {
+        assert(s_heap_mask(node).used == 0);
+        assert(s_node_footer(my_heap, node)->node == node);
+        s_bin_mapping(my_heap, s_heap_mask(node).size, &node_fl, &node_sl);
+        assert(node_fl == fl && node_sl == sl);
+      }
+    }
+
+    assert(!my_heap->sl_bitmap[fl] ==
+           !(my_heap->free_bins_bitmap & (1U << fl)));
+  }
+#endif
+
+  /* Take a free chunk with size >= blocks out of the bins or bump it out
+   * of the wilderness.
+   */
+
+  node = s_chunk_take(my_heap, blocks);
+  if (node == NULL)
+  {
+    s_stat_add(my_heap, &my_heap->failed_count, 1);
+    return NULL;
+  }
+
+  mem_node_t *next_node = s_next_node(my_heap, node);
+  if (next_node != NULL)
+    s_node_lock(my_heap, next_node);
 
-#include "s_heap.h"
+  s_mark_used(my_heap, node);
+  next_node = s_release_tail(my_heap, node, blocks, next_node);
+
+  s_node_unlock(my_heap, next_node);
+  s_node_unlock(my_heap, node);
+
+  s_stat_add(my_heap, &my_heap->alloc_count, 1);
+  return s_node_payload(node);
+}
 
 /**
- * size_comparator() - Address comparator.
+ * s_alloc() - Allocate a memory chunk in a specified heap.
+ *
+ * @len: The requested memory size.
+ * @my_heap: The pool of memory from where we allocate.
  *
- * @node_1: The first node's address.
- * @node_2: The second's node address.
+ * Return: A void pointer on success otherwise NULL.
+ */
+void *s_alloc(size_t len, heap_t *my_heap)
+{
+  uint32_t depth = s_trace_enter();
+  s_prof_t prof = s_prof_start();
+  void *ptr = s_do_alloc(len, my_heap);
+
+  s_prof_end(my_heap, S_HEAP_OP_ALLOC, s_heap_len_to_blocks(my_heap, len),
+             &prof);
+  s_trace_leave(my_heap, depth, S_HEAP_OP_ALLOC, len, ptr, 0);
+  return ptr;
+}
+
+/**
+ * s_do_aligned_alloc() - Allocate an aligned memory chunk.
  *
- * This utility function is used by allocator function to select the node
- * that occupies less blocks
+ * @align: The payload alignment, a power of two.
+ * @len: The requested memory size.
+ * @my_heap: The pool of memory from where we allocate.
  *
- * Return: -1 if the 2nd node's size is greater than the 1st node's size
- *          1 if the 1st node's size is greater than the 2nd node's size
- *          0 otherwise
+ * A free chunk large enough for the payload and the worst case alignment
+ * gap is taken from the bins. The header is placed right before the first
+ * aligned address and the gap in front of it is given back to the bins as
+ * a free chunk, so only the alignment of the tail costs memory.
  *
+ * Return: A void pointer on success otherwise NULL.
  */
-static int size_comparator(void *priv,
-                           struct list_head *node_1,
-                           struct list_head *node_2)
+static void *s_do_aligned_alloc(size_t align, size_t len,
+                                heap_t *my_heap)
 {
-  mem_node_t *mem_node_1 = list_entry(node_1, mem_node_t, node_list);
-  mem_node_t *mem_node_2 = list_entry(node_2, mem_node_t, node_list);
+  size_t block_size = my_heap->block_size;
+  size_t min_len = my_heap->min_blocks * block_size;
+  size_t blocks, blocks_max, lead_len;
+  uintptr_t payload;
+  mem_node_t *node, *aligned_node, *next_node;
 
- return (mem_node_1->mask.size > mem_node_2->mask.size) -
-        (mem_node_1->mask.size < mem_node_2->mask.size);
-}
+  if (align == 0 || (align & (align - 1)) != 0)
+  {
+    s_stat_add(my_heap, &my_heap->failed_count, 1);
+    return NULL;
+  }
 
-/*
- * Returns a list organized in an intermediate format suited
- * to chaining of merge() calls: null-terminated, no reserved or
- * sentinel head node, "prev" links not maintained.
- */
-static struct list_head *merge(void *priv,
-                               int (*cmp)(void *priv, struct list_head *a,
-                               struct list_head *b),
-                               struct list_head *a, struct list_head *b)
-{
-  struct list_head head, *tail = &head;
-
-  while (a && b) {
-    /* if equal, take 'a' -- important for sort stability */
-    if ((*cmp)(priv, a, b) <= 0) {
-      tail->next = a;
-      a = a->next;
-    } else {
-      tail->next = b;
-      b = b->next;
-    }
-    tail = tail->next;
+  if (align < my_heap->alignment)
+    align = my_heap->alignment;
+
+  if (align <= block_size)
+    return s_alloc(len, my_heap);
+
+  blocks = s_heap_len_to_blocks(my_heap, len);
+  blocks_max = blocks + (align + min_len) / block_size;
+  if (blocks > S_HEAP_MAX_BLOCKS ||
+      align > (size_t)S_HEAP_MAX_BLOCKS * block_size ||
+      blocks_max > S_HEAP_MAX_BLOCKS)
+  {
+    s_stat_add(my_heap, &my_heap->failed_count, 1);
+    return NULL;
   }
-  tail->next = a?:b;
-  return head.next;
-}
 
-/*
- * Combine final list merge with restoration of standard doubly-linked
- * list structure.  This approach duplicates code from merge(), but
- * runs faster than the tidier alternatives of either a separate final
- * prev-link restoration pass, or maintaining the prev links
- * throughout.
- */
-static void merge_and_restore_back_links(void *priv,
-                                         int (*cmp)(void *priv, struct list_head *a,
-                                         struct list_head *b),
-                                         struct list_head *head,
-                                         struct list_head *a, struct list_head *b)
-{
-  struct list_head *tail = head;
-  uint8_t count = 0;
-
-  while (a && b) {
-    /* if equal, take 'a' -- important for sort stability */
-    if ((*cmp)(priv, a, b) <= 0) {
-      tail->next = a;
-      a->prev = tail;
-      a = a->next;
-    } else {
-      tail->next = b;
-      b->prev = tail;
-      b = b->next;
-    }
-    tail = tail->next;
+  node = s_chunk_take(my_heap, blocks_max);
+  if (node == NULL)
+  {
+    s_stat_add(my_heap, &my_heap->failed_count, 1);
+    return NULL;
   }
-  tail->next = a ? : b;
 
-  do {
-    /*
-     * In worst cases this loop may run many iterations.
-     * Continue callbacks to the client even though no
-     * element comparison is needed, so the client's cmp()
-     * routine can invoke cond_resched() periodically.
+  /* The gap before the aligned header has to be empty or hold a free
+   * chunk.
+   */
+
+  payload = (uintptr_t)s_node_payload(node);
+  lead_len = ((payload + align - 1) & ~(align - 1)) - payload;
+  while (lead_len != 0 && lead_len < min_len)
+    lead_len += align;
+
+  /* The next chunk finds the one we split through its boundary tag, lock
+   * it before the size changes.
+   */
+
+  next_node = s_next_node(my_heap, node);
+  if (next_node != NULL)
+    s_node_lock(my_heap, next_node);
+
+  aligned_node = node;
+  if (lead_len != 0)
+  {
+    /* Split the gap off, the new header is only reachable through the gap
+     * chunk which stays locked until the split is done.
      */
-    if (!(++count))
-      (*cmp)(priv, tail->next, tail->next);
 
-    tail->next->prev = tail;
-    tail = tail->next;
-  } while (tail->next);
+    mem_mask_t mask = s_heap_mask(node);
+
+    aligned_node = (mem_node_t *)((uint8_t *)node + lead_len);
+    s_node_set_mask(aligned_node, (mem_mask_t) {
+      .used = 0,
+      .prev_free = 0,
+      .locked = my_heap->thread_safe,
+      .zeroed = mask.zeroed,
+      .size = mask.size - lead_len / block_size,
+    });
+    mask.size = lead_len / block_size;
+    s_node_set_mask(node, mask);
+
+    s_mark_free(my_heap, node);
+    s_bin_insert(my_heap, node);
+  }
+
+  assert(s_heap_mask(aligned_node).size >= blocks);
+
+  s_mark_used(my_heap, aligned_node);
+  next_node = s_release_tail(my_heap, aligned_node, blocks, next_node);
 
-  tail->next = head;
-  head->prev = tail;
+  s_node_unlock(my_heap, next_node);
+  s_node_unlock(my_heap, aligned_node);
+  if (aligned_node != node)
+    s_node_unlock(my_heap, node);
+
+  s_stat_add(my_heap, &my_heap->alloc_count, 1);
+  return s_node_payload(aligned_node);
 }
 
 /**
- * list_sort - sort a list
- * @priv: private data, opaque to list_sort(), passed to @cmp
- * @head: the list to sort
- * @cmp: the elements comparison function
+ * s_aligned_alloc() - Allocate an aligned memory chunk in a specified heap.
  *
- * This function implements "merge sort", which has O(nlog(n))
- * complexity.
+ * @align: The payload alignment, a power of two.
+ * @len: The requested memory size.
+ * @my_heap: The pool of memory from where we allocate.
  *
- * The comparison function @cmp must return a negative value if @a
- * should sort before @b, and a positive value if @a should sort after
- * @b. If @a and @b are equivalent, and their original relative
- * ordering is to be preserved, @cmp must return 0.
+ * Return: A void pointer on success otherwise NULL.
  */
-void list_sort(void *priv, struct list_head *head,
-               int (*cmp)(void *priv, struct list_head *a,
-               struct list_head *b))
+void *s_aligned_alloc(size_t align, size_t len, heap_t *my_heap)
 {
-  struct list_head *part[MAX_LIST_LENGTH_BITS+1]; /* sorted partial lists
-            -- last slot is a sentinel */
-  int lev;  /* index into part[] */
-  int max_lev = 0;
-  struct list_head *list;
+  uint32_t depth = s_trace_enter();
+  s_prof_t prof = s_prof_start();
+  void *ptr = s_do_aligned_alloc(align, len, my_heap);
+
+  s_prof_end(my_heap, S_HEAP_OP_ALIGNED_ALLOC,
+             s_heap_len_to_blocks(my_heap, len), &prof);
+  s_trace_leave(my_heap, depth, S_HEAP_OP_ALIGNED_ALLOC, len, ptr, align);
+  return ptr;
+}
 
-  if (list_empty(head))
-    return;
+/**
+ * s_do_calloc() - Allocate a zero filled memory chunk in a specified heap.
+ *
+ * @nmemb: The number of elements.
+ * @size: The size of an element.
+ * @my_heap: The pool of memory from where we allocate.
+ *
+ * A chunk that was zeroed while it was free only needs its bin links and
+ * its boundary tag to be cleared.
+ *
+ * Return: A void pointer on success otherwise NULL.
+ */
+static void *s_do_calloc(size_t nmemb, size_t size, heap_t *my_heap)
+{
+  size_t len;
+  mem_mask_t mask;
+  uint8_t *ptr;
 
-  memset(part, 0, sizeof(part));
+  if (__builtin_mul_overflow(nmemb, size, &len))
+  {
+    s_stat_add(my_heap, &my_heap->failed_count, 1);
+    return NULL;
+  }
 
-  head->prev->next = NULL;
-  list = head->next;
+  ptr = s_alloc(len, my_heap);
+  if (ptr == NULL)
+    return NULL;
 
-  while (list) {
-    struct list_head *cur = list;
-    list = list->next;
-    cur->next = NULL;
+  /* Only the neighbours write our header now, under its lock bit */
 
-    for (lev = 0; part[lev]; lev++) {
-      cur = merge(priv, cmp, part[lev], cur);
-      part[lev] = NULL;
-    }
-    if (lev > max_lev) {
-      if (lev >= ARRAY_SIZE(part)-1) {
-        /* list too long for efficiency\n */
-        lev--;
-      }
-      max_lev = lev;
-    }
-    part[lev] = cur;
+  mask = s_heap_mask(s_heap_node(ptr));
+  if (!mask.zeroed)
+  {
+    memset(ptr, 0, len);
+    return ptr;
   }
 
-  for (lev = 0; lev < max_lev; lev++)
-    if (part[lev])
-      list = merge(priv, cmp, part[lev], list);
+  memset(ptr, 0, sizeof(struct list_head));
+  memset(ptr + mask.size * my_heap->block_size - S_HEAP_HDR_SIZE -
+         sizeof(mem_footer_t), 0, sizeof(mem_footer_t));
 
-  merge_and_restore_back_links(priv, cmp, head, part[max_lev], list);
+  return ptr;
 }
 
 /**
- * s_init() - Initialize heap memory.
+ * s_calloc() - Allocate a zero filled memory chunk in a specified heap.
  *
- * @start_heap_unaligned: The start of the unaligned memory region for HEAP.
- * @end_heap: The end of the HEAP region.
- * @block_size: The block size.
+ * @nmemb: The number of elements.
+ * @size: The size of an element.
+ * @my_heap: The pool of memory from where we allocate.
  *
- * Initialize a heap strucure and create the first free node that will hold
- * all the blocks.
+ * Return: A void pointer on success otherwise NULL.
+ */
+void *s_calloc(size_t nmemb, size_t size, heap_t *my_heap)
+{
+  uint32_t depth = s_trace_enter();
+  s_prof_t prof = s_prof_start();
+  void *ptr = s_do_calloc(nmemb, size, my_heap);
+
+  s_prof_end(my_heap, S_HEAP_OP_CALLOC,
+             ptr != NULL ? s_heap_mask(s_heap_node(ptr)).size : 0, &prof);
+  s_trace_leave(my_heap, depth, S_HEAP_OP_CALLOC, nmemb * size, ptr, 0);
+  return ptr;
+}
+
+/**
+ * s_do_alloc_batch() - Allocate several memory chunks at once.
  *
- * Return: No return value.
+ * @num: The number of chunks.
+ * @sizes: The requested size of every chunk.
+ * @out: Output array of num chunk pointers.
+ * @my_heap: The pool of memory from where we allocate.
+ *
+ * One free chunk large enough for the whole batch is taken and split in
+ * place. When no such chunk exists or the heap has an alignment larger
+ * than the block size, the chunks are allocated one by one.
+ *
+ * Return: 0 on success, -1 if the batch does not fit.
  */
-void s_init(heap_t *my_heap,
-            void *start_heap_unaligned,
-            void *end_heap)
+static int s_do_alloc_batch(size_t num, const size_t *sizes, void **out,
+                            heap_t *my_heap)
 {
-  size_t block_size = sizeof(mem_node_t);
-  mem_node_t *start_node = NULL;
-  assert(end_heap > start_heap_unaligned);
+  mem_node_t *node = NULL, *next_node, *chunk;
+  size_t total = 0, blocks, left;
+  mem_mask_t mask;
+  bool zeroed;
+  size_t i;
 
-  if (my_heap == NULL ||
-      start_heap_unaligned == NULL ||
-      end_heap == NULL)
-    {
-      assert(false);
-      return;
-    }
+  if (num == 0)
+    return 0;
 
-  /* Save the block size */
+  for (i = 0; i < num && total <= S_HEAP_MAX_BLOCKS; i++)
+    total += s_heap_len_to_blocks(my_heap, sizes[i]);
 
-  my_heap->block_size = block_size;
-  my_heap->heap_memory_end = end_heap;
-  my_heap->heap_mem_start_unaligned = start_heap_unaligned;
+  if (total <= S_HEAP_MAX_BLOCKS && my_heap->alignment <= my_heap->block_size)
+    node = s_chunk_take(my_heap, total);
 
-  INIT_LIST_HEAD(&my_heap->g_free_heap_list);
-  INIT_LIST_HEAD(&my_heap->g_used_heap_list);
+  if (node == NULL)
+  {
+    for (i = 0; i < num; i++)
+    {
+      out[i] = s_alloc(sizes[i], my_heap);
+      if (out[i] == NULL)
+      {
+        s_free_batch(out, i, my_heap);
+        memset(out, 0, num * sizeof(void *));
+        return -1;
+      }
+    }
 
-  /* Align heap_mem_start to HEAP_BLOCK_SIZE */
+    return 0;
+  }
 
-  my_heap->heap_mem_start = (void *)(((uintptr_t)start_heap_unaligned) +
-    ((uintptr_t)start_heap_unaligned) % block_size);
+  next_node = s_next_node(my_heap, node);
+  if (next_node != NULL)
+    s_node_lock(my_heap, next_node);
 
-  /* Count the number of blocks */
+  s_mark_used(my_heap, node);
+  next_node = s_release_tail(my_heap, node, total, next_node);
 
-  my_heap->num_blocks =
-    ((uintptr_t)end_heap - (uintptr_t)my_heap->heap_mem_start) / block_size;
+  /* The chunks after the first one are not reachable by other threads
+   * until we return them, their headers are written unlocked. The last
+   * chunk keeps whatever the split left.
+   */
 
-  memset(my_heap->heap_mem_start, 0, my_heap->num_blocks * block_size);
+  mask = s_heap_mask(node);
+  zeroed = mask.zeroed;
+  left = mask.size;
+  chunk = node;
 
-  /* Add the first node */
+  for (i = 0; i < num; i++)
+  {
+    blocks = i + 1 < num ? s_heap_len_to_blocks(my_heap, sizes[i]) : left;
 
-  start_node = (mem_node_t *)my_heap->heap_mem_start;
-  start_node->mask = (mem_mask_t) {
-    .used = 0,
-    .size = my_heap->num_blocks - 1,
-  };
+    if (chunk != node)
+    {
+      mask = (mem_mask_t) {
+        .used = 1,
+        .prev_free = 0,
+        .zeroed = zeroed,
+        .size = blocks,
+      };
+      chunk->magic = S_HEAP_MAGIC_USED;
+    }
+    else
+      mask.size = blocks;
 
-  start_node->chunk_addr = my_heap->heap_mem_start + block_size;
+    s_node_set_mask(chunk, mask);
 
-  INIT_LIST_HEAD(&start_node->node_list);
+    out[i] = s_node_payload(chunk);
+    left -= blocks;
+    chunk = (mem_node_t *)((uint8_t *)chunk + blocks * my_heap->block_size);
+  }
 
-  /* Add the init node to the free list */
+  s_node_unlock(my_heap, next_node);
+  s_node_unlock(my_heap, node);
 
-  list_add(&start_node->node_list, &my_heap->g_free_heap_list);
+  s_stat_add(my_heap, &my_heap->alloc_count, num);
+  return 0;
 }
 
 /**
- * s_alloc() - Allocate a memory chunk in a specified heap.
+ * s_alloc_batch() - Allocate several memory chunks at once.
  *
- * @len: The requested memory size.
+ * @num: The number of chunks.
+ * @sizes: The requested size of every chunk.
+ * @out: Output array of num chunk pointers.
  * @my_heap: The pool of memory from where we allocate.
  *
- * This function reserves a continious block of memory.
+ * Return: 0 on success, -1 if the batch does not fit.
+ */
+int s_alloc_batch(size_t num, const size_t *sizes, void **out,
+                  heap_t *my_heap)
+{
+  uint32_t depth = s_trace_enter();
+  s_prof_t prof = s_prof_start();
+  int ret = s_do_alloc_batch(num, sizes, out, my_heap);
+
+  s_prof_end(my_heap, S_HEAP_OP_ALLOC_BATCH, num, &prof);
+  s_trace_batch(my_heap, depth, S_HEAP_OP_ALLOC, out, sizes,
+                ret == 0 ? num : 0);
+  return ret;
+}
+
+/**
+ * s_purge_tick() - Count a release for the purge decay.
  *
- * Return: A void pointer on success otherwise NULL.
+ * @my_heap: The heap context.
  *
- * On success it returns the address of the new memory block otherwise
- * it returns NULL.
+ * Every purge_interval releases start a new purge epoch. The free chunks
+ * binned before the epoch that just ended stayed free for at least a whole
+ * interval and give their pages back to the OS.
  */
-void *s_alloc(size_t len, heap_t *my_heap)
+static inline void s_purge_tick(heap_t *my_heap)
 {
-  /* Start by looking in the list and search for an empty block with size >= len */
+  uint32_t epoch;
 
-  mem_node_t *node = NULL;
-#ifdef DEBUG_ONLY
+  if (my_heap->purge_min == 0 ||
+      __atomic_add_fetch(&my_heap->purge_ticks, 1, __ATOMIC_RELAXED) %
+      my_heap->purge_interval != 0)
+    return;
 
-  list_for_each_entry (node , &my_heap->g_free_heap_list, node_list)
-  {
+  epoch = __atomic_add_fetch(&my_heap->purge_epoch, 1, __ATOMIC_RELAXED) - 1;
+  s_heap_purge(my_heap, my_heap->purge_min, &epoch);
+}
+
+/**
+ * s_free_deferred() - Release a chunk without merging it.
+ *
+ * @my_heap: The heap context.
+ * @node: The used chunk.
+ *
+ * The chunk goes to its bin, or becomes the wilderness when it ends the
+ * last segment, and the heap is compacted every defer_limit calls.
+ */
+static void s_free_deferred(heap_t *my_heap, mem_node_t *node)
+{
+  mem_node_t *next_node;
+  uint32_t count;
 
-    assert(node->mask.used == 0);
+  s_node_lock(my_heap, node);
 
-    mem_node_t *node_used = NULL;
-    list_for_each_entry (node_used , &my_heap->g_used_heap_list, node_list)
-    {
-      assert(node_used->mask.used == 1);
-      assert(node->chunk_addr != node_used->chunk_addr);
-    }
-  }
-#endif
+  next_node = s_next_node(my_heap, node);
+  if (next_node != NULL)
+    s_node_lock(my_heap, next_node);
 
-  list_sort(NULL, &my_heap->g_free_heap_list, size_comparator);
+  s_node_dirty(node);
+  s_node_release(my_heap, node);
 
-  list_for_each_entry (node , &my_heap->g_free_heap_list, node_list)
-  {
-    if ((node->mask.size > 1) &&
-        (node->mask.size - 2) * my_heap->block_size >= len)
-    {
-      /* Compute the address and verify if we are out of bounds */
+  s_node_unlock(my_heap, next_node);
+  s_node_unlock(my_heap, node);
+
+  if (my_heap->thread_safe)
+    count = __atomic_add_fetch(&my_heap->defer_count, 1, __ATOMIC_RELAXED);
+  else
+    count = ++my_heap->defer_count;
 
-      size_t blocks = len / my_heap->block_size +
-        ((len % my_heap->block_size) ? 1 : 0);
+  if (count >= my_heap->defer_limit)
+    s_heap_compact(my_heap);
 
-      /* Remove the node from the free list */
+  s_purge_tick(my_heap);
+}
 
-      assert(node->mask.used == 0);
-      node->mask.used = 1;
+/**
+ * s_free_node() - Release a used chunk.
+ *
+ * @my_heap: The heap context.
+ * @node: The validated chunk header.
+ *
+ * The chunk is merged with its free physical neighbours and placed in the
+ * free bin that matches its size.
+ */
+static void s_free_node(heap_t *my_heap, mem_node_t *node)
+{
+  mem_node_t *next_node, *next_next_node, *prev_node;
 
-      list_del(&node->node_list);
-      list_add(&node->node_list, &my_heap->g_used_heap_list);
+  if (my_heap->defer_coalescing)
+  {
+    s_free_deferred(my_heap, node);
+    return;
+  }
 
-      assert(node->mask.size - blocks - 1 >= 0);
-      int prev_size = node->mask.size;
-      node->mask.size = blocks;
+  /* In thread-safe mode lock the chunk and the neighbours we may merge
+   * with. The previous chunk sits at a lower address so it can only be
+   * try-locked, on failure everything is released and we start again.
+   */
 
-      /* Verify if we have free space after this allocated block. */
+  do {
+    s_node_lock(my_heap, node);
 
-      /* next_used_node can be == node */
+    next_node = s_next_node(my_heap, node);
+    next_next_node = NULL;
+    if (next_node != NULL)
+    {
+      s_node_lock(my_heap, next_node);
 
-      mem_node_t *free_node = node + blocks + 1;
-      if ((void *)free_node + my_heap->block_size > my_heap->heap_memory_end)
+      if (s_heap_mask(next_node).used == 0)
       {
-        return NULL;
+        next_next_node = s_next_node(my_heap, next_node);
+        if (next_next_node != NULL)
+          s_node_lock(my_heap, next_next_node);
       }
+    }
 
-      int new_free_node_size = prev_size - blocks - 1;
-      assert(new_free_node_size > 0);
+    prev_node = s_prev_node(my_heap, node);
+    if (prev_node == NULL || s_node_trylock(my_heap, prev_node))
+      break;
 
-      free_node->mask.size = new_free_node_size;
-      free_node->mask.used = 0;
-      free_node->chunk_addr = free_node + 1;
-      list_add(&free_node->node_list, &my_heap->g_free_heap_list);
+    s_node_unlock(my_heap, next_next_node);
+    s_node_unlock(my_heap, next_node);
+    s_node_unlock(my_heap, node);
+    sched_yield();
+  } while (true);
 
-      return node->chunk_addr;
-    }
+  s_node_dirty(node);
+
+  /* Do we have continious free memory blocks ? If we have, merge them.
+   * Unless coalescing is deferred, free chunks are always merged on
+   * release so at most the two physical neighbours can be free. The next
+   * one is found from our size and the previous one from its boundary tag.
+   */
+
+  if (next_node != NULL && s_heap_mask(next_node).used == 0)
+  {
+    if (!s_is_wild(my_heap, next_node))
+      s_bin_remove(my_heap, next_node);
+
+    s_prof_visit();
+    s_node_absorb(node, next_node);
+    next_node = next_next_node;
   }
 
-  return NULL;
-}
+  if (prev_node != NULL)
+  {
+    s_prof_visit();
+    s_bin_remove(my_heap, prev_node);
+    s_node_absorb(prev_node, node);
+    node = prev_node;
+  }
 
-/**
- * addr_comparator() - Address comparator.
- *
- * @node_1: The first node's address.
- * @node_2: The second's node address.
- *
- * This utility function is used by the sorting algoritm to compare the address
- * of two memory nodes.
- *
- * Return: -1 if the 2nd node's address is greater than the 1st node's address
- *          1 if the 1st node's address is greater than the 2nd node's address
- *          0 otherwise
+  s_node_release(my_heap, node);
 
- *
- */
-static int addr_comparator(void *priv,
-                           struct list_head *node_1,
-                           struct list_head *node_2)
-{
-  mem_node_t *mem_node_1 = list_entry(node_1, mem_node_t, node_list);
-  mem_node_t *mem_node_2 = list_entry(node_2, mem_node_t, node_list);
+  s_node_unlock(my_heap, next_node);
+  s_node_unlock(my_heap, node);
 
-  return (mem_node_1->chunk_addr > mem_node_2->chunk_addr) -
-         (mem_node_1->chunk_addr < mem_node_2->chunk_addr);
+  s_purge_tick(my_heap);
 }
 
 /**
@@ -366,8 +2820,9 @@ static int addr_comparator(void *priv,
  * @ptr: The specified buffer to be freed.
  * @my_heap: The specified heap where the buffer lives in.
  *
- * Free an allocate dmmeory chunk. In case the block does not exist in the
- * used blocks list we assert.
+ * Free an allocate dmmeory chunk. In case the pointer does not belong to an
+ * allocated chunk we assert. The chunk is merged with its free physical
+ * neighbours and placed in the free bin that matches its size.
  *
  * Return: None.
  *
@@ -381,98 +2836,155 @@ void s_free(void *ptr, heap_t *my_heap)
     return;
   }
 
-  mem_node_t *node = NULL;
-  bool found_block = false;
-  list_for_each_entry (node, &my_heap->g_used_heap_list, node_list)
-  {
-
-    if (node->chunk_addr == ptr)
-      {
-        /* We can't have a free block in this list */
+  uint32_t depth = s_trace_enter();
+  s_prof_t prof = s_prof_start();
+  mem_node_t *node = s_ptr_to_node(my_heap, ptr);
+  size_t blocks = s_heap_mask(node).size;
 
-        assert(node->mask.used == 1);
-        node->mask.used = 0;
+  /* Logged before another thread can get the chunk */
 
-        list_del(&node->node_list);
-        list_add(&node->node_list, &my_heap->g_free_heap_list);
+  s_trace_leave(my_heap, depth, S_HEAP_OP_FREE, 0, ptr, 0);
+  s_free_node(my_heap, node);
+  s_stat_add(my_heap, &my_heap->free_count, 1);
+  s_prof_end(my_heap, S_HEAP_OP_FREE, blocks, &prof);
+}
 
-        found_block = true;
-        break;
-      }
-  }
+/**
+ * s_free_sized() - Release an allocated block of memory of a known size.
+ *
+ * @ptr: The specified buffer to be freed.
+ * @size: The size that was requested for the buffer.
+ * @my_heap: The specified heap where the buffer lives in.
+ *
+ * A thin alias of s_free(): the header already holds the chunk size, so the
+ * size is only checked against it in debug builds, in place of the segment
+ * lookup s_ptr_to_node() asserts on.
+ *
+ * Return: None.
+ */
+void s_free_sized(void *ptr, size_t size, heap_t *my_heap)
+{
+  uint32_t depth;
+  s_prof_t prof;
+  mem_node_t *node;
+  size_t blocks;
 
-  /* The specified input address for this function is invalid.
-   * Did we encounter a double free memory corruption ?
-   */
+  if (ptr == NULL)
+    return;
 
-  assert(found_block == true);
+  depth = s_trace_enter();
+  prof = s_prof_start();
+  node = s_heap_node(ptr);
+  assert(node->magic == S_HEAP_MAGIC_USED && s_heap_mask(node).used == 1);
+  assert(s_heap_len_to_blocks(my_heap, size) <= s_heap_mask(node).size);
 
-  /* Do we have continious free memory blocks ? If we have, merge them */
+  /* The size may be smaller than the chunk, profile the chunk itself */
 
-  bool merge_blocks;
-  list_sort(NULL, &my_heap->g_free_heap_list, addr_comparator);
+  blocks = s_heap_mask(node).size;
+  s_trace_leave(my_heap, depth, S_HEAP_OP_FREE, 0, ptr, 0);
+  s_free_node(my_heap, node);
+  s_stat_add(my_heap, &my_heap->free_count, 1);
+  s_prof_end(my_heap, S_HEAP_OP_FREE, blocks, &prof);
+}
 
-  do {
+/**
+ * s_usable_size() - Get the number of bytes that fit in a chunk.
+ *
+ * @ptr: A pointer returned by s_alloc or NULL.
+ * @my_heap: The heap where the chunk lives in.
+ *
+ * Return: The usable size of the chunk, 0 for NULL.
+ */
+size_t s_usable_size(void *ptr, heap_t *my_heap)
+{
+  mem_mask_t mask;
 
-      merge_blocks = false;
+  if (ptr == NULL)
+    return 0;
 
-      list_for_each_entry (node, &my_heap->g_free_heap_list, node_list)
-      {
-        struct list_head *next_node = node->node_list.next;
-        mem_node_t *next_free_node = list_entry(next_node, mem_node_t, node_list);
+  mask = s_heap_mask(s_ptr_to_node(my_heap, ptr));
+  return mask.size * my_heap->block_size - S_HEAP_HDR_SIZE;
+}
 
-        for (int offset = 0; offset < 2; offset++)
-        {
-          mem_node_t *next_possible_node = (mem_node_t *)node->chunk_addr + node->mask.size + offset;
-          if (next_possible_node->chunk_addr == ((void *)next_possible_node + sizeof(mem_node_t)))
-          {
-            /* We almost sure have a new node !!! or we may be totally wrong */
+/**
+ * s_free_batch() - Release several memory chunks at once.
+ *
+ * @ptrs: The chunks to release, NULL entries are skipped. The array is not
+ *        modified.
+ * @num: The number of entries in ptrs.
+ * @my_heap: The specified heap where the chunks live in.
+ *
+ * Consecutive entries whose chunks follow each other in memory are absorbed
+ * into the first one of their run while it is locked. Nobody else can reach
+ * the headers of the absorbed chunks: they are used so no neighbour merges
+ * with them and the chunk before them is ours. The pointers are not sorted,
+ * entries out of address order are simply released one by one.
+ *
+ * Return: None.
+ */
+void s_free_batch(void **ptrs, size_t num, heap_t *my_heap)
+{
+  uint32_t depth = s_trace_enter();
+  s_prof_t prof = s_prof_start();
+  mem_node_t *node, *next_node;
+  size_t i = 0, freed = 0;
+  mem_mask_t mask;
 
-            /* Verify if the size makes sense */
+  s_trace_batch(my_heap, depth, S_HEAP_OP_FREE, ptrs, NULL, num);
 
-            if (next_possible_node->mask.used == 1 ||
-                next_possible_node->mask.size == 0 ||
-                next_possible_node->mask.size > 0xFFFF)
-            {
-              continue;
-            }
+  while (i < num)
+  {
+    if (ptrs[i] == NULL)
+    {
+      i++;
+      continue;
+    }
 
-            /* Check if blocks are adjacent in memory */
+    node = s_ptr_to_node(my_heap, ptrs[i++]);
+    s_node_lock(my_heap, node);
+    freed++;
 
-            if (next_possible_node == next_free_node)
-            {
-              merge_blocks = true;
+    while (i < num && ptrs[i] != NULL)
+    {
+      next_node = s_ptr_to_node(my_heap, ptrs[i]);
+      if (next_node != s_next_node(my_heap, node))
+        break;
 
-              /* The next block is my neighbour. Merge with him */
+      s_node_lock(my_heap, next_node);
+      mask = s_heap_mask(node);
+      mask.size += s_heap_mask(next_node).size;
+      s_node_set_mask(node, mask);
+      freed++;
+      i++;
+    }
 
-              assert(node->mask.used == 0);
+    s_node_unlock(my_heap, node);
+    s_free_node(my_heap, node);
+  }
 
-              node->mask.size += next_free_node->mask.size + 1;
-              list_del(next_node);
-              break;
-            }
-          }
-        }
-      }
+  if (freed != 0)
+    s_stat_add(my_heap, &my_heap->free_count, freed);
 
-  } while(merge_blocks);
+  s_prof_end(my_heap, S_HEAP_OP_FREE_BATCH, num, &prof);
 }
 
 /**
- * s_realloc() - Re-allocate a memory block with a new specified size.
+ * s_do_realloc() - Re-allocate a memory block with a new specified size.
  *
  * @ptr: Previously allocated buffer with s_alloc or NULL in case this is a new
  *       allocation.
  * @size: The size of the new alocation or 0 if we want to free ptr memory.
  * @my_heap: The specified heap where the buffer lives in.
  *
- * Resize a block of memory. In case the block does not exist in the
- * used blocks list we assert.
+ * Resize a block of memory. The chunk is shrunk in place or extended into
+ * the next chunk in memory when that one is free, the data is only copied
+ * to a new chunk when neither is possible. In case the pointer does not
+ * belong to an allocated chunk we assert.
  *
  * Return: None.
  *
  */
-void *s_realloc(void *ptr, size_t size, heap_t *my_heap)
+static void *s_do_realloc(void *ptr, size_t size, heap_t *my_heap)
 {
   if (ptr == NULL)
   {
@@ -485,27 +2997,67 @@ void *s_realloc(void *ptr, size_t size, heap_t *my_heap)
     return NULL;
   }
 
-  mem_node_t *node = NULL;
-  bool found_block = false;
-  list_for_each_entry (node, &my_heap->g_used_heap_list, node_list)
-  {
+  mem_node_t *node = s_ptr_to_node(my_heap, ptr);
+  mem_node_t *next_node, *next_next_node = NULL;
+  size_t blocks = s_heap_len_to_blocks(my_heap, size);
+  size_t old_size;
 
-    if (node->chunk_addr == ptr)
-      {
-        /* We can't have a free block in this list */
+  s_node_lock(my_heap, node);
+  next_node = s_next_node(my_heap, node);
+  if (next_node != NULL)
+    s_node_lock(my_heap, next_node);
 
-        assert(node->mask.used == 1);
+  /* The payload has been written since the chunk was handed out */
 
-        found_block = true;
-        break;
-      }
+  s_node_dirty(node);
+
+  /* Shrink in place and give the tail back to the free bins */
+
+  if (blocks <= s_heap_mask(node).size)
+  {
+    next_node = s_release_tail(my_heap, node, blocks, next_node);
+
+    s_node_unlock(my_heap, next_node);
+    s_node_unlock(my_heap, node);
+    return ptr;
   }
 
-  /* The specified input address for this function is invalid.
-   * Did we encounter a double free memory corruption ?
+  /* Grow in place if the next chunk in memory is free and large enough,
+   * only the missing part is cut from the wilderness.
    */
 
-  assert(found_block == true);
+  if (next_node != NULL && s_heap_mask(next_node).used == 0 &&
+      s_heap_mask(node).size + s_heap_mask(next_node).size >= blocks)
+  {
+    if (s_is_wild(my_heap, next_node))
+    {
+      s_wild_lock(my_heap);
+      s_wild_carve(my_heap, next_node, blocks - s_heap_mask(node).size);
+      s_wild_unlock(my_heap);
+    }
+    else
+      s_bin_remove(my_heap, next_node);
+
+    next_next_node = s_next_node(my_heap, next_node);
+    if (next_next_node != NULL)
+      s_node_lock(my_heap, next_next_node);
+
+    s_node_absorb(node, next_node);
+
+    s_mark_used(my_heap, node);
+    next_next_node = s_release_tail(my_heap, node, blocks, next_next_node);
+
+    s_node_unlock(my_heap, next_next_node);
+    s_node_unlock(my_heap, node);
+    return ptr;
+  }
+
+  old_size = s_heap_mask(node).size * my_heap->block_size - S_HEAP_HDR_SIZE;
+
+  s_node_unlock(my_heap, next_node);
+  s_node_unlock(my_heap, node);
+
+  /* Move the data to a new chunk as a last resort */
 
   uint8_t *new_buffer = s_alloc(size, my_heap);
   if (new_buffer == NULL)
@@ -514,12 +3066,37 @@ void *s_realloc(void *ptr, size_t size, heap_t *my_heap)
     return NULL;
   }
 
-  /* If we shrink space we need to copy at least these bytes */
+  /* We only get here when growing so the whole old chunk is copied */
 
-  size_t alloc_size = node->mask.size * my_heap->block_size;
-  size_t min_copy_size = size > alloc_size ? alloc_size :
-    size;
-  memcpy(new_buffer, ptr, min_copy_size);
+  memcpy(new_buffer, ptr, old_size);
   s_free(ptr, my_heap);
   return new_buffer;
 }
+
+/**
+ * s_realloc() - Re-allocate a memory block with a new specified size.
+ *
+ * @ptr: Previously allocated buffer with s_alloc or NULL in case this is a new
+ *       allocation.
+ * @size: The size of the new alocation or 0 if we want to free ptr memory.
+ * @my_heap: The specified heap where the buffer lives in.
+ *
+ * Return: The resized buffer, NULL when it could not be resized or when
+ * size is 0.
+ */
+void *s_realloc(void *ptr, size_t size, heap_t *my_heap)
+{
+  uint32_t depth = s_trace_enter();
+  s_prof_t prof = s_prof_start();
+  void *new_ptr;
+
+  if (depth == 0 && ptr != NULL && size == 0)
+    s_trace_record(my_heap, S_HEAP_OP_FREE, 0, ptr, 0);
+
+  new_ptr = s_do_realloc(ptr, size, my_heap);
+  s_prof_end(my_heap, S_HEAP_OP_REALLOC, s_heap_len_to_blocks(my_heap, size),
+             &prof);
+  s_trace_leave(my_heap, depth, S_HEAP_OP_REALLOC, size, new_ptr,
+                (uintptr_t)ptr);
+  return new_ptr;
+}
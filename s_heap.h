@@ -20,49 +20,442 @@
 #define __S_HEAP_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
 
 #include "list.h"
 
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+/* The free bins are organized in two levels. The first level splits the
+ * sizes in powers of two and the second level splits every power of two
+ * range in S_HEAP_SL_COUNT linear classes.
+ *
+ * The segregated engine only uses the first second level list of every
+ * first level class, the TLSF engine uses all of them.
+ */
+
+#define S_HEAP_FL_COUNT     (32)
+#define S_HEAP_SL_LOG2      (4)
+#define S_HEAP_SL_COUNT     (1 << S_HEAP_SL_LOG2)
+
+/* Values stored in every chunk header to validate the pointers received by
+ * s_free and s_realloc.
+ */
+
+#define S_HEAP_MAGIC_USED   (0x5A110C8DU)
+#define S_HEAP_MAGIC_FREE   (0x5A11F8EEU)
+#define S_HEAP_MAGIC_FENCE  (0x5A11FE4CU)
+
+/* Chunk sizes are multiples of the block size and the payloads are aligned
+ * to it. S_HEAP_BLOCK_SIZE is used unless s_init_ex is given another power
+ * of two of at least 8 bytes.
+ */
+
+#define S_HEAP_BLOCK_SIZE   (16)
+
+/* The largest chunk in blocks number, a larger region is truncated */
+
+#define S_HEAP_MAX_BLOCKS   ((1U << 28) - 1)
+
+/* Bytes of a chunk header. The bin links that follow it in mem_node_t are
+ * only valid while the chunk is free, in a used chunk they overlap the
+ * payload.
+ */
+
+#define S_HEAP_HDR_SIZE     (offsetof(mem_node_t, node_list))
+
+/* Size and alignment of the regions mapped by s_init_huge(), a transparent
+ * huge page with 4K base pages.
+ */
+
+#define S_HEAP_HUGE_PAGE_SIZE (2UL << 20)
+
+/* Number of s_free calls between two automatic purges of the free chunks
+ * unless s_init_ex is given another interval.
+ */
+
+#define S_HEAP_PURGE_INTERVAL (1024)
+
+/* Number of free chunks of one class a purge locks and releases at a time,
+ * the automatic purges release at most this many per class.
+ */
+
+#define S_HEAP_PURGE_BATCH  (16)
+
+/* Number of chunks freed without coalescing before a heap in deferred
+ * coalescing mode compacts its free chunks, unless s_init_ex is given
+ * another limit.
+ */
+
+#define S_HEAP_DEFER_LIMIT  (4096)
+
+/* Building the library and its users with -DS_HEAP_PROFILE times every
+ * public allocation and release call, see s_heap_prof_read(). The
+ * latencies and the visit counts are kept in log2 buckets.
+ */
+
+#define S_HEAP_PROF_BUCKETS (32)
+
+/* Building the library with -DS_HEAP_TRACE lets s_heap_trace_start() log
+ * the public calls to a file, see s_heap_trace_rec_t. The records are
+ * written S_HEAP_TRACE_BATCH at a time.
+ */
+
+#define S_HEAP_TRACE_MAGIC  (0x43525453U)
+#define S_HEAP_TRACE_VERSION (1)
+#define S_HEAP_TRACE_BATCH  (4096)
+
 /****************************************************************************
  * Public types
  ****************************************************************************/
 
-/* This structure keeps track of the memory chunk size */
+/* The allocation engine used by a heap */
+
+typedef enum {
+  S_HEAP_MODE_SEGREGATED = 0, /* Power of two bins, first fit in the bin */
+  S_HEAP_MODE_TLSF,           /* Two-Level Segregated Fit, O(1) bounded */
+} s_heap_mode_t;
+
+/* Optional heap settings for s_init_ex, zero means default */
 
 typedef struct {
-  uint32_t used : 1;  /* used/unused chunk */
-  uint32_t size : 31; /* size of the chunk without header in blocks number */
+  s_heap_mode_t mode;         /* Allocation engine */
+  size_t block_size;          /* Allocation granularity, S_HEAP_BLOCK_SIZE */
+  size_t alignment;           /* Minimum payload alignment, the block size */
+  bool zeroed;                /* The region is known to be zero filled */
+  size_t grow_size;           /* Segment size mapped on exhaustion, 0 never */
+  size_t purge_min;           /* Free chunks given back to the OS, 0 never */
+  uint32_t purge_interval;    /* s_free calls before a free chunk is purged */
+  bool defer_coalescing;      /* s_free does not merge free neighbours */
+  uint32_t defer_limit;       /* Deferred frees between compactions */
+} s_heap_config_t;
+
+/* Heap state reported by s_heap_stats */
+
+typedef struct {
+  size_t total_bytes;         /* Bytes of all the chunks of the segments */
+  size_t used_bytes;          /* Bytes of the used chunks, headers included */
+  size_t free_bytes;          /* Bytes of the free chunks and the wilderness */
+  size_t free_chunks;         /* Free chunks in the bins */
+  size_t largest_free;        /* Bytes of the largest free chunk */
+  size_t wild_bytes;          /* Bytes left in the wilderness */
+  size_t alloc_count;         /* Successful allocations */
+  size_t free_count;          /* Released chunks */
+  size_t failed_count;        /* Allocations that returned NULL */
+
+  /* free_hist[N] counts the free chunks of 2^N to 2^(N+1) - 1 blocks */
+
+  size_t free_hist[S_HEAP_FL_COUNT];
+
+  /* 1000 * (1 - largest_free / free_bytes): 0 when the free memory is in
+   * one piece, close to 1000 when it is spread in many small chunks.
+   */
+
+  uint32_t fragmentation;
+} s_heap_stats_t;
+
+/* Public calls timed in S_HEAP_PROFILE builds. A call made by another one,
+ * like the s_alloc() of a s_realloc() that moves the data, is timed for
+ * both of them but only the outer one is logged in S_HEAP_TRACE builds.
+ */
+
+typedef enum {
+  S_HEAP_OP_ALLOC = 0,        /* s_alloc */
+  S_HEAP_OP_ALIGNED_ALLOC,    /* s_aligned_alloc */
+  S_HEAP_OP_CALLOC,           /* s_calloc */
+  S_HEAP_OP_REALLOC,          /* s_realloc */
+  S_HEAP_OP_FREE,             /* s_free and s_free_sized */
+  S_HEAP_OP_ALLOC_BATCH,      /* s_alloc_batch */
+  S_HEAP_OP_FREE_BATCH,       /* s_free_batch */
+  S_HEAP_OP_COUNT,
+} s_heap_op_t;
+
+/* Histograms reported by s_heap_prof_read. Bucket 0 counts the calls that
+ * took no time and bucket N the ones that took 2^(N-1) to 2^N - 1 ticks,
+ * the last bucket also holds the slower ones. A tick is a TSC cycle on x86
+ * and a nanosecond elsewhere.
+ */
+
+typedef struct {
+  /* [op][size class][bucket]: the size class is the log2 of the chunk
+   * size in blocks, or of the number of chunks for the batch calls.
+   */
+
+  size_t latency[S_HEAP_OP_COUNT][S_HEAP_FL_COUNT][S_HEAP_PROF_BUCKETS];
+
+  /* [op][bucket] of the free chunks a call looked at: bin entries
+   * searched, neighbours merged and chunks walked by a purge or a
+   * compaction, bucketed like the latencies.
+   */
+
+  size_t visits[S_HEAP_OP_COUNT][S_HEAP_PROF_BUCKETS];
+} s_heap_prof_t;
+
+/* A trace file starts with this header */
+
+typedef struct {
+  uint32_t magic;             /* S_HEAP_TRACE_MAGIC */
+  uint32_t version;           /* S_HEAP_TRACE_VERSION */
+  uint32_t rec_size;          /* sizeof(s_heap_trace_rec_t) */
+  uint32_t reserved;
+} s_heap_trace_hdr_t;
+
+/* One logged call. The chunk address is the id of an allocation: it is
+ * given by an allocation record and used by the release or the s_realloc
+ * of the same chunk. Calls that fail are not logged, a s_realloc to size 0
+ * is logged as a release and the batch calls as one record per chunk.
+ */
+
+typedef struct {
+  uint64_t time_ns : 56;      /* Since s_heap_trace_start() */
+  uint64_t op : 8;            /* s_heap_op_t */
+  uint64_t size;              /* Requested size, 0 for a release */
+  uint64_t ptr;               /* Chunk returned or released */
+  uint64_t arg;               /* Old chunk of a s_realloc, alignment of a
+                               * s_aligned_alloc, 0 otherwise */
+} s_heap_trace_rec_t;
+
+/* This structure keeps track of the memory chunk size. The payload of a free
+ * chunk with the zeroed bit set only holds zeros apart from its bin links and
+ * its boundary tag, either because it was never used or because its pages
+ * were purged. A used chunk keeps the bit it had when it was handed out.
+ */
+
+typedef union {
+  struct {
+    uint32_t used : 1;      /* used/unused chunk */
+    uint32_t prev_free : 1; /* the previous chunk in memory is free */
+    uint32_t locked : 1;    /* header owned by a thread in thread-safe mode */
+    uint32_t zeroed : 1;    /* payload is zero, see below */
+    uint32_t size : 28;     /* size of the chunk with header in blocks number */
+  };
+  uint32_t word;            /* all the fields for atomic access */
 } mem_mask_t;
 
-/* The memory chunk is represented as a node in a double linked list */
+/* The memory chunk header. The payload starts S_HEAP_HDR_SIZE bytes after
+ * it and a free chunk is a node in the double linked list of its bin.
+ */
 
 typedef struct mem_node_info_s
 {
   mem_mask_t mask;            /* Chunk information as size */
-  void *chunk_addr;           /* Start of an allocated chunk */
-  struct list_head node_list; /* Next/Prev chunk node */
+  uint32_t magic;             /* S_HEAP_MAGIC_USED or S_HEAP_MAGIC_FREE */
+  struct list_head node_list; /* Next/Prev node in a free bin, free only */
 } mem_node_t;
 
+/* The boundary tag stored at the end of a free chunk. It lets the next
+ * chunk in memory find this header when its prev_free bit is set.
+ */
+
+typedef struct {
+  mem_node_t *node;           /* Header of the free chunk */
+} mem_footer_t;
+
+/* A memory region that holds chunks. The chunks of a segment are followed
+ * by a fence header of size 0 so that they are never merged with the chunks
+ * of another segment.
+ */
+
+typedef struct s_heap_seg_s
+{
+  struct s_heap_seg_s *next;  /* Next segment of the heap */
+  uintptr_t start;            /* First chunk header */
+  uintptr_t end;              /* Fence header */
+  size_t map_len;             /* Bytes mapped by the heap or 0 */
+} s_heap_seg_t;
+
 /* The heap memory structure */
 
 typedef struct {
-  struct list_head g_free_heap_list;
-  struct list_head g_used_heap_list;
+  struct list_head g_free_bins[S_HEAP_FL_COUNT][S_HEAP_SL_COUNT];
+
+  /* Bit N is set when one of the g_free_bins[N] lists is not empty and
+   * bit M of sl_bitmap[N] is set when g_free_bins[N][M] is not empty.
+   */
 
-  /* Memory boundaries */
+  uint32_t free_bins_bitmap;
+  uint32_t sl_bitmap[S_HEAP_FL_COUNT];
+
+  s_heap_mode_t mode;
+
+  /* Thread-safe mode: one lock for the bins of every first level class.
+   * Chunk headers are protected by their own lock bit.
+   */
+
+  bool thread_safe;
+  pthread_mutex_t bin_locks[S_HEAP_FL_COUNT];
+
+  /* The wilderness is the free chunk at the end of the last segment that
+   * was never split. It is not kept in the bins, allocations are carved
+   * from its front when the bins have nothing that fits. Memory from
+   * untouched to wild_end was never handed out and is still zero filled.
+   */
+
+  mem_node_t *wilderness;
+  uintptr_t untouched;
+  uintptr_t wild_end;
+  pthread_mutex_t wild_lock;
+
+  /* Memory boundaries of the region given to s_init, it is the first
+   * segment and the ones added later follow it in the list.
+   */
 
   void *heap_mem_start;
   void *heap_mem_start_unaligned;
   void *heap_memory_end;
+  s_heap_seg_t first_segment;
+  size_t grow_size;
+  bool huge_pages;            /* Segments are mapped on huge pages */
+
+  /* Free chunks of at least purge_min bytes give their pages back to the
+   * OS once they stayed free for a whole purge_interval of s_free calls.
+   * Every interval starts a new purge_epoch, a dirty chunk records the
+   * epoch in which it was binned.
+   */
+
+  size_t purge_min;
+  uint32_t purge_interval;
+  uint32_t purge_ticks;
+  uint32_t purge_epoch;
+
+  /* Deferred coalescing: s_free only puts the chunk in its bin, adjacent
+   * free chunks are merged by s_heap_compact_free() once defer_limit of
+   * them piled up or when an allocation does not fit.
+   */
+
+  bool defer_coalescing;
+  uint32_t defer_limit;
+  uint32_t defer_count;
+
+  /* Running counters for s_heap_stats(). The free chunks in the bins are
+   * counted per power of two of their size in blocks, a class is only
+   * written with the lock of the bins that hold its chunks.
+   */
+
+  struct {
+    size_t chunks;
+    size_t blocks;
+  } bin_stats[S_HEAP_FL_COUNT];
+  size_t alloc_count;
+  size_t free_count;
+  size_t failed_count;
+
+#ifdef S_HEAP_PROFILE
+  s_heap_prof_t prof;
+#endif
+
+#ifdef S_HEAP_TRACE
+  struct s_heap_trace_s *trace;
+  uint32_t trace_users;       /* Threads logging a call right now */
+#endif
 
   /* Size config */
 
   size_t block_size;
-  size_t num_blocks;
-  size_t total_size;
+  size_t alignment;           /* Minimum alignment of every payload */
+  size_t num_blocks;          /* Blocks of all the segments */
+  size_t min_blocks;          /* Smallest chunk that can hold the free links */
+  size_t total_size;          /* Bytes of all the segments */
 } heap_t;
 
+/****************************************************************************
+ * Inline Functions
+ ****************************************************************************/
+
+/**
+ * s_bin_mapping() - Get the free bin indexes for a chunk size.
+ *
+ * @my_heap: The heap context.
+ * @size: The chunk size in blocks number.
+ * @fl: Output first level index.
+ * @sl: Output second level index.
+ *
+ * The segregated engine uses one bin per power of two. The TLSF engine
+ * keeps the sizes under S_HEAP_SL_COUNT blocks in the first class and
+ * splits every power of two range above it in S_HEAP_SL_COUNT classes.
+ */
+static inline void s_bin_mapping(heap_t *my_heap, size_t size,
+                                 unsigned int *fl, unsigned int *sl)
+{
+  unsigned int msb = size ? 31 - __builtin_clz((uint32_t)size) : 0;
+
+  if (my_heap->mode == S_HEAP_MODE_SEGREGATED)
+  {
+    *fl = msb;
+    *sl = 0;
+  }
+  else if (size < S_HEAP_SL_COUNT)
+  {
+    *fl = 0;
+    *sl = size;
+  }
+  else
+  {
+    *fl = msb - S_HEAP_SL_LOG2 + 1;
+    *sl = (size >> (msb - S_HEAP_SL_LOG2)) - S_HEAP_SL_COUNT;
+  }
+}
+
+/**
+ * s_heap_node() - Get the header of a chunk from its payload.
+ *
+ * @ptr: The pointer returned by s_alloc.
+ *
+ * The header is not validated, see s_free for that.
+ *
+ * Return: The chunk header.
+ */
+static inline mem_node_t *s_heap_node(void *ptr)
+{
+  return (mem_node_t *)((uint8_t *)ptr - S_HEAP_HDR_SIZE);
+}
+
+/**
+ * s_heap_mask() - Read the mask of a chunk header.
+ *
+ * @node: The chunk header.
+ *
+ * In thread-safe mode other threads take and drop the lock bit of any
+ * header with atomic operations on the whole word, so the fields are
+ * always read from an atomic load of it.
+ *
+ * Return: A copy of the mask.
+ */
+static inline mem_mask_t s_heap_mask(const mem_node_t *node)
+{
+  mem_mask_t mask;
+
+  mask.word = __atomic_load_n(&node->mask.word, __ATOMIC_RELAXED);
+  return mask;
+}
+
+/**
+ * s_heap_len_to_blocks() - Get the chunk size needed for a request.
+ *
+ * @my_heap: The heap context.
+ * @len: The requested memory size.
+ *
+ * Return: The number of blocks of the chunk that holds len bytes and its
+ * header, S_HEAP_MAX_BLOCKS + 1 if it can never fit in a chunk.
+ */
+static inline size_t s_heap_len_to_blocks(heap_t *my_heap, size_t len)
+{
+  size_t blocks;
+
+  if (len > (size_t)S_HEAP_MAX_BLOCKS * my_heap->block_size)
+    return (size_t)S_HEAP_MAX_BLOCKS + 1;
+
+  blocks = (len + S_HEAP_HDR_SIZE + my_heap->block_size - 1) /
+    my_heap->block_size;
+
+  return blocks < my_heap->min_blocks ? my_heap->min_blocks : blocks;
+}
+
 /****************************************************************************
  * Public Functions
  ****************************************************************************/
@@ -83,6 +476,221 @@ void s_init(heap_t *my_heap,
             void *start_heap_unaligned,
             void *end_heap);
 
+/**
+ * s_init_mode() - Initialize heap memory with a specific allocation engine.
+ *
+ * @my_heap : The heap context used to store heap info.
+ * @start_heap_unaligned: The start of the unaligned memory region for HEAP.
+ * @end_heap: The end of the HEAP region.
+ * @mode: The engine used to search the free bins.
+ *
+ * Same as s_init() but lets the caller pick S_HEAP_MODE_TLSF which bounds
+ * the cost of s_alloc and s_free to a constant number of steps.
+ *
+ * Return: No return value.
+ */
+void s_init_mode(heap_t *my_heap,
+                 void *start_heap_unaligned,
+                 void *end_heap,
+                 s_heap_mode_t mode);
+
+/**
+ * s_init_ex() - Initialize heap memory with a specific configuration.
+ *
+ * @my_heap : The heap context used to store heap info.
+ * @start_heap_unaligned: The start of the unaligned memory region for HEAP.
+ * @end_heap: The end of the HEAP region.
+ * @config: The engine, block size, minimum alignment and whether the region
+ *          is already zero filled or NULL for the defaults of s_init().
+ *
+ * Small blocks waste less memory on rounding, large blocks make the free
+ * chunks cover more memory per size class. When the alignment is larger
+ * than the block size every allocation behaves like s_aligned_alloc().
+ *
+ * Only the first chunk header is written, the rest of the region is not
+ * touched until it is handed out. With a grow_size the heap maps a new
+ * segment of at least that size from the OS when it runs out of memory.
+ * With a purge_min the pages of free chunks of at least that size are
+ * given back to the OS after they stayed free for purge_interval calls to
+ * s_free, see s_heap_trim(). With
+ * defer_coalescing the free chunks are merged in batches, see
+ * s_heap_compact_free().
+ *
+ * Return: 0 on success, -1 if the configuration is invalid.
+ */
+int s_init_ex(heap_t *my_heap,
+              void *start_heap_unaligned,
+              void *end_heap,
+              const s_heap_config_t *config);
+
+/**
+ * s_init_huge() - Initialize a heap on a region mapped with huge pages.
+ *
+ * @my_heap : The heap context used to store heap info.
+ * @len: The size of the region, rounded up to S_HEAP_HUGE_PAGE_SIZE.
+ * @config: The heap settings like for s_init_ex() or NULL.
+ *
+ * The region is an anonymous mapping aligned to S_HEAP_HUGE_PAGE_SIZE. It
+ * is backed by reserved huge pages (MAP_HUGETLB) when the system has them
+ * and by transparent huge pages (MADV_HUGEPAGE) otherwise. The segments
+ * mapped when the heap grows are mapped the same way and s_heap_destroy()
+ * unmaps all of them.
+ *
+ * Return: 0 on success, -1 if the region could not be mapped or the
+ * configuration is invalid.
+ */
+int s_init_huge(heap_t *my_heap, size_t len, const s_heap_config_t *config);
+
+/**
+ * s_heap_extend() - Add a memory region to a heap.
+ *
+ * @my_heap: An initialized heap.
+ * @start: The start of the new region.
+ * @end: The end of the new region.
+ *
+ * The region becomes a new segment of the heap and its free space the new
+ * wilderness. Chunks are never merged across segments so the region does
+ * not have to be adjacent to the others.
+ *
+ * Return: 0 on success, -1 if the region is too small.
+ */
+int s_heap_extend(heap_t *my_heap, void *start, void *end);
+
+/**
+ * s_heap_contains() - Check if a pointer belongs to one of the segments.
+ *
+ * @my_heap: The heap context.
+ * @ptr: Any address.
+ *
+ * Return: true if ptr lies inside a segment of the heap.
+ */
+bool s_heap_contains(heap_t *my_heap, const void *ptr);
+
+/**
+ * s_heap_destroy() - Release the resources held by a heap.
+ *
+ * @my_heap: The heap context, it can not be used any more.
+ *
+ * The segments mapped when the heap grew on its own and the region of
+ * s_init_huge() are unmapped, the regions given by the caller are left
+ * alone. A running trace is stopped.
+ *
+ * Return: None.
+ */
+void s_heap_destroy(heap_t *my_heap);
+
+/**
+ * s_heap_trim() - Give the pages of the free memory back to the OS.
+ *
+ * @my_heap: The heap context.
+ *
+ * The whole pages inside the free chunks and the used part of the
+ * wilderness are released with madvise(MADV_DONTNEED). The heap memory has
+ * to be private anonymous memory, the purged pages read as zero when they
+ * are faulted in again and the chunks are tagged as zeroed so s_calloc()
+ * does not clear them.
+ *
+ * Return: The number of bytes given back.
+ */
+size_t s_heap_trim(heap_t *my_heap);
+
+/**
+ * s_heap_compact_free() - Merge the free chunks that are neighbours.
+ *
+ * @my_heap: The heap context.
+ *
+ * In deferred coalescing mode s_free() leaves the freed chunk next to its
+ * free neighbours, which is cheap when chunks of the same size are reused
+ * right away. This walks all the segments once and merges every run of
+ * free chunks, including the ones that end at the wilderness. It runs on
+ * its own when defer_limit chunks were freed since the last compaction or
+ * when an allocation does not fit.
+ *
+ * Return: The number of free chunks that were merged into another one.
+ */
+size_t s_heap_compact_free(heap_t *my_heap);
+
+/**
+ * s_heap_stats() - Report the heap usage and fragmentation.
+ *
+ * @my_heap: The heap context.
+ * @stats: Output structure filled with the counters.
+ *
+ * The counters are kept up to date by the allocation and release paths,
+ * so the report does not walk the chunks. The largest free chunk is the
+ * wilderness or the largest chunk of the highest non-empty bin, which is
+ * the only list that is searched, under its bin lock. In thread-safe mode
+ * the report is a snapshot that other threads may be changing.
+ *
+ * Return: None.
+ */
+void s_heap_stats(heap_t *my_heap, s_heap_stats_t *stats);
+
+/**
+ * s_heap_prof_read() - Copy the latency histograms of a heap.
+ *
+ * @my_heap: The heap context.
+ * @prof: Output structure filled with the histograms.
+ *
+ * The histograms are only kept when the library is built with
+ * S_HEAP_PROFILE, otherwise the public calls are not timed at all.
+ *
+ * Return: 0 on success, -1 if the library was built without
+ * S_HEAP_PROFILE in which case prof is zero filled.
+ */
+int s_heap_prof_read(heap_t *my_heap, s_heap_prof_t *prof);
+
+/**
+ * s_heap_prof_reset() - Clear the latency histograms of a heap.
+ *
+ * @my_heap: The heap context.
+ *
+ * Return: None.
+ */
+void s_heap_prof_reset(heap_t *my_heap);
+
+/**
+ * s_heap_trace_start() - Log the calls made on a heap to a file.
+ *
+ * @my_heap: The heap context.
+ * @path: The trace file, created or truncated.
+ *
+ * Every s_alloc(), s_aligned_alloc(), s_calloc(), s_realloc(), s_free()
+ * and batch call is appended to the file as an s_heap_trace_rec_t, in the
+ * order the calls complete. The records go through a buffer that is
+ * written when it is full and by s_heap_trace_stop().
+ *
+ * Return: 0 on success, -1 if the file can not be created, the heap is
+ * already traced or the library was built without S_HEAP_TRACE.
+ */
+int s_heap_trace_start(heap_t *my_heap, const char *path);
+
+/**
+ * s_heap_trace_stop() - Flush and close the trace of a heap.
+ *
+ * @my_heap: The heap context.
+ *
+ * The calls that complete after it are not logged any more, it waits for
+ * the ones being logged by other threads.
+ *
+ * Return: 0 on success, -1 if the heap was not traced or a write to the
+ * trace file failed.
+ */
+int s_heap_trace_stop(heap_t *my_heap);
+
+/**
+ * s_heap_set_thread_safe() - Let several threads use a heap concurrently.
+ *
+ * @my_heap: An initialized heap that is not used by any thread yet.
+ *
+ * Every first level class of free bins gets its own lock and every chunk
+ * header is protected by a lock bit, so threads allocating from different
+ * size classes or freeing chunks that are not neighbours do not contend.
+ *
+ * Return: 0 on success, an error number otherwise.
+ */
+int s_heap_set_thread_safe(heap_t *my_heap);
+
 /**
  * s_alloc() - Allocate a memory chunk in a specified heap.
  *
@@ -99,20 +707,118 @@ void s_init(heap_t *my_heap,
  */
 void *s_alloc(size_t len, heap_t *my_heap);
 
+/**
+ * s_aligned_alloc() - Allocate an aligned memory chunk in a specified heap.
+ *
+ * @align: The payload alignment, a power of two.
+ * @len: The requested memory size.
+ * @my_heap: The heap context where we allocate memory.
+ *
+ * The chunk header is placed right before the aligned payload and the gap
+ * in front of it goes back to the free bins. The chunk is released with
+ * s_free() and resized with s_realloc() like any other, a chunk that has
+ * to move in s_realloc() is only aligned to the heap alignment.
+ *
+ * Return: A void pointer on success otherwise NULL.
+ */
+void *s_aligned_alloc(size_t align, size_t len, heap_t *my_heap);
+
+/**
+ * s_calloc() - Allocate a zero filled memory chunk in a specified heap.
+ *
+ * @nmemb: The number of elements.
+ * @size: The size of an element.
+ * @my_heap: The heap context where we allocate memory.
+ *
+ * Chunks carved out of memory that was never used since the heap was
+ * initialized from a zero filled region are not cleared again.
+ *
+ * Return: A void pointer on success otherwise NULL, also when the total
+ * size overflows.
+ */
+void *s_calloc(size_t nmemb, size_t size, heap_t *my_heap);
+
+/**
+ * s_alloc_batch() - Allocate several memory chunks at once.
+ *
+ * @num: The number of chunks.
+ * @sizes: The requested size of every chunk.
+ * @out: Output array of num chunk pointers.
+ * @my_heap: The heap context where we allocate memory.
+ *
+ * All the chunks are cut one after the other from a single free chunk, so
+ * the free bins are searched once for the whole batch. The chunks are
+ * released with s_free() or s_free_batch() like any other.
+ *
+ * Return: 0 on success, -1 if the batch does not fit in which case out is
+ * filled with NULL.
+ */
+int s_alloc_batch(size_t num, const size_t *sizes, void **out,
+                  heap_t *my_heap);
+
 /**
  * s_free() - Release an allocated block of memory.
  *
  * @ptr: The specified buffer to be freed.
  * @my_heap: The specified heap where the buffer lives in.
  *
- * Free an allocate dmmeory chunk. In case the block does not exist in the
- * used blocks list we assert.
+ * Free an allocate dmmeory chunk. In case the pointer does not belong to an
+ * allocated chunk we assert. The chunk is merged with its free physical
+ * neighbours and placed in the free bin that matches its size.
  *
  * Return: None.
  *
  */
 void s_free(void *ptr, heap_t *my_heap);
 
+/**
+ * s_free_sized() - Release an allocated block of memory of a known size.
+ *
+ * @ptr: The specified buffer to be freed or NULL.
+ * @size: The size that was requested when the buffer was allocated, or any
+ *        size up to s_usable_size() of the buffer.
+ * @my_heap: The specified heap where the buffer lives in.
+ *
+ * Same as s_free() for callers that still know the size of the buffer.
+ * The chunk header already holds its size so there is no lookup for the
+ * hint to save, it is only checked against the header in debug builds.
+ *
+ * Return: None.
+ */
+void s_free_sized(void *ptr, size_t size, heap_t *my_heap);
+
+/**
+ * s_usable_size() - Get the number of bytes that fit in a chunk.
+ *
+ * @ptr: A buffer allocated from my_heap or NULL.
+ * @my_heap: The specified heap where the buffer lives in.
+ *
+ * The chunk may be larger than the requested size because of the block
+ * size rounding, the whole usable size can be written without a
+ * s_realloc().
+ *
+ * Return: The usable size of the buffer in bytes, 0 for NULL.
+ */
+size_t s_usable_size(void *ptr, heap_t *my_heap);
+
+/**
+ * s_free_batch() - Release several memory chunks at once.
+ *
+ * @ptrs: The chunks to release in any order, NULL entries are skipped. The
+ *        array is left as it is.
+ * @num: The number of entries in ptrs.
+ * @my_heap: The specified heap where the chunks live in.
+ *
+ * Consecutive entries that are physical neighbours are merged first and
+ * every merged run is released with a single s_free(), so a batch from
+ * s_alloc_batch(), which is in address order, goes back to the free bins
+ * in one step. The array is not sorted, entries out of address order are
+ * released one by one.
+ *
+ * Return: None.
+ */
+void s_free_batch(void **ptrs, size_t num, heap_t *my_heap);
+
 /**
  * s_realloc() - Re-allocate a memory block with a new specified size.
  *
@@ -121,8 +827,10 @@ void s_free(void *ptr, heap_t *my_heap);
  * @size: The size of the new alocation or 0 if we want to free ptr memory.
  * @my_heap: The specified heap where the buffer lives in.
  *
- * Resize a block of memory. In case the block does not exist in the
- * used blocks list we assert.
+ * Resize a block of memory. The chunk is shrunk in place or extended into
+ * the next chunk in memory when that one is free, the data is only copied
+ * to a new chunk when neither is possible. In case the pointer does not
+ * belong to an allocated chunk we assert.
  *
  * Return: None.
  *
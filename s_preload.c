@@ -0,0 +1,661 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Replace the C library allocator of a process with one thread-safe heap:
+ *
+ *   LD_PRELOAD=./lib_salloc.so ./program
+ *
+ * The heap is created by the first allocation. Allocations made while it
+ * is being created, by the thread that creates it, are served from a small
+ * static buffer and are never released. A pointer that this library did not
+ * return stops free, realloc and malloc_usable_size with a message, as the
+ * C library does.
+ *
+ * A fork() waits for the calls in progress to leave the heap and holds off
+ * the new ones, the child gets a heap with no lock taken.
+ * The thread that forks keeps using the heap from the fork handlers of
+ * other libraries.
+ *
+ * In a library built with -DS_HEAP_TRACE the calls are logged to the file
+ * $S_HEAP_TRACE_FILE.<pid> when the variable is set.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "s_heap.h"
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+/* The first segment is reserved up front and only faulted in when it is
+ * used. The heap grows by S_PRELOAD_GROW_SIZE segments past it.
+ */
+
+#define S_PRELOAD_HEAP_SIZE   ((size_t)S_HEAP_MAX_BLOCKS * S_HEAP_BLOCK_SIZE)
+#define S_PRELOAD_GROW_SIZE   (256UL << 20)
+#define S_PRELOAD_BOOT_SIZE   (64 * 1024)
+#define S_PRELOAD_BOOT_ALIGN  (16)
+
+#define S_PRELOAD_EXPORT      __attribute__((visibility("default")))
+
+/* The calls on the heap read lock one of these stripes, so the threads do
+ * not all write the same cache line.
+ */
+
+#define S_PRELOAD_STRIPES     (64)
+#define S_PRELOAD_CACHE_LINE  (64)
+
+/****************************************************************************
+ * Public types
+ ****************************************************************************/
+
+typedef enum {
+  S_PRELOAD_UNINIT = 0,
+  S_PRELOAD_INIT,             /* The heap is being created */
+  S_PRELOAD_READY,
+  S_PRELOAD_FAILED,           /* No memory could be reserved */
+} s_preload_state_t;
+
+typedef struct {
+  pthread_rwlock_t lock;      /* Write locked by fork() */
+} __attribute__((aligned(S_PRELOAD_CACHE_LINE))) s_preload_stripe_t;
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+static heap_t g_heap;
+static int g_state = S_PRELOAD_UNINIT;
+static pthread_t g_init_thread;
+
+static uint8_t g_boot[S_PRELOAD_BOOT_SIZE]
+  __attribute__((aligned(S_PRELOAD_BOOT_ALIGN)));
+static size_t g_boot_used;
+
+static s_preload_stripe_t g_stripes[S_PRELOAD_STRIPES];
+static uint32_t g_next_stripe;
+static __thread s_preload_stripe_t *g_stripe
+  __attribute__((tls_model("initial-exec")));
+static __thread bool g_forking __attribute__((tls_model("initial-exec")));
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/**
+ * s_preload_boot_alloc() - Allocate from the bootstrap buffer.
+ *
+ * @align: The payload alignment, a power of two.
+ * @len: The requested memory size.
+ *
+ * The length is stored right before the payload so that realloc and
+ * malloc_usable_size work on these chunks too.
+ *
+ * Return: A void pointer on success otherwise NULL.
+ */
+static void *s_preload_boot_alloc(size_t align, size_t len)
+{
+  size_t offset, end, used;
+
+  if (align < S_PRELOAD_BOOT_ALIGN)
+    align = S_PRELOAD_BOOT_ALIGN;
+
+  do {
+    used = __atomic_load_n(&g_boot_used, __ATOMIC_RELAXED);
+    offset = (used + sizeof(size_t) + align - 1) & ~(align - 1);
+    if (len > S_PRELOAD_BOOT_SIZE || offset > S_PRELOAD_BOOT_SIZE - len)
+      return NULL;
+
+    end = offset + len;
+  } while (!__atomic_compare_exchange_n(&g_boot_used, &used, end, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  memcpy(g_boot + offset - sizeof(size_t), &len, sizeof(size_t));
+  return g_boot + offset;
+}
+
+/**
+ * s_preload_is_boot() - Check if a pointer comes from the bootstrap buffer.
+ *
+ * @ptr: Any address.
+ *
+ * Return: true if ptr lies in the bootstrap buffer.
+ */
+static inline bool s_preload_is_boot(const void *ptr)
+{
+  return (uintptr_t)ptr - (uintptr_t)g_boot < S_PRELOAD_BOOT_SIZE;
+}
+
+/**
+ * s_preload_boot_len() - Get the length of a bootstrap chunk.
+ *
+ * @ptr: A pointer from the bootstrap buffer.
+ *
+ * Return: The length that was requested for the chunk.
+ */
+static inline size_t s_preload_boot_len(const void *ptr)
+{
+  size_t len;
+
+  memcpy(&len, (const uint8_t *)ptr - sizeof(size_t), sizeof(size_t));
+  return len;
+}
+
+/**
+ * s_preload_foreign() - Stop on a pointer that this library did not return.
+ *
+ * @ptr: The pointer.
+ * @func: The call it was given to.
+ *
+ * Its size is unknown, so it can neither be released, copied nor measured.
+ */
+static void __attribute__((noreturn)) s_preload_foreign(const void *ptr,
+                                                        const char *func)
+{
+  char msg[128];
+  int len = snprintf(msg, sizeof(msg),
+                     "lib_salloc: %s(%p): not allocated by this heap\n",
+                     func, ptr);
+  ssize_t ret = write(STDERR_FILENO, msg, len);
+
+  (void)ret;
+  abort();
+}
+
+/**
+ * s_preload_trace_start() - Log the calls made on the process heap.
+ *
+ * The trace file name ends with the process id so the programs started by
+ * a traced one do not truncate its trace.
+ */
+static void s_preload_trace_start(void)
+{
+  const char *prefix = getenv("S_HEAP_TRACE_FILE");
+  char path[PATH_MAX];
+
+  if (prefix == NULL ||
+      snprintf(path, sizeof(path), "%s.%d", prefix, (int)getpid()) >=
+      (int)sizeof(path))
+    return;
+
+  s_heap_trace_start(&g_heap, path);
+}
+
+/**
+ * s_preload_fini() - Write the end of the trace when the process exits.
+ */
+__attribute__((destructor)) static void s_preload_fini(void)
+{
+  if (__atomic_load_n(&g_state, __ATOMIC_ACQUIRE) == S_PRELOAD_READY)
+    s_heap_trace_stop(&g_heap);
+}
+
+/**
+ * s_preload_enter() - Start a call on the process heap.
+ *
+ * The call waits while a fork is in progress.
+ *
+ * Return: The stripe to pass to s_preload_leave().
+ */
+static s_preload_stripe_t *s_preload_enter(void)
+{
+  s_preload_stripe_t *stripe = g_stripe;
+
+  if (stripe == NULL)
+  {
+    stripe = &g_stripes[__atomic_fetch_add(&g_next_stripe, 1,
+                                           __ATOMIC_RELAXED) %
+                        S_PRELOAD_STRIPES];
+    g_stripe = stripe;
+  }
+
+  /* Between the prepare handler of this library and its parent or child
+   * handler, the forking thread runs the handlers of other libraries. It
+   * holds every stripe, so no other thread is on the heap.
+   */
+
+  if (g_forking)
+    return NULL;
+
+  pthread_rwlock_rdlock(&stripe->lock);
+  return stripe;
+}
+
+/**
+ * s_preload_leave() - End a call on the process heap.
+ *
+ * @stripe: The value returned by s_preload_enter().
+ */
+static inline void s_preload_leave(s_preload_stripe_t *stripe)
+{
+  if (stripe != NULL)
+    pthread_rwlock_unlock(&stripe->lock);
+}
+
+/**
+ * s_preload_stripes_init() - Create the stripe locks.
+ *
+ * A fork waiting for a stripe holds off its new readers, so the busy
+ * threads can not starve it.
+ *
+ * Return: 0 on success, an error number otherwise.
+ */
+static int s_preload_stripes_init(void)
+{
+  pthread_rwlockattr_t attr;
+  int ret;
+
+  ret = pthread_rwlockattr_init(&attr);
+  if (ret != 0)
+    return ret;
+
+  ret = pthread_rwlockattr_setkind_np(&attr,
+    PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+
+  for (int i = 0; i < S_PRELOAD_STRIPES && ret == 0; i++)
+    ret = pthread_rwlock_init(&g_stripes[i].lock, &attr);
+
+  pthread_rwlockattr_destroy(&attr);
+  return ret;
+}
+
+/**
+ * s_preload_fork_prepare() - Quiesce the heap before a fork.
+ *
+ * The stripes are write locked in a fixed order, this waits for the calls
+ * in progress and holds off the new ones. No thread is left with a chunk
+ * lock bit or a mutex of the heap, so none of them is taken here.
+ *
+ * A fork from a signal handler that interrupted a call on the heap waits
+ * for that call forever, as it would with the C library allocator.
+ */
+static void s_preload_fork_prepare(void)
+{
+  for (int i = 0; i < S_PRELOAD_STRIPES; i++)
+    pthread_rwlock_wrlock(&g_stripes[i].lock);
+
+  g_forking = true;
+}
+
+/**
+ * s_preload_fork_parent() - Let the calls on the heap run after a fork.
+ */
+static void s_preload_fork_parent(void)
+{
+  g_forking = false;
+
+  for (int i = S_PRELOAD_STRIPES - 1; i >= 0; i--)
+    pthread_rwlock_unlock(&g_stripes[i].lock);
+}
+
+/**
+ * s_preload_fork_child() - Start the heap of a forked child.
+ *
+ * The stripes are created again, the child only has the forking thread.
+ */
+static void s_preload_fork_child(void)
+{
+  g_forking = false;
+
+  if (s_preload_stripes_init() != 0)
+    abort();
+}
+
+/**
+ * s_preload_setup() - Create the process heap.
+ *
+ * Return: S_PRELOAD_READY or S_PRELOAD_FAILED.
+ */
+static int s_preload_setup(void)
+{
+  s_heap_config_t config = {
+    .zeroed = true,
+    .grow_size = S_PRELOAD_GROW_SIZE,
+  };
+  size_t len = S_PRELOAD_HEAP_SIZE;
+  uint8_t *map = MAP_FAILED;
+
+  /* Without overcommit a large reservation fails, ask for less */
+
+  for (; len >= S_PRELOAD_GROW_SIZE && map == MAP_FAILED; len /= 2)
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (map == MAP_FAILED)
+    return S_PRELOAD_FAILED;
+
+  len *= 2;
+  if (s_init_ex(&g_heap, map, map + len, &config) != 0 ||
+      s_heap_set_thread_safe(&g_heap) != 0 ||
+      s_preload_stripes_init() != 0 ||
+      pthread_atfork(s_preload_fork_prepare, s_preload_fork_parent,
+                     s_preload_fork_child) != 0)
+    return S_PRELOAD_FAILED;
+
+  s_preload_trace_start();
+  return S_PRELOAD_READY;
+}
+
+/**
+ * s_preload_ready() - Make sure the process heap exists.
+ *
+ * The first caller creates the heap while the others wait for it. When the
+ * creating thread allocates itself it gets bootstrap memory.
+ *
+ * Return: true if the heap can be used, false if the caller has to use
+ * the bootstrap buffer.
+ */
+static bool s_preload_ready(void)
+{
+  int state = __atomic_load_n(&g_state, __ATOMIC_ACQUIRE);
+  int expected = S_PRELOAD_UNINIT;
+
+  if (__builtin_expect(state == S_PRELOAD_READY, 1))
+    return true;
+
+  if (state == S_PRELOAD_UNINIT &&
+      __atomic_compare_exchange_n(&g_state, &expected, S_PRELOAD_INIT, false,
+                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+  {
+    g_init_thread = pthread_self();
+    __atomic_store_n(&g_state, s_preload_setup(), __ATOMIC_RELEASE);
+    return g_state == S_PRELOAD_READY;
+  }
+
+  while ((state = __atomic_load_n(&g_state, __ATOMIC_ACQUIRE)) ==
+         S_PRELOAD_INIT)
+  {
+    if (pthread_equal(g_init_thread, pthread_self()))
+      return false;
+
+    sched_yield();
+  }
+
+  return state == S_PRELOAD_READY;
+}
+
+/**
+ * s_preload_memalign() - Allocate an aligned chunk.
+ *
+ * @align: The payload alignment, a power of two.
+ * @len: The requested memory size.
+ *
+ * Return: A void pointer on success otherwise NULL with errno set.
+ */
+static void *s_preload_memalign(size_t align, size_t len)
+{
+  s_preload_stripe_t *stripe;
+  void *ptr;
+
+  if (s_preload_ready())
+  {
+    stripe = s_preload_enter();
+    ptr = s_aligned_alloc(align, len, &g_heap);
+    s_preload_leave(stripe);
+  }
+  else
+    ptr = s_preload_boot_alloc(align, len);
+
+  if (ptr == NULL)
+    errno = ENOMEM;
+
+  return ptr;
+}
+
+/**
+ * s_preload_usable_size() - Get the usable size of an allocation.
+ *
+ * @ptr: A pointer returned by this allocator.
+ *
+ * Return: The number of bytes that can be written at ptr.
+ */
+static size_t s_preload_usable_size(void *ptr)
+{
+  if (s_preload_is_boot(ptr))
+    return s_preload_boot_len(ptr);
+
+  if (__atomic_load_n(&g_state, __ATOMIC_ACQUIRE) != S_PRELOAD_READY ||
+      !s_heap_contains(&g_heap, ptr))
+    s_preload_foreign(ptr, "malloc_usable_size");
+
+  return s_usable_size(ptr, &g_heap);
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+S_PRELOAD_EXPORT void *malloc(size_t size)
+{
+  s_preload_stripe_t *stripe;
+  void *ptr;
+
+  if (s_preload_ready())
+  {
+    stripe = s_preload_enter();
+    ptr = s_alloc(size, &g_heap);
+    s_preload_leave(stripe);
+  }
+  else
+    ptr = s_preload_boot_alloc(S_PRELOAD_BOOT_ALIGN, size);
+
+  if (ptr == NULL)
+    errno = ENOMEM;
+
+  return ptr;
+}
+
+S_PRELOAD_EXPORT void free(void *ptr)
+{
+  s_preload_stripe_t *stripe;
+
+  if (ptr == NULL || s_preload_is_boot(ptr))
+    return;
+
+  if (__atomic_load_n(&g_state, __ATOMIC_ACQUIRE) != S_PRELOAD_READY ||
+      !s_heap_contains(&g_heap, ptr))
+    s_preload_foreign(ptr, "free");
+
+  stripe = s_preload_enter();
+  s_free(ptr, &g_heap);
+  s_preload_leave(stripe);
+}
+
+/* C23 sized deallocation. The chunk header already holds the size, so this
+ * is free() with the size checked against the header in debug builds only.
+ */
+
+S_PRELOAD_EXPORT void free_sized(void *ptr, size_t size)
+{
+  s_preload_stripe_t *stripe;
+
+  if (ptr == NULL || s_preload_is_boot(ptr))
+    return;
+
+  if (__atomic_load_n(&g_state, __ATOMIC_ACQUIRE) != S_PRELOAD_READY ||
+      !s_heap_contains(&g_heap, ptr))
+    s_preload_foreign(ptr, "free_sized");
+
+  stripe = s_preload_enter();
+  s_free_sized(ptr, size, &g_heap);
+  s_preload_leave(stripe);
+}
+
+S_PRELOAD_EXPORT void free_aligned_sized(void *ptr, size_t align, size_t size)
+{
+  (void)align;
+  free_sized(ptr, size);
+}
+
+S_PRELOAD_EXPORT void *calloc(size_t nmemb, size_t size)
+{
+  s_preload_stripe_t *stripe;
+  size_t len;
+  void *ptr;
+
+  if (__builtin_mul_overflow(nmemb, size, &len))
+  {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  /* The bootstrap buffer is static storage and never reused */
+
+  if (s_preload_ready())
+  {
+    stripe = s_preload_enter();
+    ptr = s_calloc(nmemb, size, &g_heap);
+    s_preload_leave(stripe);
+  }
+  else
+    ptr = s_preload_boot_alloc(S_PRELOAD_BOOT_ALIGN, len);
+
+  if (ptr == NULL)
+    errno = ENOMEM;
+
+  return ptr;
+}
+
+S_PRELOAD_EXPORT void *realloc(void *ptr, size_t size)
+{
+  s_preload_stripe_t *stripe;
+  void *new_ptr;
+  size_t old_len;
+
+  if (ptr == NULL)
+    return malloc(size);
+
+  if (s_preload_is_boot(ptr))
+  {
+    if (size == 0)
+      return NULL;
+
+    new_ptr = malloc(size);
+    if (new_ptr == NULL)
+      return NULL;
+
+    old_len = s_preload_boot_len(ptr);
+    memcpy(new_ptr, ptr, old_len < size ? old_len : size);
+    return new_ptr;
+  }
+
+  if (__atomic_load_n(&g_state, __ATOMIC_ACQUIRE) != S_PRELOAD_READY ||
+      !s_heap_contains(&g_heap, ptr))
+    s_preload_foreign(ptr, "realloc");
+
+  stripe = s_preload_enter();
+  new_ptr = s_realloc(ptr, size, &g_heap);
+  s_preload_leave(stripe);
+  if (new_ptr == NULL && size != 0)
+    errno = ENOMEM;
+
+  return new_ptr;
+}
+
+S_PRELOAD_EXPORT void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+  size_t len;
+
+  if (__builtin_mul_overflow(nmemb, size, &len))
+  {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  return realloc(ptr, len);
+}
+
+S_PRELOAD_EXPORT int posix_memalign(void **memptr, size_t alignment,
+                                    size_t size)
+{
+  void *ptr;
+
+  if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+    return EINVAL;
+
+  ptr = s_preload_memalign(alignment, size);
+  if (ptr == NULL)
+    return ENOMEM;
+
+  *memptr = ptr;
+  return 0;
+}
+
+S_PRELOAD_EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return s_preload_memalign(alignment, size);
+}
+
+S_PRELOAD_EXPORT void *memalign(size_t alignment, size_t size)
+{
+  size_t align = S_PRELOAD_BOOT_ALIGN;
+
+  /* Like the C library, round the alignment up to a power of two */
+
+  while (align < alignment && align != 0)
+    align <<= 1;
+
+  if (align == 0)
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return s_preload_memalign(align, size);
+}
+
+S_PRELOAD_EXPORT void *valloc(size_t size)
+{
+  return s_preload_memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+S_PRELOAD_EXPORT void *pvalloc(size_t size)
+{
+  size_t page_size = sysconf(_SC_PAGESIZE);
+
+  if (size > SIZE_MAX - page_size)
+  {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  return s_preload_memalign(page_size,
+                            (size + page_size - 1) & ~(page_size - 1));
+}
+
+S_PRELOAD_EXPORT size_t malloc_usable_size(void *ptr)
+{
+  return ptr != NULL ? s_preload_usable_size(ptr) : 0;
+}
@@ -0,0 +1,219 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "s_router.h"
+
+/**
+ * s_router_bucket() - Find the bucket that serves a size.
+ *
+ * @router: The router context.
+ * @len: The requested memory size.
+ *
+ * The bounds are sorted so the bucket index is the number of bounds that
+ * are smaller than len. The loop has a fixed trip count and no data
+ * dependent branches, the compiler unrolls it into compares and adds.
+ *
+ * Return: The bucket index.
+ */
+static inline uint32_t s_router_bucket(const s_router_t *router, size_t len)
+{
+  uint32_t idx = 0;
+
+  for (int i = 0; i < S_ROUTER_MAX_BUCKETS; i++)
+    idx += len > router->max_len[i];
+
+  return idx;
+}
+
+/**
+ * s_router_owner() - Find the bucket that owns a chunk.
+ *
+ * @router: The router context.
+ * @ptr: The chunk payload.
+ *
+ * The primary regions are checked first, the segments a heap added when it
+ * grew are only searched on a miss.
+ *
+ * Return: The bucket index or num_buckets if no bucket owns ptr.
+ */
+static inline uint32_t s_router_owner(const s_router_t *router, void *ptr)
+{
+  uint32_t i;
+
+  for (i = 0; i < router->num_buckets; i++)
+  {
+    if ((uintptr_t)ptr - router->mem_start[i] < router->mem_len[i])
+      return i;
+  }
+
+  for (i = 0; i < router->num_buckets; i++)
+  {
+    if (s_heap_contains(router->heaps[i], ptr))
+      break;
+  }
+
+  return i;
+}
+
+/**
+ * s_router_init() - Route allocations to several heaps by size.
+ *
+ * @router: The router context.
+ * @heaps: num_buckets initialized heaps with disjoint memory regions.
+ * @max_len: The largest request served by every bucket except the last one.
+ * @num_buckets: The number of buckets.
+ *
+ * Return: 0 on success, -1 if the configuration is invalid.
+ */
+int s_router_init(s_router_t *router, heap_t **heaps, const size_t *max_len,
+                  uint32_t num_buckets)
+{
+  if (router == NULL || heaps == NULL || num_buckets == 0 ||
+      num_buckets > S_ROUTER_MAX_BUCKETS ||
+      (num_buckets > 1 && max_len == NULL))
+  {
+    assert(false);
+    return -1;
+  }
+
+  memset(router, 0, sizeof(s_router_t));
+  router->num_buckets = num_buckets;
+
+  for (uint32_t i = 0; i < S_ROUTER_MAX_BUCKETS; i++)
+  {
+    if (i + 1 < num_buckets)
+    {
+      if (i > 0 && max_len[i] <= max_len[i - 1])
+      {
+        assert(false);
+        return -1;
+      }
+
+      router->max_len[i] = max_len[i];
+    }
+    else
+      router->max_len[i] = SIZE_MAX;
+  }
+
+  for (uint32_t i = 0; i < num_buckets; i++)
+  {
+    assert(heaps[i] != NULL);
+
+    router->heaps[i] = heaps[i];
+    router->mem_start[i] = (uintptr_t)heaps[i]->heap_mem_start;
+    router->mem_len[i] = (uintptr_t)heaps[i]->heap_memory_end -
+      router->mem_start[i];
+  }
+
+  return 0;
+}
+
+/**
+ * s_router_alloc() - Allocate a memory chunk from the bucket of its size.
+ *
+ * @len: The requested memory size.
+ * @router: The router context.
+ *
+ * Return: A void pointer on success otherwise NULL.
+ */
+void *s_router_alloc(size_t len, s_router_t *router)
+{
+  void *ptr = NULL;
+
+  for (uint32_t i = s_router_bucket(router, len);
+       i < router->num_buckets && ptr == NULL; i++)
+    ptr = s_alloc(len, router->heaps[i]);
+
+  return ptr;
+}
+
+/**
+ * s_router_free() - Release a chunk to the bucket that owns it.
+ *
+ * @ptr: A chunk allocated through the router or NULL.
+ * @router: The router context.
+ *
+ * Return: None.
+ */
+void s_router_free(void *ptr, s_router_t *router)
+{
+  uint32_t owner;
+
+  if (ptr == NULL)
+    return;
+
+  owner = s_router_owner(router, ptr);
+  assert(owner < router->num_buckets);
+
+  s_free(ptr, router->heaps[owner]);
+}
+
+/**
+ * s_router_realloc() - Re-allocate a chunk.
+ *
+ * @ptr: Previously allocated buffer or NULL.
+ * @size: The new size or 0 to free ptr.
+ * @router: The router context.
+ *
+ * Return: The resized buffer or NULL, in which case ptr is left untouched.
+ */
+void *s_router_realloc(void *ptr, size_t size, s_router_t *router)
+{
+  uint32_t owner;
+  heap_t *heap;
+  void *new_ptr;
+  size_t old_len;
+
+  if (ptr == NULL)
+    return s_router_alloc(size, router);
+
+  if (size == 0)
+  {
+    s_router_free(ptr, router);
+    return NULL;
+  }
+
+  owner = s_router_owner(router, ptr);
+  assert(owner < router->num_buckets);
+  heap = router->heaps[owner];
+
+  /* Overflowed chunks stay where they are, only growing past the owner
+   * range moves the chunk to a larger bucket.
+   */
+
+  if (s_router_bucket(router, size) <= owner)
+  {
+    new_ptr = s_realloc(ptr, size, heap);
+    if (new_ptr != NULL)
+      return new_ptr;
+  }
+
+  new_ptr = s_router_alloc(size, router);
+  if (new_ptr == NULL)
+    return NULL;
+
+  old_len = s_usable_size(ptr, heap);
+  memcpy(new_ptr, ptr, old_len < size ? old_len : size);
+  s_free(ptr, heap);
+
+  return new_ptr;
+}
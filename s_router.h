@@ -0,0 +1,115 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __S_ROUTER_H
+#define __S_ROUTER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "s_heap.h"
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define S_ROUTER_MAX_BUCKETS  (8)
+
+/****************************************************************************
+ * Public types
+ ****************************************************************************/
+
+/* A set of heap buckets that serve different size ranges. Bucket i serves
+ * the requests that are larger than max_len[i - 1] and up to max_len[i],
+ * the last bucket has no upper bound.
+ */
+
+typedef struct {
+  uint32_t num_buckets;
+  heap_t *heaps[S_ROUTER_MAX_BUCKETS];
+
+  /* Upper size bound of every bucket, the unused ones are SIZE_MAX so that
+   * a lookup never goes past the last bucket.
+   */
+
+  size_t max_len[S_ROUTER_MAX_BUCKETS];
+
+  /* Memory range of every bucket used to find the owner of a chunk */
+
+  uintptr_t mem_start[S_ROUTER_MAX_BUCKETS];
+  uintptr_t mem_len[S_ROUTER_MAX_BUCKETS];
+} s_router_t;
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/**
+ * s_router_init() - Route allocations to several heaps by size.
+ *
+ * @router: The router context.
+ * @heaps: num_buckets initialized heaps with disjoint memory regions.
+ * @max_len: The largest request served by every bucket except the last
+ *           one, in ascending order.
+ * @num_buckets: The number of buckets, up to S_ROUTER_MAX_BUCKETS.
+ *
+ * The heaps must only be used through the router from now on.
+ *
+ * Return: 0 on success, -1 if the configuration is invalid.
+ */
+int s_router_init(s_router_t *router, heap_t **heaps, const size_t *max_len,
+                  uint32_t num_buckets);
+
+/**
+ * s_router_alloc() - Allocate a memory chunk from the bucket of its size.
+ *
+ * @len: The requested memory size.
+ * @router: The router context.
+ *
+ * When the bucket is exhausted the request overflows to the next larger
+ * bucket.
+ *
+ * Return: A void pointer on success otherwise NULL.
+ */
+void *s_router_alloc(size_t len, s_router_t *router);
+
+/**
+ * s_router_free() - Release a chunk to the bucket that owns it.
+ *
+ * @ptr: A chunk allocated through the router or NULL.
+ * @router: The router context.
+ *
+ * Return: None.
+ */
+void s_router_free(void *ptr, s_router_t *router);
+
+/**
+ * s_router_realloc() - Re-allocate a chunk.
+ *
+ * @ptr: Previously allocated buffer or NULL.
+ * @size: The new size or 0 to free ptr.
+ * @router: The router context.
+ *
+ * The chunk is resized inside its bucket as long as the new size does not
+ * belong to a larger bucket, otherwise it is moved.
+ *
+ * Return: The resized buffer or NULL, in which case ptr is left untouched.
+ */
+void *s_router_realloc(void *ptr, size_t size, s_router_t *router);
+
+#endif /* __S_ROUTER_H */
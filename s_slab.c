@@ -0,0 +1,506 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "s_slab.h"
+
+/**
+ * s_slab_class_index() - Get the size class of a small object.
+ *
+ * @len: The requested size, between 1 and S_SLAB_MAX_SIZE.
+ *
+ * Return: The index of the class whose slots can hold len bytes.
+ */
+static inline unsigned int s_slab_class_index(size_t len)
+{
+  return (len - 1) / S_SLAB_QUANTUM;
+}
+
+/**
+ * s_slab_run_end() - Get the address right after the last slot of a run.
+ *
+ * @slab: The slab context.
+ * @run: The run.
+ */
+static inline uint8_t *s_slab_run_end(s_slab_t *slab, s_slab_run_t *run)
+{
+  return run->slots + run->num_slots * slab->classes[run->class_idx].slot_size;
+}
+
+/**
+ * s_slab_lookup() - Find the run that owns an object.
+ *
+ * @slab: The slab context.
+ * @ptr: The object.
+ *
+ * A run is S_SLAB_RUN_SIZE long so the object lives either in the run that
+ * starts in its own window or in the one that starts in the window before.
+ *
+ * Return: The owning run or NULL if the object was not served by a run.
+ */
+static s_slab_run_t *s_slab_lookup(s_slab_t *slab, void *ptr)
+{
+  uintptr_t addr = (uintptr_t)ptr;
+  s_slab_run_t *run;
+  size_t window;
+
+  if (addr < slab->run_map_base)
+    return NULL;
+
+  window = (addr - slab->run_map_base) >> S_SLAB_RUN_SHIFT;
+  if (window >= slab->run_map_len)
+    return NULL;
+
+  run = slab->run_map[window];
+  if (run != NULL && (uint8_t *)ptr >= run->slots &&
+      (uint8_t *)ptr < s_slab_run_end(slab, run))
+    return run;
+
+  if (window == 0)
+    return NULL;
+
+  run = slab->run_map[window - 1];
+  if (run != NULL && (uint8_t *)ptr >= run->slots &&
+      (uint8_t *)ptr < s_slab_run_end(slab, run))
+    return run;
+
+  return NULL;
+}
+
+/**
+ * s_slab_window() - Get the run map window of an address.
+ *
+ * @slab: The slab context.
+ * @addr: The address.
+ * @window: Output window index.
+ *
+ * Return: true if the run map covers addr.
+ */
+static inline bool s_slab_window(s_slab_t *slab, uintptr_t addr,
+                                 size_t *window)
+{
+  *window = (addr - slab->run_map_base) >> S_SLAB_RUN_SHIFT;
+
+  return addr >= slab->run_map_base && *window < slab->run_map_len;
+}
+
+/**
+ * s_slab_block_node() - Get the list node of a huge page block.
+ *
+ * @block: The block, which is also its first run.
+ *
+ * The node follows the header of the first run.
+ *
+ * Return: The node in the blocks list of the slab.
+ */
+static inline struct list_head *s_slab_block_node(uint8_t *block)
+{
+  return (struct list_head *)(block + S_SLAB_RUN_HDR_SIZE);
+}
+
+/**
+ * s_slab_run_slots() - Get the offset of the first slot of a run.
+ *
+ * @run: The run.
+ *
+ * Return: The size of the run header, and of the block list node for the
+ * first run of a block.
+ */
+static inline size_t s_slab_run_slots(s_slab_run_t *run)
+{
+  if (run->in_block && ((uintptr_t)run & (S_SLAB_BLOCK_SIZE - 1)) == 0)
+    return S_SLAB_RUN_HDR_SIZE + sizeof(struct list_head);
+
+  return S_SLAB_RUN_HDR_SIZE;
+}
+
+/**
+ * s_slab_run_get() - Get the memory for a new run.
+ *
+ * @slab: The slab context.
+ *
+ * Runs that were given back are reused first. On a heap mapped with huge
+ * pages new runs are cut from a huge page block, a plain chunk is only
+ * used when no block can be allocated.
+ *
+ * Return: The run memory or NULL if the heap is exhausted.
+ */
+static s_slab_run_t *s_slab_run_get(s_slab_t *slab)
+{
+  s_slab_run_t *run;
+  uint8_t *block;
+  size_t window;
+
+  if (!list_empty(&slab->free_runs))
+  {
+    run = list_entry(slab->free_runs.next, s_slab_run_t, run_list);
+    list_del(&run->run_list);
+    return run;
+  }
+
+  if (slab->heap->huge_pages && slab->block_next == slab->block_end)
+  {
+    block = s_aligned_alloc(S_SLAB_BLOCK_SIZE, S_SLAB_BLOCK_SIZE, slab->heap);
+    if (block != NULL &&
+        s_slab_window(slab, (uintptr_t)block + S_SLAB_BLOCK_SIZE - 1,
+                      &window))
+    {
+      list_add(s_slab_block_node(block), &slab->blocks);
+      slab->block_next = block;
+      slab->block_end = block + S_SLAB_BLOCK_SIZE;
+    }
+    else
+      s_free(block, slab->heap);
+  }
+
+  if (slab->block_next != slab->block_end)
+  {
+    run = (s_slab_run_t *)slab->block_next;
+    slab->block_next += S_SLAB_RUN_SIZE;
+    run->in_block = 1;
+    return run;
+  }
+
+  run = s_alloc(S_SLAB_RUN_SIZE, slab->heap);
+  if (run != NULL)
+    run->in_block = 0;
+
+  return run;
+}
+
+/**
+ * s_slab_run_create() - Carve a new run from the heap for a size class.
+ *
+ * @slab: The slab context.
+ * @class_idx: The size class.
+ *
+ * Return: The new run or NULL if the heap is exhausted or the run landed in
+ * a segment the run map does not cover.
+ */
+static s_slab_run_t *s_slab_run_create(s_slab_t *slab, unsigned int class_idx)
+{
+  s_slab_class_t *class = &slab->classes[class_idx];
+  s_slab_run_t *run = s_slab_run_get(slab);
+  size_t header_size;
+  size_t window;
+
+  if (run == NULL)
+    return NULL;
+
+  if (!s_slab_window(slab, (uintptr_t)run, &window))
+  {
+    s_free(run, slab->heap);
+    return NULL;
+  }
+
+  header_size = s_slab_run_slots(run);
+  run->slots = (uint8_t *)run + header_size;
+  run->class_idx = class_idx;
+  run->num_slots = (S_SLAB_RUN_SIZE - header_size) / class->slot_size;
+  run->num_free = run->num_slots;
+
+  memset(run->free_map, 0, sizeof(run->free_map));
+  for (int i = 0; i < run->num_slots; i++)
+    run->free_map[i / 64] |= 1ULL << (i % 64);
+
+  assert(slab->run_map[window] == NULL);
+  slab->run_map[window] = run;
+
+  list_add(&run->run_list, &class->partial_runs);
+  class->num_runs++;
+  class->num_slots += run->num_slots;
+
+  return run;
+}
+
+/**
+ * s_slab_run_destroy() - Give an empty run back to the heap.
+ *
+ * @slab: The slab context.
+ * @run: The run.
+ *
+ * A run cut from a huge page block is kept for the next run instead.
+ */
+static void s_slab_run_destroy(s_slab_t *slab, s_slab_run_t *run)
+{
+  s_slab_class_t *class = &slab->classes[run->class_idx];
+  size_t window = ((uintptr_t)run - slab->run_map_base) >> S_SLAB_RUN_SHIFT;
+
+  slab->run_map[window] = NULL;
+
+  list_del(&run->run_list);
+  class->num_runs--;
+  class->num_slots -= run->num_slots;
+
+  if (run->in_block)
+    list_add(&run->run_list, &slab->free_runs);
+  else
+    s_free(run, slab->heap);
+}
+
+/**
+ * s_slab_init() - Initialize a slab front-end on top of a heap.
+ *
+ * @slab: The slab context.
+ * @my_heap: An initialized heap that provides the runs.
+ *
+ * Return: 0 on success, -1 if the run map could not be allocated.
+ */
+int s_slab_init(s_slab_t *slab, heap_t *my_heap)
+{
+  size_t heap_size;
+
+  if (slab == NULL || my_heap == NULL)
+  {
+    assert(false);
+    return -1;
+  }
+
+  slab->heap = my_heap;
+  INIT_LIST_HEAD(&slab->blocks);
+  INIT_LIST_HEAD(&slab->free_runs);
+  slab->block_next = NULL;
+  slab->block_end = NULL;
+
+  for (int i = 0; i < S_SLAB_NUM_CLASSES; i++)
+  {
+    INIT_LIST_HEAD(&slab->classes[i].partial_runs);
+    INIT_LIST_HEAD(&slab->classes[i].full_runs);
+    slab->classes[i].slot_size = (i + 1) * S_SLAB_QUANTUM;
+    slab->classes[i].num_runs = 0;
+    slab->classes[i].num_slots = 0;
+    slab->classes[i].used_slots = 0;
+  }
+
+  /* The run map covers the region the heap was initialized with, the
+   * segments added when it grows are served by s_alloc.
+   */
+
+  heap_size = (uintptr_t)my_heap->heap_memory_end -
+    (uintptr_t)my_heap->heap_mem_start;
+  slab->run_map_base = (uintptr_t)my_heap->heap_mem_start;
+  slab->run_map_len = (heap_size >> S_SLAB_RUN_SHIFT) + 1;
+  slab->run_map = s_calloc(slab->run_map_len, sizeof(s_slab_run_t *),
+                           my_heap);
+  if (slab->run_map == NULL)
+    return -1;
+
+  return 0;
+}
+
+/**
+ * s_slab_alloc() - Allocate an object.
+ *
+ * @len: The requested memory size.
+ * @slab: The slab context.
+ *
+ * Sizes up to S_SLAB_MAX_SIZE are served from a run slot without a chunk
+ * header, larger ones are forwarded to s_alloc.
+ *
+ * Return: A void pointer on success otherwise NULL.
+ */
+void *s_slab_alloc(size_t len, s_slab_t *slab)
+{
+  s_slab_class_t *class;
+  s_slab_run_t *run;
+  unsigned int word, slot;
+
+  if (len > S_SLAB_MAX_SIZE)
+    return s_alloc(len, slab->heap);
+
+  class = &slab->classes[s_slab_class_index(len ? len : 1)];
+
+  if (list_empty(&class->partial_runs))
+  {
+    run = s_slab_run_create(slab, class - slab->classes);
+    if (run == NULL)
+      return s_alloc(len, slab->heap);
+  }
+  else
+  {
+    run = list_entry(class->partial_runs.next, s_slab_run_t, run_list);
+  }
+
+  /* Take the first free slot from the bitmap */
+
+  for (word = 0; word < S_SLAB_BITMAP_WORDS; word++)
+  {
+    if (run->free_map[word] != 0)
+      break;
+  }
+
+  assert(word < S_SLAB_BITMAP_WORDS);
+  slot = __builtin_ctzll(run->free_map[word]);
+  run->free_map[word] &= ~(1ULL << slot);
+  slot += word * 64;
+
+  run->num_free--;
+  class->used_slots++;
+
+  if (run->num_free == 0)
+  {
+    list_del(&run->run_list);
+    list_add(&run->run_list, &class->full_runs);
+  }
+
+  return run->slots + slot * class->slot_size;
+}
+
+/**
+ * s_slab_free() - Release an object allocated with s_slab_alloc.
+ *
+ * @ptr: The object or NULL.
+ * @slab: The slab context.
+ *
+ * Return: None.
+ */
+void s_slab_free(void *ptr, s_slab_t *slab)
+{
+  s_slab_class_t *class;
+  s_slab_run_t *run;
+  size_t offset, slot;
+
+  if (ptr == NULL)
+    return;
+
+  run = s_slab_lookup(slab, ptr);
+  if (run == NULL)
+  {
+    s_free(ptr, slab->heap);
+    return;
+  }
+
+  class = &slab->classes[run->class_idx];
+  offset = (uint8_t *)ptr - run->slots;
+  slot = offset / class->slot_size;
+
+  /* The pointer must be the start of a slot that is in use. Did we
+   * encounter a double free memory corruption ?
+   */
+
+  assert(offset % class->slot_size == 0);
+  assert((run->free_map[slot / 64] & (1ULL << (slot % 64))) == 0);
+
+  run->free_map[slot / 64] |= 1ULL << (slot % 64);
+  class->used_slots--;
+
+  if (run->num_free++ == 0)
+  {
+    list_del(&run->run_list);
+    list_add(&run->run_list, &class->partial_runs);
+  }
+
+  /* Keep one empty run per class to avoid thrashing the heap */
+
+  if (run->num_free == run->num_slots &&
+      class->partial_runs.next != class->partial_runs.prev)
+    s_slab_run_destroy(slab, run);
+}
+
+/**
+ * s_slab_free_sized() - Release an object of a known size.
+ *
+ * @ptr: The object or NULL.
+ * @size: The size requested from s_slab_alloc.
+ * @slab: The slab context.
+ *
+ * Objects larger than S_SLAB_MAX_SIZE never live in a run, so they go
+ * straight to s_free_sized() without probing the run map.
+ *
+ * Return: None.
+ */
+void s_slab_free_sized(void *ptr, size_t size, s_slab_t *slab)
+{
+  if (size > S_SLAB_MAX_SIZE)
+  {
+    s_free_sized(ptr, size, slab->heap);
+    return;
+  }
+
+  s_slab_free(ptr, slab);
+}
+
+/**
+ * s_slab_stats() - Report the slab utilization.
+ *
+ * @slab: The slab context.
+ * @stats: Output structure filled with the per class counters.
+ *
+ * Return: None.
+ */
+void s_slab_stats(s_slab_t *slab, s_slab_stats_t *stats)
+{
+  memset(stats, 0, sizeof(*stats));
+
+  for (int i = 0; i < S_SLAB_NUM_CLASSES; i++)
+  {
+    s_slab_class_t *class = &slab->classes[i];
+
+    stats->classes[i].slot_size = class->slot_size;
+    stats->classes[i].num_runs = class->num_runs;
+    stats->classes[i].num_slots = class->num_slots;
+    stats->classes[i].used_slots = class->used_slots;
+
+    stats->num_runs += class->num_runs;
+    stats->used_bytes += class->used_slots * class->slot_size;
+  }
+
+  stats->run_bytes = stats->num_runs * S_SLAB_RUN_SIZE;
+}
+
+/**
+ * s_slab_destroy() - Release all the runs and the run map to the heap.
+ *
+ * @slab: The slab context.
+ *
+ * Return: None.
+ */
+void s_slab_destroy(s_slab_t *slab)
+{
+  s_slab_run_t *run, *tmp;
+  struct list_head *block, *next_block;
+
+  for (int i = 0; i < S_SLAB_NUM_CLASSES; i++)
+  {
+    s_slab_class_t *class = &slab->classes[i];
+
+    list_for_each_entry_safe (run, tmp, &class->partial_runs, run_list)
+      s_slab_run_destroy(slab, run);
+
+    list_for_each_entry_safe (run, tmp, &class->full_runs, run_list)
+      s_slab_run_destroy(slab, run);
+
+    class->used_slots = 0;
+  }
+
+  list_for_each_safe (block, next_block, &slab->blocks)
+    s_free((uint8_t *)block - S_SLAB_RUN_HDR_SIZE, slab->heap);
+
+  INIT_LIST_HEAD(&slab->blocks);
+  INIT_LIST_HEAD(&slab->free_runs);
+  slab->block_next = NULL;
+  slab->block_end = NULL;
+
+  s_free(slab->run_map, slab->heap);
+  slab->run_map = NULL;
+  slab->run_map_len = 0;
+}
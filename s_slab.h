@@ -0,0 +1,197 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __S_SLAB_H
+#define __S_SLAB_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "s_heap.h"
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+/* Small objects are rounded up to a multiple of S_SLAB_QUANTUM and served
+ * from runs of S_SLAB_RUN_SIZE bytes carved out of the backing heap.
+ * Anything larger than S_SLAB_MAX_SIZE goes straight to s_alloc.
+ */
+
+#define S_SLAB_QUANTUM      (16)
+#define S_SLAB_MAX_SIZE     (128)
+#define S_SLAB_NUM_CLASSES  (S_SLAB_MAX_SIZE / S_SLAB_QUANTUM)
+#define S_SLAB_RUN_SHIFT    (12)
+#define S_SLAB_RUN_SIZE     (1 << S_SLAB_RUN_SHIFT)
+#define S_SLAB_MAX_SLOTS    (S_SLAB_RUN_SIZE / S_SLAB_QUANTUM)
+#define S_SLAB_BITMAP_WORDS (S_SLAB_MAX_SLOTS / 64)
+
+/* On a heap mapped with huge pages the runs are cut from blocks of
+ * S_SLAB_BLOCK_SIZE aligned to their size, so the small objects share a few
+ * TLB entries instead of being spread over the whole heap. The block list
+ * node follows the header of the first run of every block, that run has
+ * its slots after it.
+ */
+
+#define S_SLAB_BLOCK_SIZE   (S_HEAP_HUGE_PAGE_SIZE)
+
+/* Size of a run header, the slots are aligned to the quantum */
+
+#define S_SLAB_RUN_HDR_SIZE \
+  ((sizeof(s_slab_run_t) + S_SLAB_QUANTUM - 1) & ~(size_t)(S_SLAB_QUANTUM - 1))
+
+/****************************************************************************
+ * Public types
+ ****************************************************************************/
+
+/* A run of equally sized object slots. The header is placed at the start
+ * of the run and the slots follow it.
+ */
+
+typedef struct s_slab_run_s
+{
+  struct list_head run_list;  /* Node in the partial/full list of a class */
+  uint8_t *slots;             /* Address of the first slot */
+  uint16_t class_idx;         /* Index of the owning size class */
+  uint16_t num_slots;         /* Number of slots in this run */
+  uint16_t num_free;          /* Number of free slots in this run */
+  uint16_t in_block;          /* Cut from a block instead of s_alloc */
+  uint64_t free_map[S_SLAB_BITMAP_WORDS]; /* Bit N set when slot N is free */
+} s_slab_run_t;
+
+/* All the runs that serve one object size */
+
+typedef struct {
+  struct list_head partial_runs; /* Runs with at least one free slot */
+  struct list_head full_runs;    /* Runs without free slots */
+  size_t slot_size;
+  size_t num_runs;
+  size_t num_slots;
+  size_t used_slots;
+} s_slab_class_t;
+
+/* The slab front-end context */
+
+typedef struct {
+  heap_t *heap;
+  s_slab_class_t classes[S_SLAB_NUM_CLASSES];
+
+  /* Entry N holds the run that starts in the N-th S_SLAB_RUN_SIZE window
+   * of the heap. At most one run can start in a window.
+   */
+
+  s_slab_run_t **run_map;
+  size_t run_map_len;
+  uintptr_t run_map_base;
+
+  /* Huge page blocks, the runs cut from them are reused before a new
+   * block is allocated.
+   */
+
+  struct list_head blocks;
+  struct list_head free_runs;
+  uint8_t *block_next;
+  uint8_t *block_end;
+} s_slab_t;
+
+/* Per class utilization report */
+
+typedef struct {
+  size_t slot_size;
+  size_t num_runs;
+  size_t num_slots;
+  size_t used_slots;
+} s_slab_class_stats_t;
+
+typedef struct {
+  s_slab_class_stats_t classes[S_SLAB_NUM_CLASSES];
+  size_t num_runs;    /* Runs owned by the slab layer */
+  size_t run_bytes;   /* Heap memory held by these runs */
+  size_t used_bytes;  /* Bytes handed out in slots */
+} s_slab_stats_t;
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/**
+ * s_slab_init() - Initialize a slab front-end on top of a heap.
+ *
+ * @slab: The slab context.
+ * @my_heap: An initialized heap that provides the runs.
+ *
+ * Return: 0 on success, -1 if the run map could not be allocated.
+ */
+int s_slab_init(s_slab_t *slab, heap_t *my_heap);
+
+/**
+ * s_slab_alloc() - Allocate an object.
+ *
+ * @len: The requested memory size.
+ * @slab: The slab context.
+ *
+ * Sizes up to S_SLAB_MAX_SIZE are served from a run slot without a chunk
+ * header, larger ones are forwarded to s_alloc.
+ *
+ * Return: A void pointer on success otherwise NULL.
+ */
+void *s_slab_alloc(size_t len, s_slab_t *slab);
+
+/**
+ * s_slab_free() - Release an object allocated with s_slab_alloc.
+ *
+ * @ptr: The object or NULL.
+ * @slab: The slab context.
+ *
+ * Return: None.
+ */
+void s_slab_free(void *ptr, s_slab_t *slab);
+
+/**
+ * s_slab_free_sized() - Release an object of a known size.
+ *
+ * @ptr: The object or NULL.
+ * @size: The size requested from s_slab_alloc.
+ * @slab: The slab context.
+ *
+ * Return: None.
+ */
+void s_slab_free_sized(void *ptr, size_t size, s_slab_t *slab);
+
+/**
+ * s_slab_stats() - Report the slab utilization.
+ *
+ * @slab: The slab context.
+ * @stats: Output structure filled with the per class counters.
+ *
+ * Return: None.
+ */
+void s_slab_stats(s_slab_t *slab, s_slab_stats_t *stats);
+
+/**
+ * s_slab_destroy() - Release all the runs and the run map to the heap.
+ *
+ * @slab: The slab context.
+ *
+ * Objects that are still allocated from the runs become invalid.
+ *
+ * Return: None.
+ */
+void s_slab_destroy(s_slab_t *slab);
+
+#endif /* __S_SLAB_H */
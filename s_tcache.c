@@ -0,0 +1,297 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "s_tcache.h"
+
+/**
+ * s_tcache_chunk_class() - Get the size class of an allocated chunk.
+ *
+ * @tc_heap: The shared heap context.
+ * @ptr: The chunk payload.
+ *
+ * The header is read without the heap lock while another thread may be
+ * setting the prev_free bit of the same word by releasing the previous
+ * chunk, so it is read as a whole.
+ *
+ * Return: The class index, S_TCACHE_NUM_CLASSES or more if it is not cached.
+ */
+static inline size_t s_tcache_chunk_class(s_tcache_heap_t *tc_heap, void *ptr)
+{
+  mem_node_t *node = s_heap_node(ptr);
+
+  assert(node->magic == S_HEAP_MAGIC_USED);
+  return s_heap_mask(node).size - tc_heap->heap->min_blocks;
+}
+
+/**
+ * s_tcache_mag_flush() - Return chunks from a magazine to the heap.
+ *
+ * @tc_heap: The shared heap context.
+ * @mag: The magazine.
+ * @count: How many chunks to return.
+ */
+static void s_tcache_mag_flush(s_tcache_heap_t *tc_heap, s_tcache_mag_t *mag,
+                               uint32_t count)
+{
+  assert(count <= mag->count);
+
+  pthread_mutex_lock(&tc_heap->lock);
+  while (count-- > 0)
+    s_free(mag->chunks[--mag->count], tc_heap->heap);
+  pthread_mutex_unlock(&tc_heap->lock);
+}
+
+/**
+ * s_tcache_destructor() - Flush the cache of an exiting thread.
+ *
+ * @arg: The thread cache.
+ */
+static void s_tcache_destructor(void *arg)
+{
+  s_tcache_t *cache = arg;
+  s_tcache_heap_t *tc_heap = cache->tc_heap;
+
+  for (int i = 0; i < S_TCACHE_NUM_CLASSES; i++)
+    s_tcache_mag_flush(tc_heap, &cache->mags[i], cache->mags[i].count);
+
+  pthread_mutex_lock(&tc_heap->lock);
+  s_free(cache, tc_heap->heap);
+  pthread_mutex_unlock(&tc_heap->lock);
+}
+
+/**
+ * s_tcache_get() - Get the cache of the calling thread.
+ *
+ * @tc_heap: The shared heap context.
+ *
+ * The cache is allocated from the shared heap on first use.
+ *
+ * Return: The thread cache or NULL if it could not be allocated.
+ */
+static s_tcache_t *s_tcache_get(s_tcache_heap_t *tc_heap)
+{
+  s_tcache_t *cache = pthread_getspecific(tc_heap->key);
+
+  if (cache != NULL)
+    return cache;
+
+  pthread_mutex_lock(&tc_heap->lock);
+  cache = s_alloc(sizeof(s_tcache_t), tc_heap->heap);
+  pthread_mutex_unlock(&tc_heap->lock);
+
+  if (cache == NULL)
+    return NULL;
+
+  memset(cache, 0, sizeof(s_tcache_t));
+  cache->tc_heap = tc_heap;
+
+  if (pthread_setspecific(tc_heap->key, cache) != 0)
+  {
+    pthread_mutex_lock(&tc_heap->lock);
+    s_free(cache, tc_heap->heap);
+    pthread_mutex_unlock(&tc_heap->lock);
+    return NULL;
+  }
+
+  return cache;
+}
+
+/**
+ * s_tcache_init() - Share a heap between threads through per-thread caches.
+ *
+ * @tc_heap: The shared heap context.
+ * @my_heap: An initialized heap.
+ *
+ * Return: 0 on success, an error number otherwise.
+ */
+int s_tcache_init(s_tcache_heap_t *tc_heap, heap_t *my_heap)
+{
+  int ret;
+
+  if (tc_heap == NULL || my_heap == NULL)
+  {
+    assert(false);
+    return -1;
+  }
+
+  tc_heap->heap = my_heap;
+
+  ret = pthread_mutex_init(&tc_heap->lock, NULL);
+  if (ret != 0)
+    return ret;
+
+  ret = pthread_key_create(&tc_heap->key, s_tcache_destructor);
+  if (ret != 0)
+    pthread_mutex_destroy(&tc_heap->lock);
+
+  return ret;
+}
+
+/**
+ * s_tcache_alloc() - Allocate a memory chunk from the calling thread cache.
+ *
+ * @len: The requested memory size.
+ * @tc_heap: The shared heap context.
+ *
+ * Return: A void pointer on success otherwise NULL.
+ */
+void *s_tcache_alloc(size_t len, s_tcache_heap_t *tc_heap)
+{
+  heap_t *my_heap = tc_heap->heap;
+  size_t blocks = s_heap_len_to_blocks(my_heap, len);
+  size_t class = blocks - my_heap->min_blocks;
+  s_tcache_t *cache;
+  s_tcache_mag_t *mag;
+  void *ptr;
+
+  if (class >= S_TCACHE_NUM_CLASSES ||
+      (cache = s_tcache_get(tc_heap)) == NULL)
+  {
+    pthread_mutex_lock(&tc_heap->lock);
+    ptr = s_alloc(len, tc_heap->heap);
+    pthread_mutex_unlock(&tc_heap->lock);
+    return ptr;
+  }
+
+  mag = &cache->mags[class];
+
+  /* Refill an empty magazine with a batch of chunks */
+
+  if (mag->count == 0)
+  {
+    pthread_mutex_lock(&tc_heap->lock);
+    while (mag->count < S_TCACHE_BATCH)
+    {
+      ptr = s_alloc(blocks * my_heap->block_size - S_HEAP_HDR_SIZE, my_heap);
+      if (ptr == NULL)
+        break;
+
+      mag->chunks[mag->count++] = ptr;
+    }
+    pthread_mutex_unlock(&tc_heap->lock);
+
+    if (mag->count == 0)
+      return NULL;
+  }
+
+  return mag->chunks[--mag->count];
+}
+
+/**
+ * s_tcache_free() - Release a chunk to the calling thread cache.
+ *
+ * @ptr: A chunk allocated by any thread from the same shared heap.
+ * @tc_heap: The shared heap context.
+ *
+ * Return: None.
+ */
+void s_tcache_free(void *ptr, s_tcache_heap_t *tc_heap)
+{
+  s_tcache_t *cache;
+  s_tcache_mag_t *mag;
+  size_t class;
+
+  if (ptr == NULL)
+    return;
+
+  class = s_tcache_chunk_class(tc_heap, ptr);
+
+  if (class >= S_TCACHE_NUM_CLASSES ||
+      (cache = s_tcache_get(tc_heap)) == NULL)
+  {
+    pthread_mutex_lock(&tc_heap->lock);
+    s_free(ptr, tc_heap->heap);
+    pthread_mutex_unlock(&tc_heap->lock);
+    return;
+  }
+
+  mag = &cache->mags[class];
+
+  /* Flush half of a full magazine to make room */
+
+  if (mag->count == S_TCACHE_MAG_SIZE)
+    s_tcache_mag_flush(tc_heap, mag, S_TCACHE_BATCH);
+
+  mag->chunks[mag->count++] = ptr;
+}
+
+/**
+ * s_tcache_realloc() - Re-allocate a chunk from the shared heap.
+ *
+ * @ptr: Previously allocated buffer or NULL.
+ * @size: The new size or 0 to free ptr.
+ * @tc_heap: The shared heap context.
+ *
+ * Return: The resized buffer or NULL.
+ */
+void *s_tcache_realloc(void *ptr, size_t size, s_tcache_heap_t *tc_heap)
+{
+  void *new_ptr;
+
+  if (ptr == NULL)
+    return s_tcache_alloc(size, tc_heap);
+
+  if (size == 0)
+  {
+    s_tcache_free(ptr, tc_heap);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&tc_heap->lock);
+  new_ptr = s_realloc(ptr, size, tc_heap->heap);
+  pthread_mutex_unlock(&tc_heap->lock);
+
+  return new_ptr;
+}
+
+/**
+ * s_tcache_flush() - Give all the chunks cached by the calling thread back.
+ *
+ * @tc_heap: The shared heap context.
+ *
+ * Return: None.
+ */
+void s_tcache_flush(s_tcache_heap_t *tc_heap)
+{
+  s_tcache_t *cache = pthread_getspecific(tc_heap->key);
+
+  if (cache == NULL)
+    return;
+
+  pthread_setspecific(tc_heap->key, NULL);
+  s_tcache_destructor(cache);
+}
+
+/**
+ * s_tcache_destroy() - Stop sharing the heap.
+ *
+ * @tc_heap: The shared heap context.
+ *
+ * Return: None.
+ */
+void s_tcache_destroy(s_tcache_heap_t *tc_heap)
+{
+  s_tcache_flush(tc_heap);
+  pthread_key_delete(tc_heap->key);
+  pthread_mutex_destroy(&tc_heap->lock);
+}
@@ -0,0 +1,145 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __S_TCACHE_H
+#define __S_TCACHE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "s_heap.h"
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+/* The S_TCACHE_NUM_CLASSES smallest chunk sizes are cached per thread, one
+ * class per number of blocks. Every size class has a magazine of
+ * S_TCACHE_MAG_SIZE entries that is refilled from and flushed to the shared
+ * heap S_TCACHE_BATCH chunks at a time.
+ */
+
+#define S_TCACHE_NUM_CLASSES  (8)
+#define S_TCACHE_MAG_SIZE     (32)
+#define S_TCACHE_BATCH        (S_TCACHE_MAG_SIZE / 2)
+
+/****************************************************************************
+ * Public types
+ ****************************************************************************/
+
+/* A bounded stack of free chunks that have the same size */
+
+typedef struct {
+  uint32_t count;
+  void *chunks[S_TCACHE_MAG_SIZE];
+} s_tcache_mag_t;
+
+/* A heap shared by several threads through their caches */
+
+typedef struct s_tcache_heap_s
+{
+  heap_t *heap;
+  pthread_mutex_t lock;
+  pthread_key_t key;
+} s_tcache_heap_t;
+
+/* The cache owned by one thread */
+
+typedef struct {
+  s_tcache_heap_t *tc_heap;
+  s_tcache_mag_t mags[S_TCACHE_NUM_CLASSES];
+} s_tcache_t;
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/**
+ * s_tcache_init() - Share a heap between threads through per-thread caches.
+ *
+ * @tc_heap: The shared heap context.
+ * @my_heap: An initialized heap. It must only be used through tc_heap
+ *           from now on.
+ *
+ * Return: 0 on success, an error number otherwise.
+ */
+int s_tcache_init(s_tcache_heap_t *tc_heap, heap_t *my_heap);
+
+/**
+ * s_tcache_alloc() - Allocate a memory chunk from the calling thread cache.
+ *
+ * @len: The requested memory size.
+ * @tc_heap: The shared heap context.
+ *
+ * Small chunks are taken from the thread magazine which is refilled in a
+ * batch under the heap lock when it runs empty. Large chunks are always
+ * allocated under the heap lock.
+ *
+ * Return: A void pointer on success otherwise NULL.
+ */
+void *s_tcache_alloc(size_t len, s_tcache_heap_t *tc_heap);
+
+/**
+ * s_tcache_free() - Release a chunk to the calling thread cache.
+ *
+ * @ptr: A chunk allocated by any thread from the same shared heap.
+ * @tc_heap: The shared heap context.
+ *
+ * Small chunks go to the thread magazine and half of it is flushed to the
+ * heap when it is full.
+ *
+ * Return: None.
+ */
+void s_tcache_free(void *ptr, s_tcache_heap_t *tc_heap);
+
+/**
+ * s_tcache_realloc() - Re-allocate a chunk from the shared heap.
+ *
+ * @ptr: Previously allocated buffer or NULL.
+ * @size: The new size or 0 to free ptr.
+ * @tc_heap: The shared heap context.
+ *
+ * Return: The resized buffer or NULL.
+ */
+void *s_tcache_realloc(void *ptr, size_t size, s_tcache_heap_t *tc_heap);
+
+/**
+ * s_tcache_flush() - Give all the chunks cached by the calling thread back.
+ *
+ * @tc_heap: The shared heap context.
+ *
+ * This is done automatically when a thread exits, call it explicitly
+ * before tearing down the shared heap.
+ *
+ * Return: None.
+ */
+void s_tcache_flush(s_tcache_heap_t *tc_heap);
+
+/**
+ * s_tcache_destroy() - Stop sharing the heap.
+ *
+ * @tc_heap: The shared heap context.
+ *
+ * The caches of the other threads must have been flushed already.
+ *
+ * Return: None.
+ */
+void s_tcache_destroy(s_tcache_heap_t *tc_heap);
+
+#endif /* __S_TCACHE_H */
@@ -0,0 +1,265 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TEST_H
+#define __TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "s_heap.h"
+
+/* Helpers shared by the programs in tests/. A failed check prints where it
+ * failed and aborts, so the checks still run in -DNDEBUG builds.
+ */
+
+#define CHECK(cond)                                                         \
+  do {                                                                      \
+    if (!(cond))                                                            \
+    {                                                                       \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,     \
+              #cond);                                                       \
+      abort();                                                              \
+    }                                                                       \
+  } while (0)
+
+/* Runs the statement that follows for every allocation engine */
+
+#define TEST_FOR_EACH_MODE(mode)                                            \
+  for (s_heap_mode_t mode = S_HEAP_MODE_SEGREGATED;                         \
+       mode <= S_HEAP_MODE_TLSF; mode++)
+
+/* What test_heap_check() found in the chunks of a heap */
+
+typedef struct {
+  size_t used_blocks;
+  size_t free_blocks;         /* Including the wilderness */
+  size_t free_chunks;         /* In the bins */
+  size_t largest_free;        /* In blocks, including the wilderness */
+  size_t wild_blocks;
+} test_walk_t;
+
+/* xorshift64*, the tests are reproducible */
+
+static inline uint64_t test_rand(uint64_t *state)
+{
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+
+/**
+ * test_region() - Map a zero filled region for a heap.
+ *
+ * @len: The region size.
+ *
+ * Return: The region, the test aborts if it can not be mapped.
+ */
+static inline uint8_t *test_region(size_t len)
+{
+  uint8_t *region = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  CHECK(region != MAP_FAILED);
+  return region;
+}
+
+/**
+ * test_fill() - Fill a buffer with a pattern derived from a seed.
+ *
+ * @ptr: The buffer.
+ * @len: The buffer size.
+ * @seed: The pattern seed.
+ */
+static inline void test_fill(void *ptr, size_t len, uint8_t seed)
+{
+  for (size_t i = 0; i < len; i++)
+    ((uint8_t *)ptr)[i] = (uint8_t)(seed + i * 7);
+}
+
+/**
+ * test_verify() - Check a buffer filled by test_fill().
+ *
+ * @ptr: The buffer.
+ * @len: The number of bytes to check.
+ * @seed: The pattern seed.
+ *
+ * Return: true if the pattern is intact.
+ */
+static inline bool test_verify(const void *ptr, size_t len, uint8_t seed)
+{
+  for (size_t i = 0; i < len; i++)
+  {
+    if (((const uint8_t *)ptr)[i] != (uint8_t)(seed + i * 7))
+      return false;
+  }
+
+  return true;
+}
+
+/**
+ * test_is_zero() - Check that a buffer only holds zeros.
+ *
+ * @ptr: The buffer.
+ * @len: The buffer size.
+ *
+ * Return: true if every byte is zero.
+ */
+static inline bool test_is_zero(const void *ptr, size_t len)
+{
+  for (size_t i = 0; i < len; i++)
+  {
+    if (((const uint8_t *)ptr)[i] != 0)
+      return false;
+  }
+
+  return true;
+}
+
+/**
+ * test_heap_check() - Walk a heap that no thread is using and check it.
+ *
+ * @my_heap: The heap context.
+ * @coalesced: No two free chunks may follow each other, false for a heap
+ *             with deferred coalescing that was not compacted.
+ * @walk: Output totals or NULL.
+ *
+ * Every segment has to be a run of chunks with a non-zero size that ends
+ * exactly on its fence. A free chunk carries its boundary tag, the next
+ * chunk has prev_free set only after a free chunk, a zeroed free chunk
+ * only holds zeros between its links and its tag and every free chunk but
+ * the wilderness sits in the bin of its size, with the bitmaps and the
+ * per class counters in line with the bins.
+ */
+static inline void test_heap_check(heap_t *my_heap, bool coalesced,
+                                   test_walk_t *walk)
+{
+  size_t block_size = my_heap->block_size;
+  size_t class_chunks[S_HEAP_FL_COUNT] = { 0 };
+  size_t class_blocks[S_HEAP_FL_COUNT] = { 0 };
+  size_t binned = 0, num_blocks = 0;
+  test_walk_t totals = { 0 };
+  s_heap_seg_t *seg;
+  mem_node_t *node;
+  bool wild_seen = false;
+
+  for (seg = &my_heap->first_segment; seg != NULL; seg = seg->next)
+  {
+    mem_node_t *fence = (mem_node_t *)seg->end;
+    bool prev_free = false;
+    uint8_t *chunk;
+
+    CHECK(fence->magic == S_HEAP_MAGIC_FENCE && fence->mask.size == 0);
+
+    for (chunk = (uint8_t *)seg->start; chunk < (uint8_t *)seg->end;
+         chunk += node->mask.size * block_size)
+    {
+      node = (mem_node_t *)chunk;
+
+      CHECK(node->mask.size >= my_heap->min_blocks);
+      CHECK(chunk + node->mask.size * block_size <= (uint8_t *)seg->end);
+      CHECK(node->mask.locked == 0);
+      CHECK(node->mask.prev_free == prev_free);
+      num_blocks += node->mask.size;
+
+      if (node->mask.used)
+      {
+        CHECK(node->magic == S_HEAP_MAGIC_USED);
+        totals.used_blocks += node->mask.size;
+        prev_free = false;
+        continue;
+      }
+
+      CHECK(node->magic == S_HEAP_MAGIC_FREE);
+      CHECK(!coalesced || !prev_free);
+      totals.free_blocks += node->mask.size;
+      if (node->mask.size > totals.largest_free)
+        totals.largest_free = node->mask.size;
+
+      if (node == my_heap->wilderness)
+      {
+        CHECK(chunk + node->mask.size * block_size == (uint8_t *)seg->end);
+        CHECK(seg->end == my_heap->wild_end);
+        totals.wild_blocks = node->mask.size;
+        wild_seen = true;
+        continue;
+      }
+
+      CHECK(((mem_footer_t *)(chunk + node->mask.size * block_size) - 1)
+            ->node == node);
+      if (node->mask.zeroed)
+        CHECK(test_is_zero(chunk + sizeof(mem_node_t),
+                           node->mask.size * block_size -
+                           sizeof(mem_node_t) - sizeof(mem_footer_t)));
+
+      totals.free_chunks++;
+      prev_free = true;
+    }
+
+    CHECK(chunk == (uint8_t *)seg->end);
+  }
+
+  CHECK(wild_seen == (my_heap->wilderness != NULL));
+  CHECK(num_blocks == my_heap->num_blocks);
+
+  /* Every binned chunk is a free chunk of the walk in its own bin */
+
+  for (unsigned int fl = 0; fl < S_HEAP_FL_COUNT; fl++)
+  {
+    for (unsigned int sl = 0; sl < S_HEAP_SL_COUNT; sl++)
+    {
+      struct list_head *bin = &my_heap->g_free_bins[fl][sl];
+      unsigned int node_fl, node_sl;
+
+      CHECK(!!(my_heap->sl_bitmap[fl] & (1U << sl)) == !list_empty(bin));
+
+      list_for_each_entry (node, bin, node_list)
+      {
+        CHECK(node->magic == S_HEAP_MAGIC_FREE && node->mask.used == 0);
+        CHECK(node != my_heap->wilderness);
+        s_bin_mapping(my_heap, node->mask.size, &node_fl, &node_sl);
+        CHECK(node_fl == fl && node_sl == sl);
+
+        node_fl = 31 - __builtin_clz(node->mask.size);
+        class_chunks[node_fl]++;
+        class_blocks[node_fl] += node->mask.size;
+        binned++;
+      }
+    }
+
+    CHECK(!!(my_heap->free_bins_bitmap & (1U << fl)) ==
+          (my_heap->sl_bitmap[fl] != 0));
+  }
+
+  CHECK(binned == totals.free_chunks);
+  for (unsigned int fl = 0; fl < S_HEAP_FL_COUNT; fl++)
+  {
+    CHECK(my_heap->bin_stats[fl].chunks == class_chunks[fl]);
+    CHECK(my_heap->bin_stats[fl].blocks == class_blocks[fl]);
+  }
+
+  if (walk != NULL)
+    *walk = totals;
+}
+
+#endif /* __TEST_H */
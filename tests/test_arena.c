@@ -0,0 +1,167 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* An arena hands out aligned memory that does not overlap, a rewind drops
+ * what came after the mark and keeps what came before, and a reset gives
+ * the chunks back to the heap unless they are kept.
+ */
+
+#include "test.h"
+#include "s_arena.h"
+
+#define HEAP_SIZE     (16 * 1024 * 1024)
+#define CHUNK_SIZE    (4096)
+#define NUM_ALLOCS    (1000)
+
+typedef struct {
+  uint8_t *ptr;
+  size_t len;
+} alloc_t;
+
+/**
+ * fill_arena() - Allocate memory of random sizes and alignments.
+ *
+ * @arena: The arena context.
+ * @allocs: Output array of allocations.
+ * @first: The first allocation to fill in.
+ * @num: The number of allocations.
+ * @seed: The state of the random sizes.
+ */
+static void fill_arena(s_arena_t *arena, alloc_t *allocs, int first,
+                       int num, uint64_t *seed)
+{
+  for (int i = first; i < first + num; i++)
+  {
+    uint64_t rnd = test_rand(seed);
+    size_t len = rnd % 300;
+
+    /* One in a hundred does not fit in a chunk */
+
+    if (rnd % 100 == 0)
+      len = CHUNK_SIZE * 2 + rnd % 1000;
+
+    if ((rnd >> 32) % 4 == 0)
+    {
+      size_t align = (size_t)1 << (4 + (rnd >> 40) % 8);
+
+      allocs[i].ptr = s_arena_aligned_alloc(align, len, arena);
+      CHECK(((uintptr_t)allocs[i].ptr & (align - 1)) == 0);
+    }
+    else
+    {
+      allocs[i].ptr = s_arena_alloc(len, arena);
+      CHECK(((uintptr_t)allocs[i].ptr & (S_ARENA_ALIGN - 1)) == 0);
+    }
+
+    CHECK(allocs[i].ptr != NULL);
+    allocs[i].len = len;
+    test_fill(allocs[i].ptr, len, i);
+  }
+}
+
+static void verify_arena(const alloc_t *allocs, int num)
+{
+  for (int i = 0; i < num; i++)
+    CHECK(test_verify(allocs[i].ptr, allocs[i].len, i));
+}
+
+static size_t used_bytes(heap_t *my_heap)
+{
+  s_heap_stats_t stats;
+
+  s_heap_stats(my_heap, &stats);
+  return stats.used_bytes;
+}
+
+static void test_arena(s_heap_mode_t mode)
+{
+  uint8_t *region = test_region(HEAP_SIZE);
+  static alloc_t allocs[2 * NUM_ALLOCS];
+  s_arena_mark_t mark;
+  uint64_t seed = 13;
+  size_t base, at_mark, before, num_chunks;
+  s_arena_t arena;
+  heap_t heap;
+
+  s_init_mode(&heap, region, region + HEAP_SIZE, mode);
+  CHECK(s_arena_init(&arena, &heap, 8) == -1);
+  CHECK(s_arena_init(&arena, &heap, CHUNK_SIZE) == 0);
+  base = used_bytes(&heap);
+
+  /* Nothing is taken from the heap before the first allocation */
+
+  CHECK(arena.num_chunks == 0);
+
+  fill_arena(&arena, allocs, 0, NUM_ALLOCS, &seed);
+  verify_arena(allocs, NUM_ALLOCS);
+  at_mark = used_bytes(&heap);
+  CHECK(at_mark > base);
+
+  /* A rewind keeps what was allocated before the mark */
+
+  mark = s_arena_mark(&arena);
+  fill_arena(&arena, allocs, NUM_ALLOCS, NUM_ALLOCS, &seed);
+  verify_arena(allocs, 2 * NUM_ALLOCS);
+  before = used_bytes(&heap);
+  CHECK(before > at_mark);
+
+  s_arena_rewind(&arena, &mark);
+  verify_arena(allocs, NUM_ALLOCS);
+  CHECK(arena.used_bytes == mark.used_bytes);
+  CHECK(used_bytes(&heap) < before);
+
+  /* The large chunks went back to the heap, the others are cached and
+   * serve the next allocations without taking more from the heap.
+   */
+
+  num_chunks = arena.num_chunks;
+  fill_arena(&arena, allocs, NUM_ALLOCS, NUM_ALLOCS / 10, &seed);
+  verify_arena(allocs, NUM_ALLOCS);
+  s_arena_rewind(&arena, &mark);
+  CHECK(arena.num_chunks <= num_chunks);
+
+  /* A reset that keeps the chunks does not give anything back */
+
+  s_arena_reset(&arena, true);
+  CHECK(arena.used_bytes == 0);
+  CHECK(used_bytes(&heap) > base);
+  fill_arena(&arena, allocs, 0, NUM_ALLOCS, &seed);
+  verify_arena(allocs, NUM_ALLOCS);
+
+  s_arena_reset(&arena, false);
+  CHECK(arena.num_chunks == 0);
+  CHECK(used_bytes(&heap) == base);
+
+  fill_arena(&arena, allocs, 0, NUM_ALLOCS / 2, &seed);
+  s_arena_destroy(&arena);
+  CHECK(used_bytes(&heap) == base);
+
+  test_heap_check(&heap, true, NULL);
+  s_heap_destroy(&heap);
+  munmap(region, HEAP_SIZE);
+}
+
+int main(void)
+{
+  TEST_FOR_EACH_MODE(mode)
+    test_arena(mode);
+
+  printf("test_arena: ok\n");
+  return 0;
+}
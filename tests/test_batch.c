@@ -0,0 +1,127 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* s_alloc_batch hands out chunks that do not overlap and hold their
+ * sizes, a batch that does not fit leaves the heap as it was, and
+ * s_free_batch releases pointers in any order, mixed with NULL, without
+ * touching the array.
+ */
+
+#include "test.h"
+
+#define HEAP_SIZE     (4 * 1024 * 1024)
+#define BATCH         (256)
+
+static int cmp_ptr(const void *a, const void *b)
+{
+  uintptr_t pa = *(const uintptr_t *)a, pb = *(const uintptr_t *)b;
+
+  return pa < pb ? -1 : pa > pb;
+}
+
+static void test_batch(s_heap_mode_t mode, bool thread_safe)
+{
+  uint8_t *region = test_region(HEAP_SIZE);
+  size_t sizes[BATCH];
+  void *ptrs[BATCH], *sorted[BATCH], *copy[BATCH];
+  uint64_t seed = 3;
+  test_walk_t walk;
+  heap_t heap;
+
+  s_init_mode(&heap, region, region + HEAP_SIZE, mode);
+  if (thread_safe)
+    CHECK(s_heap_set_thread_safe(&heap) == 0);
+
+  for (int round = 0; round < 32; round++)
+  {
+    for (int i = 0; i < BATCH; i++)
+      sizes[i] = 1 + test_rand(&seed) % 1024;
+
+    CHECK(s_alloc_batch(BATCH, sizes, ptrs, &heap) == 0);
+    for (int i = 0; i < BATCH; i++)
+    {
+      CHECK(ptrs[i] != NULL);
+      CHECK(s_usable_size(ptrs[i], &heap) >= sizes[i]);
+      test_fill(ptrs[i], sizes[i], i);
+    }
+
+    /* No two chunks overlap */
+
+    memcpy(sorted, ptrs, sizeof(ptrs));
+    qsort(sorted, BATCH, sizeof(void *), cmp_ptr);
+    for (int i = 1; i < BATCH; i++)
+      CHECK((uint8_t *)sorted[i - 1] + s_usable_size(sorted[i - 1], &heap) <=
+            (uint8_t *)sorted[i]);
+
+    for (int i = 0; i < BATCH; i++)
+      CHECK(test_verify(ptrs[i], sizes[i], i));
+    test_heap_check(&heap, true, NULL);
+
+    /* Shuffle every other round, drop some and release the rest at once.
+     * In address order the neighbours are merged before the release.
+     */
+
+    for (int i = BATCH - 1; round % 2 && i > 0; i--)
+    {
+      int j = test_rand(&seed) % (i + 1);
+      void *tmp = ptrs[i];
+
+      ptrs[i] = ptrs[j];
+      ptrs[j] = tmp;
+    }
+
+    for (int i = 0; i < BATCH; i += 7)
+    {
+      s_free(ptrs[i], &heap);
+      ptrs[i] = NULL;
+    }
+
+    memcpy(copy, ptrs, sizeof(ptrs));
+    s_free_batch(ptrs, BATCH, &heap);
+    CHECK(memcmp(copy, ptrs, sizeof(ptrs)) == 0);
+    test_heap_check(&heap, true, &walk);
+    CHECK(walk.used_blocks == 0);
+  }
+
+  /* A batch that can not fit fails as a whole */
+
+  for (int i = 0; i < BATCH; i++)
+    sizes[i] = HEAP_SIZE / 64;
+
+  CHECK(s_alloc_batch(BATCH, sizes, ptrs, &heap) == -1);
+  for (int i = 0; i < BATCH; i++)
+    CHECK(ptrs[i] == NULL);
+  test_heap_check(&heap, true, &walk);
+  CHECK(walk.used_blocks == 0);
+
+  s_heap_destroy(&heap);
+  munmap(region, HEAP_SIZE);
+}
+
+int main(void)
+{
+  TEST_FOR_EACH_MODE(mode)
+  {
+    test_batch(mode, false);
+    test_batch(mode, true);
+  }
+
+  printf("test_batch: ok\n");
+  return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* s_calloc returns zero filled memory whether the chunk was dirty, never
+ * handed out or purged, and merging two purged chunks keeps both sizes.
+ */
+
+#include "test.h"
+
+#define HEAP_SIZE     (16 * 1024 * 1024)
+#define BIG_ALLOC     (64 * 1024)
+#define NUM_PTRS      (256)
+
+/* Chunks freed dirty and taken again by s_calloc are cleared */
+
+static void test_dirty(s_heap_mode_t mode, bool zeroed)
+{
+  s_heap_config_t config = { .mode = mode, .zeroed = zeroed };
+  uint8_t *region = test_region(HEAP_SIZE);
+  void *ptrs[NUM_PTRS];
+  uint64_t seed = 1;
+  heap_t heap;
+
+  /* A region that is not known to be zero filled holds garbage */
+
+  if (!zeroed)
+    memset(region, 0xa5, HEAP_SIZE);
+
+  CHECK(s_init_ex(&heap, region, region + HEAP_SIZE, &config) == 0);
+
+  for (int round = 0; round < 4; round++)
+  {
+    for (int i = 0; i < NUM_PTRS; i++)
+    {
+      size_t len = 1 + test_rand(&seed) % 2048;
+
+      ptrs[i] = s_calloc(1, len, &heap);
+      CHECK(ptrs[i] != NULL);
+      CHECK(test_is_zero(ptrs[i], len));
+      memset(ptrs[i], 0xff, len);
+    }
+
+    for (int i = 0; i < NUM_PTRS; i += 1 + round % 2)
+      s_free(ptrs[i], &heap);
+    test_heap_check(&heap, true, NULL);
+
+    for (int i = 0; i < NUM_PTRS; i += 1 + round % 2)
+    {
+      ptrs[i] = s_calloc(4, 1 + test_rand(&seed) % 512, &heap);
+      CHECK(ptrs[i] != NULL);
+      CHECK(test_is_zero(ptrs[i], 4));
+    }
+
+    for (int i = 0; i < NUM_PTRS; i++)
+      s_free(ptrs[i], &heap);
+    test_heap_check(&heap, true, NULL);
+  }
+
+  /* nmemb * size overflows */
+
+  CHECK(s_calloc(SIZE_MAX / 2, 4, &heap) == NULL);
+
+  s_heap_destroy(&heap);
+  munmap(region, HEAP_SIZE);
+}
+
+/* Two neighbours that were both purged are merged into one zeroed chunk
+ * that covers both of them.
+ */
+
+static void test_zeroed_merge(s_heap_mode_t mode)
+{
+  s_heap_config_t config = {
+    .mode = mode,
+    .zeroed = true,
+    .defer_coalescing = true,
+  };
+  uint8_t *region = test_region(HEAP_SIZE);
+  test_walk_t walk;
+  uint8_t *a, *b, *c, *guard;
+  heap_t heap;
+
+  CHECK(s_init_ex(&heap, region, region + HEAP_SIZE, &config) == 0);
+
+  a = s_alloc(BIG_ALLOC, &heap);
+  b = s_alloc(BIG_ALLOC, &heap);
+  guard = s_alloc(64, &heap);
+  CHECK(a != NULL && b != NULL && guard != NULL);
+  memset(a, 0x11, BIG_ALLOC);
+  memset(b, 0x22, BIG_ALLOC);
+
+  /* Deferred: both stay in the bins unmerged, the trim zeroes them */
+
+  s_free(a, &heap);
+  s_free(b, &heap);
+  CHECK(s_heap_trim(&heap) >= BIG_ALLOC);
+  test_heap_check(&heap, false, &walk);
+  CHECK(walk.free_chunks == 2);
+
+  CHECK(s_heap_compact_free(&heap) == 1);
+  test_heap_check(&heap, true, &walk);
+  CHECK(walk.free_chunks == 1);
+
+  /* The merged chunk serves a request larger than either of the two */
+
+  c = s_calloc(1, 2 * BIG_ALLOC - 256, &heap);
+  CHECK(c == a);
+  CHECK(test_is_zero(c, 2 * BIG_ALLOC - 256));
+  test_heap_check(&heap, true, NULL);
+
+  s_free(c, &heap);
+  s_free(guard, &heap);
+  s_heap_compact_free(&heap);
+  test_heap_check(&heap, true, &walk);
+  CHECK(walk.used_blocks == 0 && walk.free_chunks == 0);
+
+  s_heap_destroy(&heap);
+  munmap(region, HEAP_SIZE);
+}
+
+int main(void)
+{
+  TEST_FOR_EACH_MODE(mode)
+  {
+    test_dirty(mode, false);
+    test_dirty(mode, true);
+    test_zeroed_merge(mode);
+  }
+
+  printf("test_calloc: ok\n");
+  return 0;
+}
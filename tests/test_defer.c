@@ -0,0 +1,144 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Deferred coalescing: random allocations, aligned allocations, resizes
+ * and releases mixed with purges, then s_heap_compact_free() has to leave
+ * every segment without two free neighbours and with all the chunks in
+ * their bins. The live chunks keep their contents through all of it.
+ */
+
+#include "test.h"
+
+#define HEAP_SIZE     (32 * 1024 * 1024)
+#define NUM_PTRS      (1024)
+#define NUM_OPS       (200000)
+#define CHECK_EVERY   (5000)
+
+typedef struct {
+  uint8_t *ptr;
+  size_t len;
+  uint8_t seed;
+} slot_t;
+
+static void run(s_heap_mode_t mode, size_t purge_min, uint32_t defer_limit)
+{
+  s_heap_config_t config = {
+    .mode = mode,
+    .zeroed = true,
+    .purge_min = purge_min,
+    .purge_interval = 64,
+    .defer_coalescing = true,
+    .defer_limit = defer_limit,
+  };
+  static slot_t slots[NUM_PTRS];
+  uint8_t *region = test_region(HEAP_SIZE);
+  uint64_t seed = 7;
+  test_walk_t walk;
+  heap_t heap;
+
+  memset(slots, 0, sizeof(slots));
+  CHECK(s_init_ex(&heap, region, region + HEAP_SIZE, &config) == 0);
+
+  for (int op = 1; op <= NUM_OPS; op++)
+  {
+    uint64_t rnd = test_rand(&seed);
+    slot_t *slot = &slots[rnd % NUM_PTRS];
+    size_t len = 1 + (rnd >> 16) % ((rnd >> 40) % 8 == 0 ? 16384 : 512);
+
+    if (slot->ptr != NULL)
+    {
+      CHECK(test_verify(slot->ptr, slot->len, slot->seed));
+
+      if ((rnd >> 48) % 4 == 0)
+      {
+        uint8_t *ptr = s_realloc(slot->ptr, len, &heap);
+
+        CHECK(ptr != NULL);
+        CHECK(test_verify(ptr, slot->len < len ? slot->len : len,
+                          slot->seed));
+        slot->ptr = ptr;
+      }
+      else
+      {
+        s_free(slot->ptr, &heap);
+        slot->ptr = NULL;
+        continue;
+      }
+    }
+    else if ((rnd >> 48) % 4 == 0)
+    {
+      size_t align = (size_t)64 << ((rnd >> 52) % 8);
+
+      slot->ptr = s_aligned_alloc(align, len, &heap);
+      CHECK(slot->ptr != NULL);
+      CHECK(((uintptr_t)slot->ptr & (align - 1)) == 0);
+    }
+    else
+    {
+      slot->ptr = s_alloc(len, &heap);
+      CHECK(slot->ptr != NULL);
+    }
+
+    slot->len = len;
+    slot->seed = (uint8_t)op;
+    test_fill(slot->ptr, len, slot->seed);
+
+    if (op % CHECK_EVERY == 0)
+    {
+      test_heap_check(&heap, false, NULL);
+
+      if ((op / CHECK_EVERY) % 3 == 0)
+        s_heap_trim(&heap);
+
+      s_heap_compact_free(&heap);
+      test_heap_check(&heap, true, NULL);
+    }
+  }
+
+  for (int i = 0; i < NUM_PTRS; i++)
+  {
+    if (slots[i].ptr == NULL)
+      continue;
+
+    CHECK(test_verify(slots[i].ptr, slots[i].len, slots[i].seed));
+    s_free(slots[i].ptr, &heap);
+  }
+
+  s_heap_trim(&heap);
+  s_heap_compact_free(&heap);
+  test_heap_check(&heap, true, &walk);
+  CHECK(walk.used_blocks == 0 && walk.free_chunks == 0);
+  CHECK(walk.wild_blocks == heap.num_blocks);
+
+  s_heap_destroy(&heap);
+  munmap(region, HEAP_SIZE);
+}
+
+int main(void)
+{
+  TEST_FOR_EACH_MODE(mode)
+  {
+    run(mode, 0, 0);
+    run(mode, 0, 16);
+    run(mode, 4096, 256);
+  }
+
+  printf("test_defer: ok\n");
+  return 0;
+}
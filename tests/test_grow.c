@@ -0,0 +1,132 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* A heap extended by hand or growing on its own serves requests from all
+ * its segments, never merges chunks across them and reuses a chunk freed
+ * in an older segment.
+ */
+
+#include "test.h"
+
+#define HEAP_SIZE     (256 * 1024)
+#define GROW_SIZE     (1024 * 1024)
+#define NUM_PTRS      (1024)
+
+static void test_extend(s_heap_mode_t mode)
+{
+  uint8_t *region = test_region(HEAP_SIZE);
+  uint8_t *extra = test_region(HEAP_SIZE);
+  uint8_t *ptrs[NUM_PTRS];
+  size_t num = 0, num_blocks;
+  heap_t heap;
+
+  s_init_mode(&heap, region, region + HEAP_SIZE, mode);
+  num_blocks = heap.num_blocks;
+
+  for (; num < NUM_PTRS; num++)
+  {
+    ptrs[num] = s_alloc(1000, &heap);
+    if (ptrs[num] == NULL)
+      break;
+
+    test_fill(ptrs[num], 1000, num);
+  }
+
+  CHECK(num > 0 && num < NUM_PTRS / 2);
+  CHECK(s_heap_extend(&heap, extra, extra + HEAP_SIZE) == 0);
+  CHECK(heap.num_blocks > num_blocks);
+  test_heap_check(&heap, true, NULL);
+
+  for (; num < NUM_PTRS; num++)
+  {
+    ptrs[num] = s_alloc(1000, &heap);
+    if (ptrs[num] == NULL)
+      break;
+
+    CHECK(ptrs[num] >= extra && ptrs[num] < extra + HEAP_SIZE);
+    CHECK(s_heap_contains(&heap, ptrs[num]));
+    test_fill(ptrs[num], 1000, num);
+  }
+
+  /* A chunk freed in the first segment serves the next request, two
+   * neighbours are freed so that TLSF, which rounds the request up to the
+   * next class, finds it too.
+   */
+
+  s_free(ptrs[1], &heap);
+  s_free(ptrs[2], &heap);
+  CHECK(s_alloc(1000, &heap) == ptrs[1]);
+  test_fill(ptrs[1], 1000, 1);
+
+  for (size_t i = 0; i < num; i++)
+    CHECK(i == 2 || test_verify(ptrs[i], 1000, i));
+  test_heap_check(&heap, true, NULL);
+
+  CHECK(!s_heap_contains(&heap, &heap));
+  s_heap_destroy(&heap);
+  munmap(region, HEAP_SIZE);
+  munmap(extra, HEAP_SIZE);
+}
+
+static void test_grow(s_heap_mode_t mode)
+{
+  s_heap_config_t config = { .mode = mode, .grow_size = GROW_SIZE };
+  uint8_t *region = test_region(HEAP_SIZE);
+  uint8_t *ptrs[NUM_PTRS];
+  test_walk_t walk;
+  heap_t heap;
+
+  CHECK(s_init_ex(&heap, region, region + HEAP_SIZE, &config) == 0);
+
+  /* Each one is larger than the first segment */
+
+  for (int i = 0; i < 8; i++)
+  {
+    ptrs[i] = s_alloc(HEAP_SIZE + i * 4096, &heap);
+    CHECK(ptrs[i] != NULL);
+    CHECK(!(ptrs[i] >= region && ptrs[i] < region + HEAP_SIZE));
+    test_fill(ptrs[i], HEAP_SIZE + i * 4096, i);
+  }
+
+  for (int i = 0; i < 8; i++)
+    CHECK(test_verify(ptrs[i], HEAP_SIZE + i * 4096, i));
+  test_heap_check(&heap, true, NULL);
+
+  for (int i = 0; i < 8; i++)
+    s_free(ptrs[i], &heap);
+
+  test_heap_check(&heap, true, &walk);
+  CHECK(walk.used_blocks == 0);
+  CHECK(walk.free_blocks == heap.num_blocks);
+
+  s_heap_destroy(&heap);
+  munmap(region, HEAP_SIZE);
+}
+
+int main(void)
+{
+  TEST_FOR_EACH_MODE(mode)
+  {
+    test_extend(mode);
+    test_grow(mode);
+  }
+
+  printf("test_grow: ok\n");
+  return 0;
+}
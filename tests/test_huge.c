@@ -0,0 +1,132 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* A heap from s_init_huge is aligned to the huge page size and grows with
+ * huge page segments, and the slab runs on top of it are packed in huge
+ * page blocks.
+ */
+
+#include "test.h"
+#include "s_slab.h"
+
+#define HEAP_SIZE     (8 * 1024 * 1024)
+#define NUM_OBJS      (20000)
+
+static void test_heap(s_heap_mode_t mode)
+{
+  s_heap_config_t config = {
+    .mode = mode,
+    .grow_size = S_HEAP_HUGE_PAGE_SIZE,
+  };
+  uint8_t *ptrs[4];
+  heap_t heap;
+
+  CHECK(s_init_huge(&heap, HEAP_SIZE - 1, &config) == 0);
+  CHECK(heap.huge_pages);
+  CHECK(((uintptr_t)heap.heap_mem_start_unaligned &
+         (S_HEAP_HUGE_PAGE_SIZE - 1)) == 0);
+  CHECK(heap.total_size <= HEAP_SIZE &&
+        heap.total_size > HEAP_SIZE - S_HEAP_HUGE_PAGE_SIZE);
+
+  /* The mapping is zero filled and the heap knows it */
+
+  ptrs[0] = s_calloc(1, 1024 * 1024, &heap);
+  CHECK(ptrs[0] != NULL && test_is_zero(ptrs[0], 1024 * 1024));
+
+  /* Requests larger than the region come from new huge page segments */
+
+  for (int i = 1; i < 4; i++)
+  {
+    ptrs[i] = s_alloc(HEAP_SIZE, &heap);
+    CHECK(ptrs[i] != NULL);
+    test_fill(ptrs[i], HEAP_SIZE, i);
+  }
+
+  for (int i = 1; i < 4; i++)
+    CHECK(test_verify(ptrs[i], HEAP_SIZE, i));
+  test_heap_check(&heap, true, NULL);
+
+  for (int i = 0; i < 4; i++)
+    s_free(ptrs[i], &heap);
+  test_heap_check(&heap, true, NULL);
+
+  s_heap_destroy(&heap);
+}
+
+static void test_slab(s_heap_mode_t mode)
+{
+  s_heap_config_t config = { .mode = mode };
+  static uint8_t *objs[NUM_OBJS];
+  uintptr_t lowest = UINTPTR_MAX, highest = 0;
+  s_slab_stats_t stats;
+  s_slab_t slab;
+  heap_t heap;
+
+  CHECK(s_init_huge(&heap, HEAP_SIZE, &config) == 0);
+  CHECK(s_slab_init(&slab, &heap) == 0);
+
+  for (int i = 0; i < NUM_OBJS; i++)
+  {
+    size_t len = 1 + i % S_SLAB_MAX_SIZE;
+
+    objs[i] = s_slab_alloc(len, &slab);
+    CHECK(objs[i] != NULL);
+    test_fill(objs[i], len, i);
+
+    if ((uintptr_t)objs[i] < lowest)
+      lowest = (uintptr_t)objs[i];
+    if ((uintptr_t)objs[i] > highest)
+      highest = (uintptr_t)objs[i];
+  }
+
+  for (int i = 0; i < NUM_OBJS; i++)
+    CHECK(test_verify(objs[i], 1 + i % S_SLAB_MAX_SIZE, i));
+
+  /* About 1.5MB of objects fit in one block, starting with its first run */
+
+  CHECK((lowest & ~(S_SLAB_BLOCK_SIZE - 1)) ==
+        (highest & ~(S_SLAB_BLOCK_SIZE - 1)));
+  CHECK((lowest & (S_SLAB_BLOCK_SIZE - 1)) < S_SLAB_RUN_SIZE);
+
+  s_slab_stats(&slab, &stats);
+  CHECK(stats.num_runs * S_SLAB_RUN_SIZE < S_SLAB_BLOCK_SIZE);
+
+  for (int i = 0; i < NUM_OBJS; i++)
+    s_slab_free(objs[i], &slab);
+
+  s_slab_stats(&slab, &stats);
+  CHECK(stats.used_bytes == 0);
+  CHECK(stats.num_runs <= S_SLAB_NUM_CLASSES);
+
+  s_slab_destroy(&slab);
+  test_heap_check(&heap, true, NULL);
+  s_heap_destroy(&heap);
+}
+
+int main(void)
+{
+  TEST_FOR_EACH_MODE(mode)
+  {
+    test_heap(mode);
+    test_slab(mode);
+  }
+
+  printf("test_huge: ok\n");
+  return 0;
+}
@@ -0,0 +1,233 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* The C library allocation calls behave as they should when the shim is
+ * preloaded, from several threads and in a child process. make test runs
+ * it with LD_PRELOAD=lib_salloc.so.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <malloc.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "test.h"
+
+#define NUM_THREADS   (4)
+#define NUM_PTRS      (512)
+#define NUM_OPS       (50000)
+#define NUM_FORKS     (16)
+
+static uint8_t *volatile g_fork_ptr;
+
+/* Handlers that allocate while the heap is held for a fork. The ones that
+ * are registered first run their prepare handler last, after the one of
+ * the shim.
+ */
+
+static void fork_alloc(void)
+{
+  uint8_t *ptr = malloc(100);
+
+  CHECK(ptr != NULL);
+  test_fill(ptr, 100, 9);
+  free(g_fork_ptr);
+  g_fork_ptr = ptr;
+}
+
+__attribute__((constructor)) static void fork_handlers(void)
+{
+  CHECK(pthread_atfork(fork_alloc, fork_alloc, fork_alloc) == 0);
+}
+
+static void *worker(void *arg)
+{
+  uint64_t seed = (uintptr_t)arg + 1;
+  static __thread uint8_t *ptrs[NUM_PTRS];
+  static __thread size_t lens[NUM_PTRS];
+
+  for (int op = 0; op < NUM_OPS; op++)
+  {
+    uint64_t rnd = test_rand(&seed);
+    int i = rnd % NUM_PTRS;
+    size_t len = 1 + (rnd >> 16) % 4096;
+
+    if (ptrs[i] == NULL)
+    {
+      ptrs[i] = malloc(len);
+      CHECK(ptrs[i] != NULL);
+    }
+    else
+    {
+      CHECK(test_verify(ptrs[i], lens[i], i));
+      ptrs[i] = realloc(ptrs[i], len);
+      CHECK(ptrs[i] != NULL);
+      CHECK(test_verify(ptrs[i], lens[i] < len ? lens[i] : len, i));
+    }
+
+    lens[i] = len;
+    test_fill(ptrs[i], len, i);
+
+    if ((rnd >> 40) % 3 == 0)
+    {
+      free(ptrs[i]);
+      ptrs[i] = NULL;
+    }
+  }
+
+  for (int i = 0; i < NUM_PTRS; i++)
+    free(ptrs[i]);
+
+  return NULL;
+}
+
+/**
+ * check_aborts() - Check that a call on a foreign pointer aborts.
+ *
+ * @call: 0 for free, 1 for realloc and 2 for malloc_usable_size.
+ */
+static void check_aborts(int call)
+{
+  static uint8_t buf[64];
+  uint8_t *volatile foreign = buf;
+  pid_t pid;
+  int status;
+
+  pid = fork();
+  CHECK(pid >= 0);
+  if (pid == 0)
+  {
+    dup2(open("/dev/null", O_WRONLY), STDERR_FILENO);
+    if (call == 0)
+      free(foreign);
+    else if (call == 1)
+      free(realloc(foreign, 10));
+    else
+      malloc_usable_size(foreign);
+    _exit(0);
+  }
+
+  CHECK(waitpid(pid, &status, 0) == pid);
+  CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+}
+
+static void test_calls(void)
+{
+  volatile size_t huge = SIZE_MAX / 2;
+  uint8_t *ptr;
+  void *aligned;
+
+  free(NULL);
+
+  ptr = calloc(1000, 3);
+  CHECK(ptr != NULL && test_is_zero(ptr, 3000));
+  CHECK(malloc_usable_size(ptr) >= 3000);
+  memset(ptr, 0xff, 3000);
+  free(ptr);
+
+  /* nmemb * size overflows */
+
+  CHECK(calloc(huge, 4) == NULL);
+  CHECK(reallocarray(NULL, huge, 4) == NULL);
+
+  ptr = realloc(NULL, 10);
+  CHECK(ptr != NULL);
+  test_fill(ptr, 10, 3);
+  ptr = realloc(ptr, 100000);
+  CHECK(ptr != NULL && test_verify(ptr, 10, 3));
+  free(ptr);
+
+  for (size_t align = sizeof(void *); align <= 65536; align <<= 1)
+  {
+    CHECK(posix_memalign(&aligned, align, 100) == 0);
+    CHECK(((uintptr_t)aligned & (align - 1)) == 0);
+    free(aligned);
+
+    aligned = aligned_alloc(align, align * 2);
+    CHECK(aligned != NULL && ((uintptr_t)aligned & (align - 1)) == 0);
+    free(aligned);
+  }
+
+  CHECK(posix_memalign(&aligned, 3, 100) != 0);
+
+  aligned = valloc(100);
+  CHECK(((uintptr_t)aligned & (sysconf(_SC_PAGESIZE) - 1)) == 0);
+  free(aligned);
+}
+
+int main(void)
+{
+  pthread_t threads[NUM_THREADS];
+  uint8_t *ptr;
+  pid_t pid;
+  int status;
+
+  /* The heap functions are only visible when the shim is preloaded */
+
+  CHECK(dlsym(RTLD_DEFAULT, "s_heap_trim") != NULL);
+
+  test_calls();
+
+  /* The size of a pointer that is not ours is unknown */
+
+  for (int call = 0; call < 3; call++)
+    check_aborts(call);
+
+  for (uintptr_t i = 0; i < NUM_THREADS; i++)
+    CHECK(pthread_create(&threads[i], NULL, worker, (void *)i) == 0);
+
+  /* The child gets a copy of the heap while the threads use it, with no
+   * lock held by a thread that does not exist in the child.
+   */
+
+  ptr = malloc(1000);
+  test_fill(ptr, 1000, 5);
+
+  for (int i = 0; i < NUM_FORKS; i++)
+  {
+    pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0)
+    {
+      CHECK(test_verify(ptr, 1000, 5));
+      CHECK(test_verify(g_fork_ptr, 100, 9));
+      free(ptr);
+      test_calls();
+      worker(NULL);
+      _exit(0);
+    }
+
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    CHECK(test_verify(g_fork_ptr, 100, 9));
+  }
+
+  for (int i = 0; i < NUM_THREADS; i++)
+    pthread_join(threads[i], NULL);
+
+  CHECK(test_verify(ptr, 1000, 5));
+  free(ptr);
+
+  printf("test_preload: ok\n");
+  return 0;
+}
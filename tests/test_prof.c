@@ -0,0 +1,143 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Built with -DS_HEAP_PROFILE every public call lands once in the
+ * latency and visit histograms of its own call and size class, without
+ * it s_heap_prof_read fails and reports nothing.
+ */
+
+#include "test.h"
+
+#define HEAP_SIZE     (8 * 1024 * 1024)
+#define NUM_PTRS      (100)
+#define ALLOC_LEN     (1000)
+
+/**
+ * prof_calls() - Count the calls of one kind in the histograms.
+ *
+ * @prof: The histograms.
+ * @op: The public call.
+ * @cls: The size class or -1 for all of them.
+ *
+ * Return: The number of calls.
+ */
+static size_t prof_calls(const s_heap_prof_t *prof, s_heap_op_t op, int cls)
+{
+  size_t calls = 0;
+
+  for (int c = 0; c < S_HEAP_FL_COUNT; c++)
+  {
+    if (cls >= 0 && c != cls)
+      continue;
+
+    for (int b = 0; b < S_HEAP_PROF_BUCKETS; b++)
+      calls += prof->latency[op][c][b];
+  }
+
+  return calls;
+}
+
+static void test_prof(s_heap_mode_t mode)
+{
+  uint8_t *region = test_region(HEAP_SIZE);
+  static s_heap_prof_t prof;
+  void *ptrs[NUM_PTRS];
+  size_t sizes[NUM_PTRS], visits;
+  int cls;
+  heap_t heap;
+
+  s_init_mode(&heap, region, region + HEAP_SIZE, mode);
+  cls = 31 - __builtin_clz(s_heap_len_to_blocks(&heap, ALLOC_LEN));
+
+  for (int i = 0; i < NUM_PTRS; i++)
+    ptrs[i] = s_alloc(ALLOC_LEN, &heap);
+  for (int i = 0; i < NUM_PTRS; i += 2)
+    s_free(ptrs[i], &heap);
+
+  /* A release is profiled in the class of the chunk, not of the size hint */
+
+  for (int i = 1; i < NUM_PTRS; i += 2)
+    s_free_sized(ptrs[i], i % 4 == 1 ? ALLOC_LEN : 1, &heap);
+
+#ifdef S_HEAP_PROFILE
+  CHECK(s_heap_prof_read(&heap, &prof) == 0);
+  CHECK(prof_calls(&prof, S_HEAP_OP_ALLOC, cls) == NUM_PTRS);
+  CHECK(prof_calls(&prof, S_HEAP_OP_ALLOC, -1) == NUM_PTRS);
+  CHECK(prof_calls(&prof, S_HEAP_OP_FREE, cls) == NUM_PTRS);
+  CHECK(prof_calls(&prof, S_HEAP_OP_FREE, -1) == NUM_PTRS);
+  s_heap_prof_reset(&heap);
+#endif
+
+  /* The calls made by another one are timed for both of them */
+
+  for (int i = 0; i < NUM_PTRS; i++)
+    sizes[i] = ALLOC_LEN;
+  CHECK(s_alloc_batch(NUM_PTRS, sizes, ptrs, &heap) == 0);
+  ptrs[0] = s_realloc(ptrs[0], 2 * ALLOC_LEN, &heap);
+  s_free_batch(ptrs, NUM_PTRS, &heap);
+  s_free(s_calloc(1, ALLOC_LEN, &heap), &heap);
+  s_free(s_aligned_alloc(4096, ALLOC_LEN, &heap), &heap);
+
+#ifdef S_HEAP_PROFILE
+  CHECK(s_heap_prof_read(&heap, &prof) == 0);
+  CHECK(prof_calls(&prof, S_HEAP_OP_ALLOC_BATCH, -1) == 1);
+  CHECK(prof_calls(&prof, S_HEAP_OP_FREE_BATCH, -1) == 1);
+  CHECK(prof_calls(&prof, S_HEAP_OP_CALLOC, cls) == 1);
+  CHECK(prof_calls(&prof, S_HEAP_OP_ALIGNED_ALLOC, cls) == 1);
+  CHECK(prof_calls(&prof, S_HEAP_OP_REALLOC, cls + 1) == 1);
+  CHECK(prof_calls(&prof, S_HEAP_OP_FREE, -1) >= 2);
+
+  /* Every call has one entry in the visit histogram of its kind */
+
+  for (int op = 0; op < S_HEAP_OP_COUNT; op++)
+  {
+    visits = 0;
+    for (int b = 0; b < S_HEAP_PROF_BUCKETS; b++)
+      visits += prof.visits[op][b];
+
+    CHECK(visits == prof_calls(&prof, op, -1));
+  }
+
+  s_heap_prof_reset(&heap);
+  CHECK(s_heap_prof_read(&heap, &prof) == 0);
+  for (int op = 0; op < S_HEAP_OP_COUNT; op++)
+    CHECK(prof_calls(&prof, op, -1) == 0);
+#else
+  (void)visits;
+
+  memset(&prof, 0xff, sizeof(prof));
+  CHECK(s_heap_prof_read(&heap, &prof) == -1);
+  CHECK(test_is_zero(&prof, sizeof(prof)));
+  CHECK(prof_calls(&prof, S_HEAP_OP_ALLOC, cls) == 0);
+  s_heap_prof_reset(&heap);
+#endif
+
+  test_heap_check(&heap, true, NULL);
+  s_heap_destroy(&heap);
+  munmap(region, HEAP_SIZE);
+}
+
+int main(void)
+{
+  TEST_FOR_EACH_MODE(mode)
+    test_prof(mode);
+
+  printf("test_prof: ok\n");
+  return 0;
+}
@@ -0,0 +1,209 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* s_heap_trim and the automatic purge give the pages of the free chunks
+ * back to the OS, keep the chunks usable and leave them zero filled. The
+ * automatic purge only takes the chunks that stayed free for a whole
+ * interval, oldest first.
+ */
+
+#include <unistd.h>
+
+#include "test.h"
+
+#define HEAP_SIZE     (16 * 1024 * 1024)
+#define BIG_ALLOC     (4 * 1024 * 1024)
+#define BIG_CHUNK     (256 * 1024)
+#define NUM_BIG       (S_HEAP_PURGE_BATCH + 4)
+#define PURGE_INTERVAL (32)
+#define NUM_TICKS     (3 * PURGE_INTERVAL)
+
+/**
+ * resident_pages() - Count the pages of a range that are in memory.
+ *
+ * @ptr: The start of the range.
+ * @len: The range size.
+ *
+ * Return: The number of resident pages of the whole pages in the range.
+ */
+static size_t resident_pages(void *ptr, size_t len)
+{
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  uintptr_t start = ((uintptr_t)ptr + page_size - 1) & ~(page_size - 1);
+  uintptr_t end = ((uintptr_t)ptr + len) & ~(page_size - 1);
+  static unsigned char vec[HEAP_SIZE / 4096];
+  size_t resident = 0;
+
+  CHECK((end - start) / page_size <= sizeof(vec));
+  CHECK(mincore((void *)start, end - start, vec) == 0);
+
+  for (size_t i = 0; i < (end - start) / page_size; i++)
+    resident += vec[i] & 1;
+
+  return resident;
+}
+
+static void test_trim(s_heap_mode_t mode)
+{
+  s_heap_config_t config = { .mode = mode, .zeroed = true };
+  uint8_t *region = test_region(HEAP_SIZE);
+  uint8_t *big, *guard, *ptr;
+  heap_t heap;
+
+  CHECK(s_init_ex(&heap, region, region + HEAP_SIZE, &config) == 0);
+
+  big = s_alloc(BIG_ALLOC, &heap);
+  guard = s_alloc(64, &heap);
+  CHECK(big != NULL && guard != NULL);
+  memset(big, 0x5a, BIG_ALLOC);
+  CHECK(resident_pages(big, BIG_ALLOC) > 0);
+
+  /* Nothing is freed yet, only the guard tail of the wilderness */
+
+  CHECK(s_heap_trim(&heap) < 2 * 4096);
+  CHECK(resident_pages(big, BIG_ALLOC) > 0);
+
+  s_free(big, &heap);
+  CHECK(s_heap_trim(&heap) >= BIG_ALLOC - 2 * 4096);
+  CHECK(resident_pages(big, BIG_ALLOC) == 0);
+  test_heap_check(&heap, true, NULL);
+
+  /* A second trim has nothing left to give back */
+
+  CHECK(s_heap_trim(&heap) == 0);
+
+  /* The purged chunk is still used and reads as zero, the request is a
+   * bit smaller for TLSF to find it after rounding up.
+   */
+
+  ptr = s_calloc(1, BIG_ALLOC / 2, &heap);
+  CHECK(ptr == big);
+  CHECK(test_is_zero(ptr, BIG_ALLOC / 2));
+  test_fill(ptr, BIG_ALLOC / 2, 9);
+  CHECK(test_verify(ptr, BIG_ALLOC / 2, 9));
+
+  /* The wilderness pages that were handed out are given back too, but
+   * the one that holds its header.
+   */
+
+  s_free(guard, &heap);
+  s_free(ptr, &heap);
+  CHECK(s_heap_trim(&heap) >= BIG_ALLOC);
+  CHECK(resident_pages(region, HEAP_SIZE / 2) <= 1);
+  test_heap_check(&heap, true, NULL);
+
+  s_heap_destroy(&heap);
+  munmap(region, HEAP_SIZE);
+}
+
+/**
+ * count_purged() - Count the chunks that have no resident page.
+ *
+ * @ptrs: The chunks.
+ * @first: The first chunk to look at.
+ * @num: The number of chunks.
+ *
+ * Return: The number of purged chunks.
+ */
+static int count_purged(uint8_t **ptrs, int first, int num)
+{
+  int purged = 0;
+
+  for (int i = first; i < first + num; i++)
+    purged += resident_pages(ptrs[i], BIG_CHUNK) == 0;
+
+  return purged;
+}
+
+static void test_auto_purge(s_heap_mode_t mode)
+{
+  s_heap_config_t config = {
+    .mode = mode,
+    .zeroed = true,
+    .purge_min = 64 * 1024,
+    .purge_interval = PURGE_INTERVAL,
+  };
+  uint8_t *region = test_region(HEAP_SIZE);
+  uint8_t *ptrs[NUM_BIG], *small[NUM_BIG];
+  uint8_t *ticks[NUM_TICKS], *guards[NUM_TICKS];
+  int tick = 0;
+  heap_t heap;
+
+  CHECK(s_init_ex(&heap, region, region + HEAP_SIZE, &config) == 0);
+
+  for (int i = 0; i < NUM_BIG; i++)
+  {
+    ptrs[i] = s_alloc(BIG_CHUNK, &heap);
+    small[i] = s_alloc(64, &heap);
+    CHECK(ptrs[i] != NULL && small[i] != NULL);
+    memset(ptrs[i], 0x77, BIG_CHUNK);
+  }
+
+  /* The releases of small chunks that merge with nothing count the time */
+
+  for (int i = 0; i < NUM_TICKS; i++)
+  {
+    ticks[i] = s_alloc(64, &heap);
+    guards[i] = s_alloc(64, &heap);
+    CHECK(ticks[i] != NULL && guards[i] != NULL);
+  }
+
+  for (int i = 0; i < NUM_BIG; i++)
+    s_free(ptrs[i], &heap);
+
+  /* The end of the first interval keeps the chunks freed during it */
+
+  while (tick < PURGE_INTERVAL - NUM_BIG)
+    s_free(ticks[tick++], &heap);
+  CHECK(count_purged(ptrs, 0, NUM_BIG) == 0);
+
+  /* The next one purges the oldest chunks, a batch per class */
+
+  while (tick < 2 * PURGE_INTERVAL - NUM_BIG)
+    s_free(ticks[tick++], &heap);
+  CHECK(count_purged(ptrs, 0, S_HEAP_PURGE_BATCH) == S_HEAP_PURGE_BATCH);
+  CHECK(count_purged(ptrs, S_HEAP_PURGE_BATCH,
+                     NUM_BIG - S_HEAP_PURGE_BATCH) == 0);
+
+  while (tick < 3 * PURGE_INTERVAL - NUM_BIG)
+    s_free(ticks[tick++], &heap);
+  CHECK(count_purged(ptrs, 0, NUM_BIG) == NUM_BIG);
+  test_heap_check(&heap, true, NULL);
+
+  for (int i = 0; i < NUM_BIG; i++)
+    s_free(small[i], &heap);
+  for (int i = 0; i < NUM_TICKS; i++)
+    s_free(guards[i], &heap);
+  test_heap_check(&heap, true, NULL);
+
+  s_heap_destroy(&heap);
+  munmap(region, HEAP_SIZE);
+}
+
+int main(void)
+{
+  TEST_FOR_EACH_MODE(mode)
+  {
+    test_trim(mode);
+    test_auto_purge(mode);
+  }
+
+  printf("test_purge: ok\n");
+  return 0;
+}
@@ -0,0 +1,230 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* The router serves a request from the bucket of its size, a bound
+ * belongs to the bucket below it, an exhausted bucket overflows to the next
+ * larger one, and free and realloc find the owning bucket by address, even
+ * in a segment the bucket added later.
+ */
+
+#include "test.h"
+#include "s_router.h"
+
+#define HEAP_SIZE     (256 * 1024)
+#define NUM_BUCKETS   (3)
+#define SMALL_MAX     (64)
+#define MEDIUM_MAX    (1024)
+#define NUM_PTRS      (8192)
+
+typedef struct {
+  s_router_t router;
+  heap_t heaps[NUM_BUCKETS];
+  uint8_t *regions[NUM_BUCKETS];
+} test_buckets_t;
+
+static void buckets_init(test_buckets_t *buckets, s_heap_mode_t mode)
+{
+  size_t max_len[NUM_BUCKETS - 1] = { SMALL_MAX, MEDIUM_MAX };
+  heap_t *heaps[NUM_BUCKETS];
+
+  for (int i = 0; i < NUM_BUCKETS; i++)
+  {
+    buckets->regions[i] = test_region(HEAP_SIZE);
+    s_init_mode(&buckets->heaps[i], buckets->regions[i],
+                buckets->regions[i] + HEAP_SIZE, mode);
+    heaps[i] = &buckets->heaps[i];
+  }
+
+  CHECK(s_router_init(&buckets->router, heaps, max_len, NUM_BUCKETS) == 0);
+}
+
+/* Every bucket walks clean and holds no used chunk */
+
+static void buckets_destroy(test_buckets_t *buckets)
+{
+  test_walk_t walk;
+
+  for (int i = 0; i < NUM_BUCKETS; i++)
+  {
+    test_heap_check(&buckets->heaps[i], true, &walk);
+    CHECK(walk.used_blocks == 0);
+
+    s_heap_destroy(&buckets->heaps[i]);
+    munmap(buckets->regions[i], HEAP_SIZE);
+  }
+}
+
+/* The bucket whose heap holds ptr, NUM_BUCKETS for none */
+
+static int bucket_of(test_buckets_t *buckets, void *ptr)
+{
+  int i;
+
+  for (i = 0; i < NUM_BUCKETS; i++)
+  {
+    if (s_heap_contains(&buckets->heaps[i], ptr))
+      break;
+  }
+
+  return i;
+}
+
+static void test_bounds(s_heap_mode_t mode)
+{
+  size_t lens[] = {
+    0, 1, SMALL_MAX, SMALL_MAX + 1, MEDIUM_MAX, MEDIUM_MAX + 1, 64 * 1024,
+  };
+  int owners[] = { 0, 0, 0, 1, 1, 2, 2 };
+  test_buckets_t buckets;
+
+  buckets_init(&buckets, mode);
+
+  for (int i = 0; i < (int)(sizeof(lens) / sizeof(lens[0])); i++)
+  {
+    void *ptr = s_router_alloc(lens[i], &buckets.router);
+
+    CHECK(ptr != NULL && bucket_of(&buckets, ptr) == owners[i]);
+    test_fill(ptr, lens[i], i);
+    CHECK(test_verify(ptr, lens[i], i));
+    s_router_free(ptr, &buckets.router);
+  }
+
+  s_router_free(NULL, &buckets.router);
+  CHECK(s_router_alloc(2 * HEAP_SIZE, &buckets.router) == NULL);
+
+  buckets_destroy(&buckets);
+}
+
+/* Fill the small bucket until it overflows to the medium one, then the
+ * medium one until it overflows to the large one. A new segment of the
+ * small bucket takes the requests back.
+ */
+
+static void test_overflow(s_heap_mode_t mode)
+{
+  static uint8_t *ptrs[NUM_PTRS];
+  uint8_t *extra = test_region(HEAP_SIZE);
+  int num = 0, owner = 0, first[NUM_BUCKETS];
+  test_buckets_t buckets;
+
+  buckets_init(&buckets, mode);
+  first[0] = 0;
+
+  while (owner < NUM_BUCKETS - 1)
+  {
+    CHECK(num < NUM_PTRS);
+    ptrs[num] = s_router_alloc(SMALL_MAX, &buckets.router);
+    CHECK(ptrs[num] != NULL);
+    test_fill(ptrs[num], SMALL_MAX, num);
+
+    /* Once a bucket is exhausted the next one serves every request */
+
+    CHECK(bucket_of(&buckets, ptrs[num]) >= owner);
+    if (bucket_of(&buckets, ptrs[num]) > owner)
+    {
+      owner = bucket_of(&buckets, ptrs[num]);
+      CHECK(owner == 1 || owner == 2);
+      first[owner] = num;
+    }
+
+    num++;
+  }
+
+  CHECK(first[1] > 0 && first[2] > first[1]);
+
+  ptrs[num] = s_router_alloc(MEDIUM_MAX, &buckets.router);
+  CHECK(ptrs[num] != NULL && bucket_of(&buckets, ptrs[num]) == 2);
+  s_router_free(ptrs[num], &buckets.router);
+
+  CHECK(s_heap_extend(&buckets.heaps[0], extra, extra + HEAP_SIZE) == 0);
+  ptrs[num] = s_router_alloc(SMALL_MAX, &buckets.router);
+  CHECK(ptrs[num] >= extra && ptrs[num] < extra + HEAP_SIZE);
+  test_fill(ptrs[num], SMALL_MAX, num);
+  num++;
+
+  /* Frees find the owner in the primary regions and in the new segment */
+
+  for (int i = 0; i < num; i++)
+  {
+    CHECK(test_verify(ptrs[i], SMALL_MAX, i));
+    s_router_free(ptrs[i], &buckets.router);
+  }
+
+  buckets_destroy(&buckets);
+  munmap(extra, HEAP_SIZE);
+}
+
+/* A chunk stays in its bucket while the new size belongs to it or to a
+ * smaller one and moves with its contents when it grows past the bucket.
+ */
+
+static void test_realloc(s_heap_mode_t mode)
+{
+  test_buckets_t buckets;
+  uint8_t *ptr, *moved;
+
+  buckets_init(&buckets, mode);
+
+  ptr = s_router_realloc(NULL, 32, &buckets.router);
+  CHECK(ptr != NULL && bucket_of(&buckets, ptr) == 0);
+  test_fill(ptr, 32, 1);
+
+  ptr = s_router_realloc(ptr, SMALL_MAX, &buckets.router);
+  CHECK(bucket_of(&buckets, ptr) == 0 && test_verify(ptr, 32, 1));
+  test_fill(ptr, SMALL_MAX, 2);
+
+  moved = s_router_realloc(ptr, SMALL_MAX + 1, &buckets.router);
+  CHECK(bucket_of(&buckets, moved) == 1 && test_verify(moved, SMALL_MAX, 2));
+  test_fill(moved, SMALL_MAX + 1, 3);
+
+  ptr = s_router_realloc(moved, MEDIUM_MAX + 1, &buckets.router);
+  CHECK(bucket_of(&buckets, ptr) == 2 &&
+        test_verify(ptr, SMALL_MAX + 1, 3));
+  test_fill(ptr, MEDIUM_MAX + 1, 4);
+
+  /* Shrinking never moves a chunk to a smaller bucket */
+
+  moved = s_router_realloc(ptr, 16, &buckets.router);
+  CHECK(moved == ptr && test_verify(moved, 16, 4));
+
+  CHECK(s_router_realloc(moved, 0, &buckets.router) == NULL);
+
+  /* A failed move leaves the chunk untouched */
+
+  ptr = s_router_alloc(100, &buckets.router);
+  test_fill(ptr, 100, 5);
+  CHECK(s_router_realloc(ptr, 2 * HEAP_SIZE, &buckets.router) == NULL);
+  CHECK(bucket_of(&buckets, ptr) == 1 && test_verify(ptr, 100, 5));
+  s_router_free(ptr, &buckets.router);
+
+  buckets_destroy(&buckets);
+}
+
+int main(void)
+{
+  TEST_FOR_EACH_MODE(mode)
+  {
+    test_bounds(mode);
+    test_overflow(mode);
+    test_realloc(mode);
+  }
+
+  printf("test_router: ok\n");
+  return 0;
+}
@@ -0,0 +1,94 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* s_usable_size reports every byte a chunk can hold, writing all of them
+ * leaves the neighbours intact, and s_free_sized releases a chunk with the
+ * requested size or any size up to its usable size.
+ */
+
+#include "test.h"
+
+#define HEAP_SIZE     (8 * 1024 * 1024)
+#define NUM_PTRS      (1024)
+
+static void test_sized(s_heap_mode_t mode, size_t block_size)
+{
+  s_heap_config_t config = { .mode = mode, .block_size = block_size };
+  uint8_t *region = test_region(HEAP_SIZE);
+  static uint8_t *ptrs[NUM_PTRS];
+  static size_t usable[NUM_PTRS];
+  uint64_t seed = 11;
+  test_walk_t walk;
+  heap_t heap;
+
+  CHECK(s_init_ex(&heap, region, region + HEAP_SIZE, &config) == 0);
+
+  for (int i = 0; i < NUM_PTRS; i++)
+  {
+    size_t len = test_rand(&seed) % 2048;
+
+    if (i % 4 == 0)
+    {
+      size_t align = (size_t)32 << (i / 4 % 6);
+
+      ptrs[i] = s_aligned_alloc(align, len, &heap);
+      CHECK(((uintptr_t)ptrs[i] & (align - 1)) == 0);
+    }
+    else
+      ptrs[i] = s_alloc(len, &heap);
+
+    CHECK(ptrs[i] != NULL);
+    usable[i] = s_usable_size(ptrs[i], &heap);
+    CHECK(usable[i] >= len);
+    CHECK(usable[i] < len + heap.block_size + heap.min_blocks *
+          heap.block_size);
+
+    /* The whole usable size belongs to the caller */
+
+    test_fill(ptrs[i], usable[i], i);
+  }
+
+  for (int i = 0; i < NUM_PTRS; i++)
+    CHECK(test_verify(ptrs[i], usable[i], i));
+  test_heap_check(&heap, true, NULL);
+
+  /* Any size from 0 to the usable size is accepted */
+
+  for (int i = 0; i < NUM_PTRS; i++)
+    s_free_sized(ptrs[i], i % 2 ? usable[i] : usable[i] / 3, &heap);
+
+  s_free_sized(NULL, 100, &heap);
+  test_heap_check(&heap, true, &walk);
+  CHECK(walk.used_blocks == 0);
+
+  s_heap_destroy(&heap);
+  munmap(region, HEAP_SIZE);
+}
+
+int main(void)
+{
+  TEST_FOR_EACH_MODE(mode)
+  {
+    test_sized(mode, 16);
+    test_sized(mode, 64);
+  }
+
+  printf("test_sized: ok\n");
+  return 0;
+}
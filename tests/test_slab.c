@@ -0,0 +1,304 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* On an ordinary heap every slab run is a plain chunk that straddles two
+ * run map windows. A run goes full and back to partial, its slots are found
+ * through the run map from both windows, pointers the runs do not own go to
+ * the heap, and s_slab_destroy gives every run and the run map back.
+ */
+
+#include "test.h"
+#include "s_slab.h"
+
+#define HEAP_SIZE     (1024 * 1024)
+#define SMALL_SIZE    (64 * 1024)
+#define NUM_OBJS      (4096)
+
+typedef struct {
+  heap_t heap;
+  s_slab_t slab;
+  uint8_t *region;
+} test_slab_t;
+
+static void slab_init(test_slab_t *test, size_t len, s_heap_mode_t mode)
+{
+  test->region = test_region(len);
+  s_init_mode(&test->heap, test->region, test->region + len, mode);
+  CHECK(s_slab_init(&test->slab, &test->heap) == 0);
+  CHECK(test->slab.run_map_base == (uintptr_t)test->heap.heap_mem_start);
+}
+
+/* Nothing is left on the heap once the slab is gone */
+
+static void slab_destroy(test_slab_t *test, size_t len)
+{
+  test_walk_t walk;
+
+  s_slab_destroy(&test->slab);
+  CHECK(test->slab.run_map == NULL);
+
+  test_heap_check(&test->heap, true, &walk);
+  CHECK(walk.used_blocks == 0);
+
+  s_heap_destroy(&test->heap);
+  munmap(test->region, len);
+}
+
+/* Fill the first run of the smallest class until it moves to the full
+ * list, a second run serves the next object, and a slot freed in the full
+ * run puts it back in front of the partial list.
+ */
+
+static void test_full_run(s_heap_mode_t mode)
+{
+  static uint8_t *objs[NUM_OBJS];
+  s_slab_class_t *class;
+  s_slab_stats_t stats;
+  s_slab_run_t *run;
+  test_slab_t test;
+  size_t slots;
+
+  slab_init(&test, HEAP_SIZE, mode);
+  class = &test.slab.classes[0];
+  slots = (S_SLAB_RUN_SIZE - S_SLAB_RUN_HDR_SIZE) / S_SLAB_QUANTUM;
+
+  for (size_t i = 0; i < slots; i++)
+  {
+    objs[i] = s_slab_alloc(S_SLAB_QUANTUM, &test.slab);
+    CHECK(objs[i] != NULL);
+    CHECK(i == 0 || objs[i] == objs[i - 1] + S_SLAB_QUANTUM);
+    test_fill(objs[i], S_SLAB_QUANTUM, i);
+  }
+
+  CHECK(list_empty(&class->partial_runs) && !list_empty(&class->full_runs));
+  run = list_entry(class->full_runs.next, s_slab_run_t, run_list);
+  CHECK(run->num_slots == slots && run->num_free == 0 && !run->in_block);
+  CHECK(objs[0] == run->slots);
+
+  /* A run is not aligned to its window, its last slots sit in the next
+   * one and are found from there.
+   */
+
+  CHECK(((uintptr_t)objs[0] >> S_SLAB_RUN_SHIFT) !=
+        ((uintptr_t)objs[slots - 1] >> S_SLAB_RUN_SHIFT));
+
+  objs[slots] = s_slab_alloc(1, &test.slab);
+  CHECK(objs[slots] < objs[0] || objs[slots] > objs[slots - 1]);
+  CHECK(class->num_runs == 2 && class->used_slots == slots + 1);
+
+  s_slab_free(objs[slots - 1], &test.slab);
+  CHECK(run->num_free == 1);
+  CHECK(class->partial_runs.next == &run->run_list);
+  CHECK(s_slab_alloc(S_SLAB_QUANTUM, &test.slab) == objs[slots - 1]);
+  CHECK(class->partial_runs.next != &run->run_list);
+
+  s_slab_free(objs[0], &test.slab);
+  CHECK(s_slab_alloc(S_SLAB_QUANTUM, &test.slab) == objs[0]);
+
+  for (size_t i = 0; i < slots - 1; i++)
+    CHECK(test_verify(objs[i], S_SLAB_QUANTUM, i));
+
+  /* Emptying both runs gives one back to the heap and keeps the other */
+
+  for (size_t i = 0; i <= slots; i++)
+    s_slab_free(objs[i], &test.slab);
+
+  s_slab_stats(&test.slab, &stats);
+  CHECK(stats.used_bytes == 0 && stats.num_runs == 1);
+  CHECK(stats.classes[0].num_runs == 1 &&
+        stats.classes[0].num_slots == slots);
+  test_heap_check(&test.heap, true, NULL);
+
+  slab_destroy(&test, HEAP_SIZE);
+}
+
+/* Objects of every size land in the slots of their class, larger ones and
+ * the ones served after the run map ran out are chunks of the heap.
+ */
+
+static void test_lookup(s_heap_mode_t mode)
+{
+  static uint8_t *objs[NUM_OBJS];
+  s_slab_stats_t stats;
+  uint8_t *extra = test_region(SMALL_SIZE);
+  test_slab_t test;
+  int num = 0;
+
+  slab_init(&test, SMALL_SIZE, mode);
+
+  for (size_t len = 0; len <= S_SLAB_MAX_SIZE + 1; len++)
+  {
+    objs[num] = s_slab_alloc(len, &test.slab);
+    CHECK(objs[num] != NULL);
+    test_fill(objs[num], len, num);
+    num++;
+  }
+
+  s_slab_stats(&test.slab, &stats);
+  CHECK(stats.num_runs == S_SLAB_NUM_CLASSES);
+  for (int i = 0; i < S_SLAB_NUM_CLASSES; i++)
+  {
+    size_t used = i == 0 ? S_SLAB_QUANTUM + 1 : S_SLAB_QUANTUM;
+
+    CHECK(stats.classes[i].slot_size == (i + 1) * S_SLAB_QUANTUM);
+    CHECK(stats.classes[i].used_slots == used);
+  }
+
+  /* The last object is too large for a slot and has a chunk header */
+
+  CHECK(s_heap_mask(s_heap_node(objs[num - 1])).used);
+  CHECK(s_heap_node(objs[num - 1])->magic == S_HEAP_MAGIC_USED);
+
+  /* Exhaust the heap, then a new segment serves objects that the run map
+   * does not cover.
+   */
+
+  while ((objs[num] = s_slab_alloc(S_SLAB_MAX_SIZE, &test.slab)) != NULL)
+  {
+    CHECK(num + 1 < NUM_OBJS);
+    test_fill(objs[num], S_SLAB_MAX_SIZE, num);
+    num++;
+  }
+
+  CHECK(s_heap_extend(&test.heap, extra, extra + SMALL_SIZE) == 0);
+  s_slab_stats(&test.slab, &stats);
+
+  objs[num] = s_slab_alloc(S_SLAB_MAX_SIZE, &test.slab);
+  CHECK(objs[num] >= extra && objs[num] < extra + SMALL_SIZE);
+  CHECK(test.slab.classes[S_SLAB_NUM_CLASSES - 1].used_slots ==
+        stats.classes[S_SLAB_NUM_CLASSES - 1].used_slots);
+  test_fill(objs[num], S_SLAB_MAX_SIZE, num);
+  num++;
+
+  for (int i = 0; i < num; i++)
+  {
+    size_t len = i <= S_SLAB_MAX_SIZE + 1 ? (size_t)i : S_SLAB_MAX_SIZE;
+
+    CHECK(test_verify(objs[i], len, i));
+    s_slab_free(objs[i], &test.slab);
+  }
+
+  s_slab_free(NULL, &test.slab);
+
+  s_slab_stats(&test.slab, &stats);
+  CHECK(stats.used_bytes == 0);
+  CHECK(stats.num_runs <= S_SLAB_NUM_CLASSES);
+  test_heap_check(&test.heap, true, NULL);
+
+  slab_destroy(&test, SMALL_SIZE);
+  munmap(extra, SMALL_SIZE);
+}
+
+/* A sized free of a slot goes through the run map, a sized free above the
+ * slab limit goes straight to the heap.
+ */
+
+static void test_free_sized(s_heap_mode_t mode)
+{
+  size_t lens[] = {
+    1, S_SLAB_QUANTUM, S_SLAB_QUANTUM + 1, S_SLAB_MAX_SIZE,
+    S_SLAB_MAX_SIZE + 1, S_SLAB_RUN_SIZE, 64 * 1024,
+  };
+  int num = sizeof(lens) / sizeof(lens[0]);
+  uint8_t *objs[sizeof(lens) / sizeof(lens[0])];
+  test_walk_t before, after;
+  s_slab_stats_t stats;
+  test_slab_t test;
+
+  slab_init(&test, HEAP_SIZE, mode);
+
+  /* Keep a slot in use in every class so that no run comes and goes */
+
+  for (int i = 0; i < S_SLAB_NUM_CLASSES; i++)
+    CHECK(s_slab_alloc((i + 1) * S_SLAB_QUANTUM, &test.slab) != NULL);
+  test_heap_check(&test.heap, true, &before);
+
+  for (int i = 0; i < num; i++)
+  {
+    objs[i] = s_slab_alloc(lens[i], &test.slab);
+    CHECK(objs[i] != NULL);
+    test_fill(objs[i], lens[i], i);
+  }
+
+  for (int i = num - 1; i >= 0; i--)
+  {
+    CHECK(test_verify(objs[i], lens[i], i));
+    s_slab_free_sized(objs[i], lens[i], &test.slab);
+  }
+
+  s_slab_free_sized(NULL, S_SLAB_MAX_SIZE, &test.slab);
+  s_slab_free_sized(NULL, S_SLAB_RUN_SIZE, &test.slab);
+
+  test_heap_check(&test.heap, true, &after);
+  CHECK(after.used_blocks == before.used_blocks);
+
+  s_slab_stats(&test.slab, &stats);
+  CHECK(stats.num_runs == S_SLAB_NUM_CLASSES);
+  CHECK(stats.used_bytes ==
+        S_SLAB_QUANTUM * S_SLAB_NUM_CLASSES * (S_SLAB_NUM_CLASSES + 1) / 2);
+
+  slab_destroy(&test, HEAP_SIZE);
+}
+
+/* Destroying a slab with objects still in use releases the partial and the
+ * full runs, and a new slab can be set up on the same heap.
+ */
+
+static void test_destroy(s_heap_mode_t mode)
+{
+  s_slab_stats_t stats;
+  test_slab_t test;
+
+  slab_init(&test, HEAP_SIZE, mode);
+
+  /* 64 objects per class fill the runs of the largest classes */
+
+  for (int round = 0; round < 2; round++)
+  {
+    for (size_t i = 0; i < 4 * S_SLAB_MAX_SIZE; i++)
+      CHECK(s_slab_alloc(1 + i % S_SLAB_MAX_SIZE, &test.slab) != NULL);
+
+    CHECK(!list_empty(&test.slab.classes[S_SLAB_NUM_CLASSES - 1].full_runs));
+    s_slab_stats(&test.slab, &stats);
+    CHECK(stats.num_runs > S_SLAB_NUM_CLASSES);
+    CHECK(stats.run_bytes == stats.num_runs * S_SLAB_RUN_SIZE);
+
+    s_slab_destroy(&test.slab);
+    s_slab_stats(&test.slab, &stats);
+    CHECK(stats.num_runs == 0 && stats.used_bytes == 0);
+
+    CHECK(s_slab_init(&test.slab, &test.heap) == 0);
+  }
+
+  slab_destroy(&test, HEAP_SIZE);
+}
+
+int main(void)
+{
+  TEST_FOR_EACH_MODE(mode)
+  {
+    test_full_run(mode);
+    test_lookup(mode);
+    test_free_sized(mode);
+    test_destroy(mode);
+  }
+
+  printf("test_slab: ok\n");
+  return 0;
+}
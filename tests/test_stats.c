@@ -0,0 +1,173 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* The running counters of s_heap_stats add up to what a walk of the
+ * segments finds, and the call counts match the calls that were made.
+ */
+
+#include "test.h"
+
+#define HEAP_SIZE     (8 * 1024 * 1024)
+#define NUM_PTRS      (2048)
+#define NUM_OPS       (100000)
+
+/**
+ * check_stats() - Compare the stats of a heap with a walk of it.
+ *
+ * @my_heap: The heap context.
+ * @allocs: The successful allocations made so far.
+ * @frees: The chunks released so far.
+ * @failed: The allocations that failed so far.
+ */
+static void check_stats(heap_t *my_heap, size_t allocs, size_t frees,
+                        size_t failed)
+{
+  size_t block_size = my_heap->block_size;
+  size_t hist_chunks = 0;
+  s_heap_stats_t stats;
+  test_walk_t walk;
+
+  test_heap_check(my_heap, true, &walk);
+  s_heap_stats(my_heap, &stats);
+
+  CHECK(stats.total_bytes == my_heap->num_blocks * block_size);
+  CHECK(stats.used_bytes + stats.free_bytes == stats.total_bytes);
+  CHECK(stats.used_bytes == walk.used_blocks * block_size);
+  CHECK(stats.free_bytes == walk.free_blocks * block_size);
+  CHECK(stats.free_chunks == walk.free_chunks);
+  CHECK(stats.wild_bytes == walk.wild_blocks * block_size);
+
+  CHECK(stats.largest_free == walk.largest_free * block_size);
+  CHECK(stats.largest_free >= stats.wild_bytes);
+
+  for (int cls = 0; cls < S_HEAP_FL_COUNT; cls++)
+    hist_chunks += stats.free_hist[cls];
+  CHECK(hist_chunks == stats.free_chunks);
+
+  CHECK(stats.alloc_count == allocs);
+  CHECK(stats.free_count == frees);
+  CHECK(stats.failed_count == failed);
+
+  if (stats.free_bytes != 0)
+    CHECK(stats.fragmentation ==
+          1000 - stats.largest_free * 1000 / stats.free_bytes);
+  CHECK(stats.fragmentation <= 1000);
+}
+
+static void test_stats(s_heap_mode_t mode)
+{
+  uint8_t *region = test_region(HEAP_SIZE);
+  static void *ptrs[NUM_PTRS];
+  size_t allocs = 0, frees = 0, failed = 0;
+  uint64_t seed = 5;
+  heap_t heap;
+
+  memset(ptrs, 0, sizeof(ptrs));
+  s_init_mode(&heap, region, region + HEAP_SIZE, mode);
+  check_stats(&heap, 0, 0, 0);
+
+  for (int op = 1; op <= NUM_OPS; op++)
+  {
+    uint64_t rnd = test_rand(&seed);
+    int i = rnd % NUM_PTRS;
+
+    if (ptrs[i] != NULL)
+    {
+      s_free(ptrs[i], &heap);
+      ptrs[i] = NULL;
+      frees++;
+    }
+    else
+    {
+      ptrs[i] = s_alloc(1 + (rnd >> 16) % 8192, &heap);
+      if (ptrs[i] != NULL)
+        allocs++;
+      else
+        failed++;
+    }
+
+    if (op % 10000 == 0)
+      check_stats(&heap, allocs, frees, failed);
+  }
+
+  CHECK(s_alloc(HEAP_SIZE, &heap) == NULL);
+  failed++;
+  check_stats(&heap, allocs, frees, failed);
+
+  for (int i = 0; i < NUM_PTRS; i++)
+  {
+    if (ptrs[i] != NULL)
+    {
+      s_free(ptrs[i], &heap);
+      frees++;
+    }
+  }
+
+  check_stats(&heap, allocs, frees, failed);
+
+  s_heap_destroy(&heap);
+  munmap(region, HEAP_SIZE);
+}
+
+/* Three free chunks of one bin with the largest one in the middle of the
+ * list, and a wilderness too small to hide them.
+ */
+
+static void test_largest(s_heap_mode_t mode)
+{
+  uint8_t *region = test_region(HEAP_SIZE);
+  size_t sizes[3] = { 400 * 1024, 410 * 1024, 404 * 1024 };
+  uint8_t *ptrs[3];
+  s_heap_stats_t stats;
+  heap_t heap;
+
+  s_init_mode(&heap, region, region + HEAP_SIZE, mode);
+
+  for (int i = 0; i < 3; i++)
+  {
+    ptrs[i] = s_alloc(sizes[i], &heap);
+    CHECK(ptrs[i] != NULL && s_alloc(64, &heap) != NULL);
+  }
+
+  while (s_alloc(4096, &heap) != NULL)
+    ;
+
+  for (int i = 0; i < 3; i++)
+    s_free(ptrs[i], &heap);
+
+  s_heap_stats(&heap, &stats);
+  CHECK(stats.largest_free == s_heap_node(ptrs[1])->mask.size *
+        heap.block_size);
+  check_stats(&heap, stats.alloc_count, 3, 1);
+
+  s_heap_destroy(&heap);
+  munmap(region, HEAP_SIZE);
+}
+
+int main(void)
+{
+  TEST_FOR_EACH_MODE(mode)
+  {
+    test_stats(mode);
+    test_largest(mode);
+  }
+
+  printf("test_stats: ok\n");
+  return 0;
+}
@@ -0,0 +1,231 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* The thread caches refill a magazine with a batch from the heap, flush
+ * half of it when it is full, give everything back on an explicit flush
+ * and when a thread exits, and take chunks freed by another thread.
+ */
+
+#include <pthread.h>
+
+#include "test.h"
+#include "s_tcache.h"
+
+#define HEAP_SIZE     (4 * 1024 * 1024)
+#define SMALL_LEN     (24)
+#define NUM_PTRS      (4 * S_TCACHE_MAG_SIZE)
+#define NUM_THREADS   (4)
+
+typedef struct {
+  s_tcache_heap_t *tc_heap;
+  void **ptrs;
+  int num;
+} worker_t;
+
+/**
+ * cached_chunks() - Count the small chunks that the heap sees as used but
+ * nobody holds.
+ *
+ * @tc_heap: The shared heap, no other thread may use it.
+ * @live: The small chunks the caller holds.
+ * @caches: The thread caches that are allocated.
+ *
+ * Return: The number of small chunks sitting in the magazines.
+ */
+static size_t cached_chunks(s_tcache_heap_t *tc_heap, size_t live,
+                            size_t caches)
+{
+  heap_t *my_heap = tc_heap->heap;
+  size_t blocks = s_heap_len_to_blocks(my_heap, SMALL_LEN);
+  size_t cache_blocks = s_heap_len_to_blocks(my_heap, sizeof(s_tcache_t));
+  size_t used;
+  test_walk_t walk;
+
+  test_heap_check(my_heap, true, &walk);
+  used = walk.used_blocks - caches * cache_blocks;
+  CHECK(used % blocks == 0 && used / blocks >= live);
+  return used / blocks - live;
+}
+
+/* Refill on the first allocation, no heap call until the magazine is
+ * empty, flushes that keep it bounded and an explicit flush.
+ */
+
+static void test_magazine(s_heap_mode_t mode)
+{
+  uint8_t *region = test_region(HEAP_SIZE);
+  void *ptrs[NUM_PTRS];
+  s_tcache_heap_t tc_heap;
+  size_t cached;
+  heap_t heap;
+
+  s_init_mode(&heap, region, region + HEAP_SIZE, mode);
+  CHECK(s_tcache_init(&tc_heap, &heap) == 0);
+  CHECK(s_heap_len_to_blocks(&heap, SMALL_LEN) - heap.min_blocks <
+        S_TCACHE_NUM_CLASSES);
+
+  ptrs[0] = s_tcache_alloc(SMALL_LEN, &tc_heap);
+  CHECK(ptrs[0] != NULL);
+  CHECK(cached_chunks(&tc_heap, 1, 1) == S_TCACHE_BATCH - 1);
+
+  for (int i = 1; i < S_TCACHE_BATCH; i++)
+  {
+    ptrs[i] = s_tcache_alloc(SMALL_LEN, &tc_heap);
+    CHECK(ptrs[i] != NULL);
+  }
+
+  CHECK(cached_chunks(&tc_heap, S_TCACHE_BATCH, 1) == 0);
+
+  for (int i = S_TCACHE_BATCH; i < NUM_PTRS; i++)
+  {
+    ptrs[i] = s_tcache_alloc(SMALL_LEN, &tc_heap);
+    CHECK(ptrs[i] != NULL);
+    test_fill(ptrs[i], SMALL_LEN, i);
+  }
+
+  /* Every full magazine sends a batch back, the rest stays cached */
+
+  for (int i = 0; i < NUM_PTRS; i++)
+    s_tcache_free(ptrs[i], &tc_heap);
+
+  cached = cached_chunks(&tc_heap, 0, 1);
+  CHECK(cached > S_TCACHE_MAG_SIZE - S_TCACHE_BATCH);
+  CHECK(cached <= S_TCACHE_MAG_SIZE);
+
+  /* Cached chunks are handed out again before the heap is asked */
+
+  for (int i = 0; i < (int)cached; i++)
+    CHECK(s_tcache_alloc(SMALL_LEN, &tc_heap) != NULL);
+  CHECK(cached_chunks(&tc_heap, cached, 1) == 0);
+
+  /* Large chunks bypass the cache, realloc keeps the contents */
+
+  ptrs[0] = s_tcache_alloc(4096, &tc_heap);
+  CHECK(ptrs[0] != NULL);
+  test_fill(ptrs[0], 4096, 1);
+  ptrs[0] = s_tcache_realloc(ptrs[0], 8192, &tc_heap);
+  CHECK(ptrs[0] != NULL && test_verify(ptrs[0], 4096, 1));
+  s_tcache_free(ptrs[0], &tc_heap);
+
+  s_tcache_flush(&tc_heap);
+  CHECK(cached_chunks(&tc_heap, cached, 0) == 0);
+
+  s_tcache_destroy(&tc_heap);
+  s_heap_destroy(&heap);
+  munmap(region, HEAP_SIZE);
+}
+
+/* Allocate and fill chunks, keep them when ptrs is set */
+
+static void *alloc_worker(void *arg)
+{
+  worker_t *worker = arg;
+  void *ptr;
+
+  for (int i = 0; i < worker->num; i++)
+  {
+    ptr = s_tcache_alloc(SMALL_LEN + i % 64, worker->tc_heap);
+    CHECK(ptr != NULL);
+    test_fill(ptr, SMALL_LEN + i % 64, i);
+
+    if (worker->ptrs != NULL)
+      worker->ptrs[i] = ptr;
+    else
+      s_tcache_free(ptr, worker->tc_heap);
+  }
+
+  return NULL;
+}
+
+/* Check and release the chunks of another thread */
+
+static void *free_worker(void *arg)
+{
+  worker_t *worker = arg;
+
+  for (int i = 0; i < worker->num; i++)
+  {
+    CHECK(test_verify(worker->ptrs[i], SMALL_LEN + i % 64, i));
+    s_tcache_free(worker->ptrs[i], worker->tc_heap);
+  }
+
+  return NULL;
+}
+
+/* Threads exit without a flush, their caches go back on their own */
+
+static void test_threads(s_heap_mode_t mode)
+{
+  uint8_t *region = test_region(HEAP_SIZE);
+  static void *ptrs[NUM_THREADS][NUM_PTRS];
+  worker_t workers[NUM_THREADS];
+  pthread_t threads[NUM_THREADS];
+  s_tcache_heap_t tc_heap;
+  heap_t heap;
+
+  s_init_mode(&heap, region, region + HEAP_SIZE, mode);
+  CHECK(s_tcache_init(&tc_heap, &heap) == 0);
+
+  for (int i = 0; i < NUM_THREADS; i++)
+  {
+    workers[i] = (worker_t) { &tc_heap, NULL, 10000 };
+    CHECK(pthread_create(&threads[i], NULL, alloc_worker, &workers[i]) == 0);
+  }
+
+  for (int i = 0; i < NUM_THREADS; i++)
+    pthread_join(threads[i], NULL);
+  CHECK(cached_chunks(&tc_heap, 0, 0) == 0);
+
+  /* Chunks allocated by one thread and freed by the next one */
+
+  for (int i = 0; i < NUM_THREADS; i++)
+  {
+    workers[i] = (worker_t) { &tc_heap, ptrs[i], NUM_PTRS };
+    CHECK(pthread_create(&threads[i], NULL, alloc_worker, &workers[i]) == 0);
+  }
+
+  for (int i = 0; i < NUM_THREADS; i++)
+    pthread_join(threads[i], NULL);
+
+  for (int i = 0; i < NUM_THREADS; i++)
+  {
+    workers[i].ptrs = ptrs[(i + 1) % NUM_THREADS];
+    CHECK(pthread_create(&threads[i], NULL, free_worker, &workers[i]) == 0);
+  }
+
+  for (int i = 0; i < NUM_THREADS; i++)
+    pthread_join(threads[i], NULL);
+  CHECK(cached_chunks(&tc_heap, 0, 0) == 0);
+
+  s_tcache_destroy(&tc_heap);
+  s_heap_destroy(&heap);
+  munmap(region, HEAP_SIZE);
+}
+
+int main(void)
+{
+  TEST_FOR_EACH_MODE(mode)
+  {
+    test_magazine(mode);
+    test_threads(mode);
+  }
+
+  printf("test_tcache: ok\n");
+  return 0;
+}
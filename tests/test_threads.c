@@ -0,0 +1,208 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Several threads allocate, resize and release chunks of the same size
+ * classes on one thread-safe heap, then release the chunks of another
+ * thread. Every chunk keeps its contents and the heap walks clean.
+ */
+
+#include <pthread.h>
+
+#include "test.h"
+
+#define HEAP_SIZE     (16 * 1024 * 1024)
+#define GROW_SIZE     (4 * 1024 * 1024)
+#define NUM_THREADS   (8)
+#define NUM_SLOTS     (256)
+#define NUM_OPS       (20000)
+#define BATCH         (16)
+
+typedef struct {
+  heap_t *heap;
+  pthread_barrier_t *barrier;
+  uint64_t seed;
+  void *ptrs[NUM_SLOTS];
+  size_t lens[NUM_SLOTS];
+  uint8_t seeds[NUM_SLOTS];
+} worker_t;
+
+static worker_t g_workers[NUM_THREADS];
+
+/* Mostly small sizes that all threads share, a few larger ones */
+
+static size_t rand_len(uint64_t *seed)
+{
+  uint64_t rnd = test_rand(seed);
+
+  if (rnd % 64 == 0)
+    return 1 + (rnd >> 8) % (64 * 1024);
+
+  return 1 + (rnd >> 8) % 512;
+}
+
+static void release(worker_t *worker, int slot)
+{
+  CHECK(test_verify(worker->ptrs[slot], worker->lens[slot],
+                    worker->seeds[slot]));
+  s_free(worker->ptrs[slot], worker->heap);
+  worker->ptrs[slot] = NULL;
+}
+
+static void *worker_run(void *arg)
+{
+  worker_t *worker = arg;
+  heap_t *heap = worker->heap;
+  void *batch[BATCH];
+  size_t sizes[BATCH];
+
+  for (int op = 0; op < NUM_OPS; op++)
+  {
+    uint64_t rnd = test_rand(&worker->seed);
+    int slot = rnd % NUM_SLOTS;
+    size_t len = rand_len(&worker->seed);
+    uint8_t *ptr;
+
+    if (worker->ptrs[slot] != NULL && (rnd >> 32) % 3 == 0)
+    {
+      /* Resize, the common part has to survive */
+
+      size_t keep = len < worker->lens[slot] ? len : worker->lens[slot];
+
+      ptr = s_realloc(worker->ptrs[slot], len, heap);
+      CHECK(ptr != NULL);
+      CHECK(test_verify(ptr, keep, worker->seeds[slot]));
+    }
+    else if (worker->ptrs[slot] != NULL)
+    {
+      release(worker, slot);
+      continue;
+    }
+    else if ((rnd >> 32) % 16 == 0)
+    {
+      /* A burst released in one call */
+
+      for (int i = 0; i < BATCH; i++)
+        sizes[i] = rand_len(&worker->seed);
+
+      CHECK(s_alloc_batch(BATCH, sizes, batch, heap) == 0);
+      for (int i = 0; i < BATCH; i++)
+        test_fill(batch[i], sizes[i], i);
+      for (int i = 0; i < BATCH; i++)
+        CHECK(test_verify(batch[i], sizes[i], i));
+
+      s_free_batch(batch, BATCH, heap);
+      continue;
+    }
+    else if ((rnd >> 32) % 16 == 1)
+    {
+      ptr = s_aligned_alloc(256, len, heap);
+      CHECK(ptr != NULL && ((uintptr_t)ptr & 255) == 0);
+    }
+    else if ((rnd >> 32) % 16 == 2)
+    {
+      ptr = s_calloc(1, len, heap);
+      CHECK(ptr != NULL && test_is_zero(ptr, len));
+    }
+    else
+    {
+      ptr = s_alloc(len, heap);
+      CHECK(ptr != NULL);
+    }
+
+    worker->ptrs[slot] = ptr;
+    worker->lens[slot] = len;
+    worker->seeds[slot] = (uint8_t)rnd;
+    test_fill(ptr, len, (uint8_t)rnd);
+  }
+
+  /* Release what the next thread left, while it releases ours */
+
+  pthread_barrier_wait(worker->barrier);
+
+  worker = &g_workers[(worker - g_workers + 1) % NUM_THREADS];
+  for (int slot = 0; slot < NUM_SLOTS; slot++)
+  {
+    if (worker->ptrs[slot] != NULL)
+      release(worker, slot);
+  }
+
+  return NULL;
+}
+
+static void test_threads(const s_heap_config_t *config, size_t heap_size)
+{
+  uint8_t *region = test_region(heap_size);
+  pthread_t threads[NUM_THREADS];
+  pthread_barrier_t barrier;
+  test_walk_t walk;
+  heap_t heap;
+
+  CHECK(s_init_ex(&heap, region, region + heap_size, config) == 0);
+  CHECK(s_heap_set_thread_safe(&heap) == 0);
+  CHECK(pthread_barrier_init(&barrier, NULL, NUM_THREADS) == 0);
+
+  memset(g_workers, 0, sizeof(g_workers));
+  for (int i = 0; i < NUM_THREADS; i++)
+  {
+    g_workers[i].heap = &heap;
+    g_workers[i].barrier = &barrier;
+    g_workers[i].seed = i + 1;
+    CHECK(pthread_create(&threads[i], NULL, worker_run, &g_workers[i]) == 0);
+  }
+
+  for (int i = 0; i < NUM_THREADS; i++)
+    pthread_join(threads[i], NULL);
+
+  test_heap_check(&heap, !config->defer_coalescing, &walk);
+  CHECK(walk.used_blocks == 0);
+
+  if (config->defer_coalescing)
+  {
+    s_heap_compact_free(&heap);
+    test_heap_check(&heap, true, &walk);
+    CHECK(walk.used_blocks == 0);
+  }
+
+  pthread_barrier_destroy(&barrier);
+  s_heap_destroy(&heap);
+  munmap(region, heap_size);
+}
+
+int main(void)
+{
+  TEST_FOR_EACH_MODE(mode)
+  {
+    s_heap_config_t plain = { .mode = mode };
+    s_heap_config_t grow = {
+      .mode = mode,
+      .grow_size = GROW_SIZE,
+      .purge_min = 64 * 1024,
+    };
+    s_heap_config_t deferred = { .mode = mode, .defer_coalescing = true };
+
+    /* The small region makes the threads map segments concurrently */
+
+    test_threads(&plain, HEAP_SIZE);
+    test_threads(&grow, HEAP_SIZE / 64);
+    test_threads(&deferred, HEAP_SIZE);
+  }
+
+  printf("test_threads: ok\n");
+  return 0;
+}
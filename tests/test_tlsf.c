@@ -0,0 +1,250 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* The TLSF engine maps every size to the class that holds it, rounds a
+ * request up to the next class so the head of any bin it finds fits, finds
+ * that bin through the two bitmaps, and files the rest of a split and the
+ * result of a merge under their new classes.
+ */
+
+#include "test.h"
+
+#define HEAP_SIZE     (4 * 1024 * 1024)
+#define MAX_BLOCKS    (1U << 20)
+
+/* Layout of the heap: a used guard after every chunk so that only the
+ * chunks a test frees can merge.
+ */
+
+enum {
+  CHUNK_A,                    /* 100 blocks, class (3, 9) */
+  CHUNK_B,                    /* 100 blocks, right after CHUNK_A */
+  CHUNK_C,                    /* 103 blocks, class (3, 9) */
+  CHUNK_D,                    /* 300 blocks, class (5, 2) */
+  CHUNK_E,                    /* 5000 blocks, class (9, 3) */
+  NUM_CHUNKS,
+};
+
+static const size_t g_blocks[NUM_CHUNKS] = { 100, 100, 103, 300, 5000 };
+
+typedef struct {
+  heap_t heap;
+  uint8_t *region;
+  uint8_t *ptrs[NUM_CHUNKS];
+} test_tlsf_t;
+
+/* The payload length that needs exactly a number of blocks */
+
+static size_t blocks_len(heap_t *my_heap, size_t blocks)
+{
+  size_t len = blocks * my_heap->block_size - S_HEAP_HDR_SIZE;
+
+  CHECK(s_heap_len_to_blocks(my_heap, len) == blocks);
+  return len;
+}
+
+static bool bin_used(heap_t *my_heap, unsigned int fl, unsigned int sl)
+{
+  bool used = (my_heap->sl_bitmap[fl] >> sl) & 1;
+
+  CHECK(((my_heap->free_bins_bitmap >> fl) & 1) ==
+        (my_heap->sl_bitmap[fl] != 0));
+  CHECK(used == !list_empty(&my_heap->g_free_bins[fl][sl]));
+  return used;
+}
+
+static void layout_init(test_tlsf_t *test)
+{
+  heap_t *my_heap = &test->heap;
+
+  test->region = test_region(HEAP_SIZE);
+  s_init_mode(my_heap, test->region, test->region + HEAP_SIZE,
+              S_HEAP_MODE_TLSF);
+
+  for (int i = 0; i < NUM_CHUNKS; i++)
+  {
+    test->ptrs[i] = s_alloc(blocks_len(my_heap, g_blocks[i]), my_heap);
+    CHECK(test->ptrs[i] != NULL);
+    if (i != CHUNK_A)
+      CHECK(s_alloc(1, my_heap) != NULL);
+  }
+
+  CHECK(my_heap->free_bins_bitmap == 0);
+}
+
+static void layout_destroy(test_tlsf_t *test)
+{
+  test_heap_check(&test->heap, true, NULL);
+  s_heap_destroy(&test->heap);
+  munmap(test->region, HEAP_SIZE);
+}
+
+/* Every size lies inside the bounds of its class and the classes follow
+ * the sizes in order.
+ */
+
+static void test_mapping(void)
+{
+  unsigned int fl, sl, prev_fl = 0, prev_sl = 0;
+  size_t low, width;
+  heap_t heap;
+
+  heap.mode = S_HEAP_MODE_TLSF;
+
+  for (size_t size = 1; size < MAX_BLOCKS; size++)
+  {
+    s_bin_mapping(&heap, size, &fl, &sl);
+    CHECK(fl < S_HEAP_FL_COUNT && sl < S_HEAP_SL_COUNT);
+
+    if (fl == 0)
+    {
+      low = sl;
+      width = 1;
+    }
+    else
+    {
+      low = (size_t)(S_HEAP_SL_COUNT + sl) << (fl - 1);
+      width = (size_t)1 << (fl - 1);
+    }
+
+    CHECK(low <= size && size < low + width);
+
+    if (fl != prev_fl)
+      CHECK(fl == prev_fl + 1 && sl == 0);
+    else
+      CHECK(sl == prev_sl || sl == prev_sl + 1);
+
+    prev_fl = fl;
+    prev_sl = sl;
+  }
+
+  s_bin_mapping(&heap, 100, &fl, &sl);
+  CHECK(fl == 3 && sl == 9);
+  s_bin_mapping(&heap, 5000, &fl, &sl);
+  CHECK(fl == 9 && sl == 3);
+}
+
+/* A request is served from the next class up even when a chunk of its own
+ * class would fit, and the rest of the split is filed under its size.
+ */
+
+static void test_good_fit(void)
+{
+  test_tlsf_t test;
+  heap_t *my_heap = &test.heap;
+  uint8_t *ptr;
+
+  layout_init(&test);
+
+  s_free(test.ptrs[CHUNK_C], my_heap);
+  s_free(test.ptrs[CHUNK_D], my_heap);
+  CHECK(bin_used(my_heap, 3, 9) && bin_used(my_heap, 5, 2));
+
+  /* 101 blocks round up to class (3, 10): the 103 blocks chunk is skipped
+   * for the 300 blocks one, its 199 blocks rest goes to class (4, 8).
+   */
+
+  ptr = s_alloc(blocks_len(my_heap, 101), my_heap);
+  CHECK(ptr == test.ptrs[CHUNK_D]);
+  CHECK(!bin_used(my_heap, 5, 2) && bin_used(my_heap, 4, 8));
+  CHECK(s_heap_node(ptr + 101 * my_heap->block_size)->mask.size == 199);
+  test_heap_check(my_heap, true, NULL);
+
+  /* 100 blocks round up to 103, the head of class (3, 9) */
+
+  ptr = s_alloc(blocks_len(my_heap, 100), my_heap);
+  CHECK(ptr == test.ptrs[CHUNK_C]);
+  CHECK(!bin_used(my_heap, 3, 9));
+  CHECK(my_heap->sl_bitmap[3] == 0);
+
+  layout_destroy(&test);
+}
+
+/* An empty class and an empty first level are both skipped by the bitmap
+ * search, the rest of the chunk stays in its class.
+ */
+
+static void test_search(void)
+{
+  test_tlsf_t test;
+  heap_t *my_heap = &test.heap;
+  uint8_t *ptr;
+
+  layout_init(&test);
+
+  s_free(test.ptrs[CHUNK_E], my_heap);
+  CHECK(my_heap->free_bins_bitmap == 1U << 9);
+  CHECK(my_heap->sl_bitmap[9] == 1U << 3);
+
+  ptr = s_alloc(blocks_len(my_heap, 20), my_heap);
+  CHECK(ptr == test.ptrs[CHUNK_E]);
+  CHECK(my_heap->free_bins_bitmap == 1U << 9);
+  CHECK(my_heap->sl_bitmap[9] == 1U << 3);
+  s_free(ptr, my_heap);
+
+  /* Above the largest free chunk there is nothing, the wilderness serves */
+
+  ptr = s_alloc(blocks_len(my_heap, 5001), my_heap);
+  CHECK(ptr != NULL && ptr > test.ptrs[CHUNK_E]);
+  CHECK(my_heap->free_bins_bitmap == 1U << 9);
+  s_free(ptr, my_heap);
+
+  layout_destroy(&test);
+}
+
+/* Two neighbours freed in either order leave their class for the class of
+ * the merged chunk.
+ */
+
+static void test_merge(void)
+{
+  test_tlsf_t test;
+  heap_t *my_heap = &test.heap;
+
+  for (int order = 0; order < 2; order++)
+  {
+    layout_init(&test);
+
+    s_free(test.ptrs[order ? CHUNK_B : CHUNK_A], my_heap);
+    CHECK(bin_used(my_heap, 3, 9));
+
+    s_free(test.ptrs[order ? CHUNK_A : CHUNK_B], my_heap);
+    CHECK(!bin_used(my_heap, 3, 9) && bin_used(my_heap, 4, 9));
+    CHECK(s_heap_node(test.ptrs[CHUNK_A])->mask.size == 200);
+    CHECK(my_heap->free_bins_bitmap == 1U << 4);
+
+    /* The merged chunk serves a request of its whole size */
+
+    CHECK(s_alloc(blocks_len(my_heap, 200), my_heap) == test.ptrs[CHUNK_A]);
+    CHECK(my_heap->free_bins_bitmap == 0);
+
+    layout_destroy(&test);
+  }
+}
+
+int main(void)
+{
+  test_mapping();
+  test_good_fit();
+  test_search();
+  test_merge();
+
+  printf("test_tlsf: ok\n");
+  return 0;
+}
@@ -0,0 +1,174 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Built with -DS_HEAP_TRACE a traced heap writes one record per outer
+ * call with the chunk, the size and the argument of the call, in the
+ * order of the calls. Without it s_heap_trace_start fails and creates
+ * no file.
+ */
+
+#include <unistd.h>
+
+#include "test.h"
+
+#define HEAP_SIZE     (8 * 1024 * 1024)
+#define NUM_PAIRS     (5000)
+#define MAX_RECS      (2 * NUM_PAIRS + 64)
+
+typedef struct {
+  s_heap_op_t op;
+  size_t size;
+  void *ptr;
+  uintptr_t arg;
+} expect_t;
+
+static expect_t g_expect[MAX_RECS];
+static size_t g_num_expect;
+
+static void expect(s_heap_op_t op, size_t size, void *ptr, uintptr_t arg)
+{
+  CHECK(g_num_expect < MAX_RECS);
+  g_expect[g_num_expect++] = (expect_t) { op, size, ptr, arg };
+}
+
+/**
+ * check_trace() - Compare a trace file with the expected records.
+ *
+ * @path: The trace file.
+ */
+static void check_trace(const char *path)
+{
+  static s_heap_trace_rec_t recs[MAX_RECS + 1];
+  s_heap_trace_hdr_t hdr;
+  FILE *file = fopen(path, "rb");
+  size_t num;
+
+  CHECK(file != NULL);
+  CHECK(fread(&hdr, sizeof(hdr), 1, file) == 1);
+  CHECK(hdr.magic == S_HEAP_TRACE_MAGIC);
+  CHECK(hdr.version == S_HEAP_TRACE_VERSION);
+  CHECK(hdr.rec_size == sizeof(s_heap_trace_rec_t));
+
+  num = fread(recs, sizeof(recs[0]), MAX_RECS + 1, file);
+  fclose(file);
+  CHECK(num == g_num_expect);
+
+  for (size_t i = 0; i < num; i++)
+  {
+    CHECK(recs[i].op == g_expect[i].op);
+    CHECK(recs[i].size == g_expect[i].size);
+    CHECK(recs[i].ptr == (uintptr_t)g_expect[i].ptr);
+    CHECK(recs[i].arg == g_expect[i].arg);
+    CHECK(i == 0 || recs[i].time_ns >= recs[i - 1].time_ns);
+  }
+}
+
+static void test_trace(s_heap_mode_t mode, const char *path)
+{
+  uint8_t *region = test_region(HEAP_SIZE);
+  size_t sizes[3] = { 10, 20, 30 };
+  void *a, *b, *c, *old, *batch[3];
+  heap_t heap;
+
+  s_init_mode(&heap, region, region + HEAP_SIZE, mode);
+  g_num_expect = 0;
+  unlink(path);
+
+#ifdef S_HEAP_TRACE
+  CHECK(s_heap_trace_start(&heap, path) == 0);
+  CHECK(s_heap_trace_start(&heap, path) == -1);
+
+  a = s_alloc(100, &heap);
+  expect(S_HEAP_OP_ALLOC, 100, a, 0);
+  b = s_aligned_alloc(256, 50, &heap);
+  expect(S_HEAP_OP_ALIGNED_ALLOC, 50, b, 256);
+  c = s_calloc(4, 25, &heap);
+  expect(S_HEAP_OP_CALLOC, 100, c, 0);
+
+  /* Only the outer call is logged, not the s_alloc and s_free inside */
+
+  old = a;
+  a = s_realloc(a, 5000, &heap);
+  expect(S_HEAP_OP_REALLOC, 5000, a, (uintptr_t)old);
+
+  s_free(b, &heap);
+  expect(S_HEAP_OP_FREE, 0, b, 0);
+
+  CHECK(s_alloc_batch(3, sizes, batch, &heap) == 0);
+  for (int i = 0; i < 3; i++)
+    expect(S_HEAP_OP_ALLOC, sizes[i], batch[i], 0);
+
+  s_free_batch(batch, 3, &heap);
+  for (int i = 0; i < 3; i++)
+    expect(S_HEAP_OP_FREE, 0, batch[i], 0);
+
+  /* A failed call is not logged, a s_realloc to 0 is a release */
+
+  CHECK(s_alloc(2 * HEAP_SIZE, &heap) == NULL);
+  CHECK(s_realloc(c, 0, &heap) == NULL);
+  expect(S_HEAP_OP_FREE, 0, c, 0);
+
+  /* More records than fit in one batch of the buffer */
+
+  for (int i = 0; i < NUM_PAIRS; i++)
+  {
+    b = s_alloc(16 + i % 512, &heap);
+    expect(S_HEAP_OP_ALLOC, 16 + i % 512, b, 0);
+    s_free_sized(b, 16 + i % 512, &heap);
+    expect(S_HEAP_OP_FREE, 0, b, 0);
+  }
+
+  s_free(a, &heap);
+  expect(S_HEAP_OP_FREE, 0, a, 0);
+
+  CHECK(s_heap_trace_stop(&heap) == 0);
+  CHECK(s_heap_trace_stop(&heap) == -1);
+
+  /* Calls made after the stop are not logged */
+
+  s_free(s_alloc(10, &heap), &heap);
+  check_trace(path);
+  unlink(path);
+#else
+  (void)sizes, (void)a, (void)b, (void)c, (void)old, (void)batch;
+
+  CHECK(s_heap_trace_start(&heap, path) == -1);
+  CHECK(access(path, F_OK) != 0);
+  CHECK(s_heap_trace_stop(&heap) == -1);
+  (void)check_trace;
+  (void)expect;
+#endif
+
+  test_heap_check(&heap, true, NULL);
+  s_heap_destroy(&heap);
+  munmap(region, HEAP_SIZE);
+}
+
+int main(void)
+{
+  char path[64];
+
+  snprintf(path, sizeof(path), "/tmp/test_trace.%d", (int)getpid());
+
+  TEST_FOR_EACH_MODE(mode)
+    test_trace(mode, path);
+
+  printf("test_trace: ok\n");
+  return 0;
+}
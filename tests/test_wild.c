@@ -0,0 +1,133 @@
+/*
+ * This file is part of the CatOS distribution https://github.com/catos.
+ *
+ * Copyright (c) 2018 Sebastian Ene.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* The wilderness hands out chunks one after the other, takes back the
+ * chunks freed next to it and s_realloc keeps the contents of a chunk
+ * whether it grows in place, shrinks or moves.
+ */
+
+#include "test.h"
+
+#define HEAP_SIZE     (8 * 1024 * 1024)
+#define NUM_PTRS      (64)
+
+static void test_bump(s_heap_mode_t mode)
+{
+  uint8_t *region = test_region(HEAP_SIZE);
+  uint8_t *ptrs[NUM_PTRS];
+  test_walk_t walk;
+  heap_t heap;
+
+  s_init_mode(&heap, region, region + HEAP_SIZE, mode);
+  test_heap_check(&heap, true, &walk);
+  CHECK(walk.wild_blocks == heap.num_blocks);
+
+  /* Nothing is in the bins, every chunk is cut right after the last one */
+
+  for (int i = 0; i < NUM_PTRS; i++)
+  {
+    ptrs[i] = s_alloc(100, &heap);
+    CHECK(ptrs[i] != NULL);
+    if (i > 0)
+      CHECK(ptrs[i] - ptrs[i - 1] == (ptrdiff_t)s_usable_size(ptrs[i - 1],
+                                                              &heap) +
+            (ptrdiff_t)S_HEAP_HDR_SIZE);
+  }
+
+  test_heap_check(&heap, true, &walk);
+  CHECK(walk.free_chunks == 0);
+
+  /* Freed from the end, the chunks go back to the wilderness */
+
+  for (int i = NUM_PTRS - 1; i >= NUM_PTRS / 2; i--)
+    s_free(ptrs[i], &heap);
+
+  test_heap_check(&heap, true, &walk);
+  CHECK(walk.free_chunks == 0);
+  CHECK(s_alloc(100, &heap) == ptrs[NUM_PTRS / 2]);
+
+  s_heap_destroy(&heap);
+  munmap(region, HEAP_SIZE);
+}
+
+static void test_realloc(s_heap_mode_t mode)
+{
+  uint8_t *region = test_region(HEAP_SIZE);
+  uint8_t *a, *b, *c, *guard, *ptr;
+  heap_t heap;
+
+  s_init_mode(&heap, region, region + HEAP_SIZE, mode);
+
+  /* Grows in place into the wilderness */
+
+  a = s_alloc(200, &heap);
+  test_fill(a, 200, 1);
+  ptr = s_realloc(a, 4000, &heap);
+  CHECK(ptr == a);
+  CHECK(test_verify(ptr, 200, 1));
+
+  /* Grows in place into a free neighbour */
+
+  guard = s_alloc(64, &heap);
+  b = s_alloc(5000, &heap);
+  c = s_alloc(64, &heap);
+  CHECK(guard != NULL && b != NULL && c != NULL);
+  s_free(guard, &heap);
+  test_fill(a, 4000, 2);
+  ptr = s_realloc(a, 4050, &heap);
+  CHECK(ptr == a);
+  CHECK(test_verify(ptr, 4000, 2));
+  test_heap_check(&heap, true, NULL);
+
+  /* Shrinks in place, the tail is given back */
+
+  ptr = s_realloc(a, 100, &heap);
+  CHECK(ptr == a);
+  CHECK(test_verify(ptr, 100, 2));
+  test_heap_check(&heap, true, NULL);
+
+  /* Moves when the neighbour is used */
+
+  test_fill(b, 5000, 3);
+  ptr = s_realloc(b, 20000, &heap);
+  CHECK(ptr != NULL && ptr != b);
+  CHECK(test_verify(ptr, 5000, 3));
+  test_heap_check(&heap, true, NULL);
+
+  s_free(ptr, &heap);
+  s_free(c, &heap);
+  s_free(a, &heap);
+  test_heap_check(&heap, true, NULL);
+  CHECK(s_realloc(NULL, 10, &heap) != NULL);
+
+  s_heap_destroy(&heap);
+  munmap(region, HEAP_SIZE);
+}
+
+int main(void)
+{
+  TEST_FOR_EACH_MODE(mode)
+  {
+    test_bump(mode);
+    test_realloc(mode);
+  }
+
+  printf("test_wild: ok\n");
+  return 0;
+}